@@ -0,0 +1,292 @@
+#include "bam.hpp"
+#include "fn_name.hpp"
+
+#include "btllib/status.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include <zlib.h>
+
+static const unsigned char BGZF_ID1 = 31;
+static const unsigned char BGZF_ID2 = 139;
+static const unsigned char BGZF_CM_DEFLATE = 8;
+static const unsigned char BGZF_FLG_EXTRA = 4;
+static const size_t BGZF_FIXED_HEADER_BYTES = 12;
+// CRC32 and ISIZE
+static const size_t BGZF_FOOTER_BYTES = 8;
+
+// BGZF blocks inflated per thread in each batch
+static const size_t BLOCKS_PER_THREAD = 16;
+
+static const char BAM_MAGIC[4] = { 'B', 'A', 'M', 1 };
+static const size_t BAM_RECORD_FIXED_BYTES = 32;
+
+// Bit n is set if CIGAR operation n consumes reference bases, i.e. M, D, N, =
+// and X, or query bases, i.e. M, I, S, = and X, or clips query bases, i.e. S
+// and H.
+static const uint32_t CIGAR_CONSUMES_REF = 0x18D;
+static const uint32_t CIGAR_CONSUMES_QUERY = 0x193;
+static const uint32_t CIGAR_CLIPS = 0x30;
+static const unsigned CIGAR_OP_BITS = 4;
+static const uint32_t CIGAR_OP_MASK = 0xF;
+
+// BAM and BGZF integers are little endian, regardless of the host.
+template<typename T>
+static T
+read_le(const char* bytes)
+{
+  std::make_unsigned_t<T> value = 0;
+  for (size_t i = 0; i < sizeof(T); i++) {
+    value |= decltype(value)(decltype(value)(
+                               static_cast<unsigned char>(bytes[i]))
+                             << (8 * i)); // NOLINT
+  }
+  return T(value);
+}
+
+void
+CigarSpans::add(const uint32_t len, const unsigned op)
+{
+  if (((CIGAR_CLIPS >> op) & 1U) != 0) {
+    (query_span == 0 && ref_span == 0 ? leading_clip : trailing_clip) += len;
+    return;
+  }
+  if (((CIGAR_CONSUMES_QUERY >> op) & 1U) != 0) {
+    query_span += len;
+  }
+  if (((CIGAR_CONSUMES_REF >> op) & 1U) != 0) {
+    ref_span += len;
+  }
+}
+
+BamReader::BamReader(const std::string& filepath, const unsigned threads)
+  : filepath(filepath)
+  , threads(std::max(threads, 1U))
+{
+  file = filepath == "-" ? stdin : std::fopen(filepath.c_str(), "rb");
+  btllib::check_error(file == nullptr,
+                      FN_NAME + ": fopen " + filepath + ": " +
+                        btllib::get_strerror());
+  read_header();
+}
+
+BamReader::~BamReader()
+{
+  if (file != nullptr && file != stdin) {
+    std::fclose(file);
+  }
+}
+
+// Read the next BGZF block, without inflating it. Returns false at the end of
+// the file.
+bool
+BamReader::read_block(std::string& block)
+{
+  block.resize(BGZF_FIXED_HEADER_BYTES);
+  const auto header_read =
+    std::fread(block.data(), 1, BGZF_FIXED_HEADER_BYTES, file);
+  if (header_read == 0) {
+    btllib::check_error(std::ferror(file) != 0,
+                        FN_NAME + ": fread " + filepath + ": " +
+                          btllib::get_strerror());
+    return false;
+  }
+  btllib::check_error(
+    header_read != BGZF_FIXED_HEADER_BYTES ||
+      static_cast<unsigned char>(block[0]) != BGZF_ID1 ||
+      static_cast<unsigned char>(block[1]) != BGZF_ID2 ||
+      static_cast<unsigned char>(block[2]) != BGZF_CM_DEFLATE ||
+      (static_cast<unsigned char>(block[3]) & BGZF_FLG_EXTRA) == 0,
+    FN_NAME + ": " + filepath + " is not a BGZF compressed BAM file.");
+
+  const auto extra_len = read_le<uint16_t>(block.data() + 10); // NOLINT
+  block.resize(BGZF_FIXED_HEADER_BYTES + extra_len);
+  btllib::check_error(
+    std::fread(block.data() + BGZF_FIXED_HEADER_BYTES, 1, extra_len, file) !=
+      extra_len,
+    FN_NAME + ": " + filepath + " is truncated.");
+
+  // The BC extra subfield holds the block size minus one
+  size_t block_size = 0;
+  for (size_t i = BGZF_FIXED_HEADER_BYTES; i + 4 <= block.size();) {
+    const auto subfield_len = read_le<uint16_t>(block.data() + i + 2);
+    if (block[i] == 'B' && block[i + 1] == 'C' && subfield_len == 2) {
+      block_size = size_t(read_le<uint16_t>(block.data() + i + 4)) + 1;
+      break;
+    }
+    i += 4 + subfield_len;
+  }
+  btllib::check_error(block_size < block.size() + BGZF_FOOTER_BYTES,
+                      FN_NAME + ": " + filepath +
+                        " has a BGZF block without a valid size.");
+
+  const auto header_len = block.size();
+  block.resize(block_size);
+  btllib::check_error(std::fread(block.data() + header_len,
+                                 1,
+                                 block_size - header_len,
+                                 file) != block_size - header_len,
+                      FN_NAME + ": " + filepath + " is truncated.");
+  return true;
+}
+
+// Inflate a batch of BGZF blocks and append them to data. Returns false at
+// the end of the file.
+bool
+BamReader::inflate_blocks()
+{
+  const size_t batch_size = threads * BLOCKS_PER_THREAD;
+  compressed_blocks.resize(batch_size);
+  inflated_blocks.resize(batch_size);
+  size_t block_num = 0;
+  while (block_num < batch_size && read_block(compressed_blocks[block_num])) {
+    block_num++;
+  }
+  if (block_num == 0) {
+    return false;
+  }
+
+  std::vector<char> failed(block_num, 0);
+#pragma omp parallel for num_threads(threads) schedule(dynamic)
+  for (size_t i = 0; i < block_num; i++) {
+    const auto& block = compressed_blocks[i];
+    auto& inflated = inflated_blocks[i];
+    const auto* const footer = block.data() + block.size() - BGZF_FOOTER_BYTES;
+    const auto header_len =
+      BGZF_FIXED_HEADER_BYTES + read_le<uint16_t>(block.data() + 10); // NOLINT
+    inflated.resize(read_le<uint32_t>(footer + 4));
+
+    z_stream stream{};
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+      failed[i] = 1;
+      continue;
+    }
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-const-cast)
+    stream.next_in = reinterpret_cast<Bytef*>(
+      const_cast<char*>(block.data() + header_len));
+    stream.avail_in = uInt(footer - block.data() - header_len);
+    stream.next_out = reinterpret_cast<Bytef*>(inflated.data());
+    stream.avail_out = uInt(inflated.size());
+    const auto ret = inflate(&stream, Z_FINISH);
+    inflateEnd(&stream);
+    if (ret != Z_STREAM_END || stream.avail_out != 0 ||
+        crc32(0, reinterpret_cast<const Bytef*>(inflated.data()),
+              uInt(inflated.size())) != read_le<uint32_t>(footer)) {
+      failed[i] = 1;
+    }
+  }
+  btllib::check_error(std::any_of(failed.begin(),
+                                  failed.end(),
+                                  [](const char f) { return f != 0; }),
+                      FN_NAME + ": " + filepath +
+                        " has a corrupt BGZF block.");
+
+  for (size_t i = 0; i < block_num; i++) {
+    data += inflated_blocks[i];
+  }
+  return true;
+}
+
+// Make sure that at least bytes of inflated data follow pos. Returns false if
+// the file ends first.
+bool
+BamReader::fill(const size_t bytes)
+{
+  while (data.size() - pos < bytes) {
+    if (!inflate_blocks()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void
+BamReader::read_header()
+{
+  const auto truncated = FN_NAME + ": " + filepath + " has a truncated header.";
+
+  btllib::check_error(!fill(sizeof(BAM_MAGIC)) ||
+                        std::memcmp(data.data(), BAM_MAGIC, sizeof(BAM_MAGIC)) !=
+                          0,
+                      FN_NAME + ": " + filepath + " is not a BAM file.");
+  pos += sizeof(BAM_MAGIC);
+
+  btllib::check_error(!fill(4), truncated);
+  const auto text_len = read_le<uint32_t>(data.data() + pos);
+  pos += 4;
+  btllib::check_error(!fill(size_t(text_len) + 4), truncated);
+  pos += text_len;
+
+  const auto ref_num = read_le<uint32_t>(data.data() + pos);
+  pos += 4;
+  ref_names.reserve(ref_num);
+  for (uint32_t i = 0; i < ref_num; i++) {
+    btllib::check_error(!fill(4), truncated);
+    const auto name_len = read_le<uint32_t>(data.data() + pos);
+    pos += 4;
+    btllib::check_error(name_len == 0 || !fill(size_t(name_len) + 4), truncated);
+    // The name is NUL terminated and followed by the reference length
+    ref_names.emplace_back(data.data() + pos, name_len - 1);
+    pos += name_len + 4;
+  }
+}
+
+bool
+BamReader::read_records(std::vector<BamRecord>& records)
+{
+  records.clear();
+  data.erase(0, pos);
+  pos = 0;
+  const auto more = inflate_blocks();
+
+  while (data.size() - pos >= 4) {
+    const auto record_len = read_le<uint32_t>(data.data() + pos);
+    if (data.size() - pos - 4 < record_len) {
+      break;
+    }
+    const auto* const record = data.data() + pos + 4;
+    const auto name_len = static_cast<unsigned char>(record[8]);
+    const auto cigar_ops = read_le<uint16_t>(record + 12);
+    btllib::check_error(
+      record_len < BAM_RECORD_FIXED_BYTES + name_len + 4 * cigar_ops ||
+        name_len == 0,
+      FN_NAME + ": " + filepath + " has an invalid record.");
+
+    CigarSpans spans;
+    const auto* const cigar = record + BAM_RECORD_FIXED_BYTES + name_len;
+    for (unsigned i = 0; i < cigar_ops; i++) {
+      const auto op = read_le<uint32_t>(cigar + 4 * i);
+      if ((op & CIGAR_OP_MASK) < CigarSpans::CIGAR_OPS.size()) {
+        spans.add(op >> CIGAR_OP_BITS, op & CIGAR_OP_MASK);
+      }
+    }
+
+    const auto flag = read_le<uint16_t>(record + 14); // NOLINT
+    const auto query_start = spans.query_start((flag & BAM_FLAG_REVERSE) != 0);
+    records.push_back(BamRecord{
+      std::string_view(record + BAM_RECORD_FIXED_BYTES, name_len - 1),
+      read_le<int32_t>(record),
+      read_le<int32_t>(record + 4),
+      flag,
+      static_cast<uint8_t>(record[9]),
+      spans.ref_span,
+      cigar_ops > 0 ? query_start : 0,
+      cigar_ops > 0 ? query_start + spans.query_span : UINT32_MAX });
+    pos += 4 + record_len;
+  }
+
+  if (!more) {
+    btllib::check_error(pos != data.size(),
+                        FN_NAME + ": " + filepath +
+                          " ends with a truncated record.");
+    return !records.empty();
+  }
+  return true;
+}
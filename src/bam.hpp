@@ -0,0 +1,94 @@
+#ifndef BAM_HPP
+#define BAM_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+
+static const uint16_t BAM_FLAG_REVERSE = 0x10;
+static const uint16_t BAM_FLAG_SECONDARY = 0x100;
+static const uint16_t BAM_FLAG_SUPPLEMENTARY = 0x800;
+
+// Lengths covered by a CIGAR, accumulated one operation at a time. Operations
+// are given by their BAM code, i.e. their index in CIGAR_OPS.
+struct CigarSpans
+{
+  static constexpr std::string_view CIGAR_OPS = "MIDNSHP=X";
+
+  // Clipped query bases before and after the aligned ones
+  uint32_t leading_clip = 0;
+  uint32_t trailing_clip = 0;
+  // Query and reference bases covered by the alignment
+  uint32_t query_span = 0;
+  uint32_t ref_span = 0;
+
+  void add(uint32_t len, unsigned op);
+
+  // Start of the aligned query bases, counted on the original query sequence,
+  // which is reverse complemented in reverse strand alignments.
+  uint32_t query_start(bool reverse) const
+  {
+    return reverse ? trailing_clip : leading_clip;
+  }
+};
+
+// Alignment record fields needed for mappings. The sequence, qualities and
+// tags are not decoded.
+struct BamRecord
+{
+  // Points into the reader's buffer, valid until the next read_records call
+  std::string_view name;
+  int32_t ref_id;
+  int32_t pos;
+  uint16_t flag;
+  uint8_t mapq;
+  // Number of reference bases covered by the CIGAR
+  uint32_t ref_span;
+  // Aligned part of the original query sequence, [query_start, query_end), or
+  // [0, UINT32_MAX) if the record has no CIGAR
+  uint32_t query_start;
+  uint32_t query_end;
+};
+
+// Sequential BAM reader, of stdin if filepath is "-". The BGZF blocks of the
+// file are read in batches and each batch is inflated in parallel.
+class BamReader
+{
+
+public:
+  BamReader(const std::string& filepath, unsigned threads);
+  ~BamReader();
+
+  BamReader(const BamReader&) = delete;
+  BamReader& operator=(const BamReader&) = delete;
+
+  // Reference names from the header, indexed by BamRecord::ref_id.
+  const std::vector<std::string>& get_ref_names() const { return ref_names; }
+
+  // Replace records with the next batch of records. Returns false once there
+  // are no records left.
+  bool read_records(std::vector<BamRecord>& records);
+
+private:
+  bool read_block(std::string& block);
+  bool inflate_blocks();
+  bool fill(size_t bytes);
+  void read_header();
+
+  std::string filepath;
+  unsigned threads;
+  std::FILE* file = nullptr;
+
+  std::vector<std::string> compressed_blocks;
+  std::vector<std::string> inflated_blocks;
+
+  // Inflated data not yet decoded starts at data[pos]
+  std::string data;
+  size_t pos = 0;
+
+  std::vector<std::string> ref_names;
+};
+
+#endif
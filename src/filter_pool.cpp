@@ -0,0 +1,328 @@
+#include "filter_pool.hpp"
+#include "fn_name.hpp"
+
+#include "btllib/status.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <omp.h>
+
+FilterPool::Buffer::Buffer(FilterPool* const pool,
+                           std::unique_ptr<uint8_t[]> memory,
+                           const size_t bytes)
+  : pool(pool)
+  , memory(std::move(memory))
+  , bytes(bytes)
+{
+}
+
+FilterPool::Buffer::~Buffer()
+{
+  release();
+}
+
+FilterPool::Buffer::Buffer(Buffer&& other) noexcept
+  : pool(other.pool)
+  , memory(std::move(other.memory))
+  , bytes(other.bytes)
+{
+  other.pool = nullptr;
+  other.bytes = 0;
+}
+
+FilterPool::Buffer&
+FilterPool::Buffer::operator=(Buffer&& other) noexcept
+{
+  if (this != &other) {
+    release();
+    pool = other.pool;
+    memory = std::move(other.memory);
+    bytes = other.bytes;
+    other.pool = nullptr;
+    other.bytes = 0;
+  }
+  return *this;
+}
+
+void
+FilterPool::Buffer::release()
+{
+  if (pool != nullptr && memory) {
+    pool->release(std::move(memory), bytes);
+  }
+  pool = nullptr;
+  bytes = 0;
+}
+
+FilterPool::FilterPool(const size_t max_bytes)
+  : max_bytes(max_bytes)
+  , free_lists(size_t(std::max(omp_get_max_threads(), 1)))
+{
+}
+
+size_t
+FilterPool::size_class(const size_t bytes)
+{
+  size_t step = 1;
+  while (step * 8 < bytes) {
+    step <<= 1U;
+  }
+  return (bytes + step - 1) / step * step;
+}
+
+size_t
+FilterPool::own_free_list() const
+{
+  return size_t(omp_get_thread_num()) % free_lists.size();
+}
+
+std::vector<FilterPool::Buffer>
+FilterPool::acquire(const size_t bytes, const size_t count)
+{
+  const auto size = size_class(bytes);
+  const auto own = own_free_list();
+  // Free lists in the order they are taken from, the calling thread's first
+  const auto free_list = [&](const size_t i) -> FreeList& {
+    return free_lists[(own + i) % free_lists.size()];
+  };
+
+  std::unique_lock<std::mutex> lock(mutex);
+  for (;;) {
+    size_t kept_of_size = 0;
+    for (auto& list : free_lists) {
+      kept_of_size += list[size].size();
+    }
+    const auto reused = std::min(count, kept_of_size);
+    const auto needed_bytes = (count - reused) * size;
+
+    // Kept buffers of other sizes are freed to make room for new ones. Without
+    // a bound, they all are, so kept buffers don't pile up in unused sizes.
+    const auto over_budget = [&]() {
+      return needed_bytes > 0 &&
+             (max_bytes == 0 ||
+              in_use_bytes + kept_bytes + needed_bytes > max_bytes);
+    };
+    for (size_t i = free_lists.size(); i > 0 && over_budget(); i--) {
+      auto& list = free_list(i - 1);
+      for (auto it = list.begin(); over_budget() && it != list.end(); ++it) {
+        if (it->first == size) {
+          continue;
+        }
+        while (!it->second.empty() && over_budget()) {
+          it->second.pop_back();
+          kept_bytes -= it->first;
+        }
+      }
+    }
+
+    if (max_bytes == 0 || in_use_bytes == 0 ||
+        in_use_bytes + kept_bytes + needed_bytes <= max_bytes) {
+      std::vector<Buffer> buffers;
+      buffers.reserve(count);
+      for (size_t i = 0; buffers.size() < reused; i++) {
+        auto& list_of_size = free_list(i)[size];
+        while (!list_of_size.empty() && buffers.size() < reused) {
+          buffers.push_back(
+            Buffer(this, std::move(list_of_size.back()), size));
+          list_of_size.pop_back();
+        }
+      }
+      kept_bytes -= reused * size;
+      in_use_bytes += count * size;
+      lock.unlock();
+
+      for (size_t i = reused; i < count; i++) {
+        std::unique_ptr<uint8_t[]> memory(new uint8_t[size]()); // NOLINT
+        buffers.push_back(Buffer(this, std::move(memory), size));
+      }
+      return buffers;
+    }
+    released.wait(lock);
+  }
+}
+
+void
+FilterPool::release(std::unique_ptr<uint8_t[]> memory, const size_t bytes)
+{
+  std::memset(memory.get(), 0, bytes);
+  const auto own = own_free_list();
+  const std::unique_lock<std::mutex> lock(mutex);
+  in_use_bytes -= bytes;
+  free_lists[own][bytes].push_back(std::move(memory));
+  kept_bytes += bytes;
+  released.notify_all();
+}
+
+MemoryBudget::Admission::Admission(MemoryBudget* const budget,
+                                   const size_t bytes,
+                                   const double delay)
+  : budget(budget)
+  , bytes(bytes)
+  , delay(delay)
+{
+}
+
+MemoryBudget::Admission::~Admission()
+{
+  release();
+}
+
+MemoryBudget::Admission::Admission(Admission&& other) noexcept
+  : budget(other.budget)
+  , bytes(other.bytes)
+  , delay(other.delay)
+{
+  other.budget = nullptr;
+  other.bytes = 0;
+}
+
+MemoryBudget::Admission&
+MemoryBudget::Admission::operator=(Admission&& other) noexcept
+{
+  if (this != &other) {
+    release();
+    budget = other.budget;
+    bytes = other.bytes;
+    delay = other.delay;
+    other.budget = nullptr;
+    other.bytes = 0;
+  }
+  return *this;
+}
+
+void
+MemoryBudget::Admission::release()
+{
+  if (budget != nullptr) {
+    budget->release(bytes);
+  }
+  budget = nullptr;
+  bytes = 0;
+}
+
+MemoryBudget::MemoryBudget(const size_t max_bytes)
+  : max_bytes(max_bytes)
+{
+}
+
+bool
+MemoryBudget::has_room() const
+{
+  return max_bytes == 0 || admitted_batches == 0 || admitted_bytes < max_bytes;
+}
+
+bool
+MemoryBudget::fits(const size_t bytes) const
+{
+  return max_bytes == 0 || admitted_batches == 0 ||
+         admitted_bytes + bytes <= max_bytes;
+}
+
+bool
+MemoryBudget::wait_for_room(const std::chrono::milliseconds timeout)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  return changed.wait_for(lock, timeout, [&]() { return has_room(); });
+}
+
+bool
+MemoryBudget::wait_to_fit(const size_t bytes,
+                          const std::chrono::milliseconds timeout)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  return changed.wait_for(lock, timeout, [&]() { return fits(bytes); });
+}
+
+void
+MemoryBudget::add_hold_off(const double seconds)
+{
+  const std::unique_lock<std::mutex> lock(mutex);
+  hold_off += seconds;
+}
+
+MemoryBudget::Admission
+MemoryBudget::admit(const size_t bytes, const double delay)
+{
+  const std::unique_lock<std::mutex> lock(mutex);
+  if (delay > 0) {
+    delayed_batches++;
+    total_delay += delay;
+    max_delay = std::max(max_delay, delay);
+  }
+  batches++;
+  admitted_bytes += bytes;
+  admitted_batches++;
+  return Admission(this, bytes, delay);
+}
+
+void
+MemoryBudget::release(const size_t bytes)
+{
+  const std::unique_lock<std::mutex> lock(mutex);
+  admitted_bytes -= bytes;
+  admitted_batches--;
+  changed.notify_all();
+}
+
+void
+MemoryBudget::log_delays() const
+{
+  const std::unique_lock<std::mutex> lock(mutex);
+  btllib::log_info(
+    FN_NAME + ": " + std::to_string(delayed_batches) + " of " +
+    std::to_string(batches) + " batches waited for filter memory, " +
+    std::to_string(total_delay) + " s in total and " +
+    std::to_string(max_delay) + " s at most. New batches were held off for " +
+    std::to_string(hold_off) + " s.");
+}
+
+PooledCountingBloomFilter::PooledCountingBloomFilter(FilterPool::Buffer buffer,
+                                                     const size_t bytes,
+                                                     const unsigned hash_num)
+  : buffer(std::move(buffer))
+  , counters_num(bytes_for(bytes))
+  , mask((counters_num & (counters_num - 1)) == 0 ? counters_num - 1 : 0)
+  , hash_num(hash_num)
+{
+  btllib::check_error(counters_num == 0 || this->buffer.size() < counters_num,
+                      FN_NAME + ": Buffer is smaller than the filter.");
+}
+
+void
+PooledCountingBloomFilter::merge(const PooledCountingBloomFilter& other)
+{
+  btllib::check_error(other.counters_num != counters_num ||
+                        other.hash_num != hash_num,
+                      FN_NAME + ": Filters differ in size or hash number.");
+  auto* const counters = buffer.data();
+  const auto* const other_counters = other.buffer.data();
+  for (size_t i = 0; i < counters_num; i++) {
+    counters[i] =
+      uint8_t(std::min(counters[i] + other_counters[i], int(UINT8_MAX)));
+  }
+}
+
+PooledKmerCountTable::PooledKmerCountTable(FilterPool::Buffer buffer)
+  : buffer(std::move(buffer))
+  , mask(this->buffer.size() / sizeof(uint64_t) - 1)
+  , max_keys(mask + 1 - (mask + 1) / 4)
+{
+  btllib::check_error(this->buffer.size() < sizeof(uint64_t) ||
+                        (this->buffer.size() & (this->buffer.size() - 1)) != 0,
+                      FN_NAME + ": Buffer size is not a power of 2.");
+}
+
+void
+PooledKmerCountTable::add_key()
+{
+  // Probe sequences stay short as long as the table is at most 3/4 full
+  btllib::check_error(++keys > max_keys,
+                      FN_NAME + ": More k-mers than the table was sized for.");
+}
@@ -0,0 +1,352 @@
+#ifndef FILTER_POOL_HPP
+#define FILTER_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Zeroed filter buffers shared by the batches of the builder. Buffers come in
+// size classes and are cleared and kept when a batch is done with them, so
+// later batches reuse them instead of allocating and faulting in new ones.
+// Each thread keeps the buffers it released in a free list of its own and
+// takes from it first, so it reuses memory it cleared last, which is in its
+// caches and on its NUMA node. Other threads' buffers are taken next.
+// Only the counting filters are pooled, so a bound on the pool doesn't cover
+// the presence filters.
+class FilterPool
+{
+
+public:
+  // A buffer handed out by the pool, which returns to it when destroyed.
+  class Buffer
+  {
+
+  public:
+    Buffer() = default;
+    ~Buffer();
+
+    Buffer(const Buffer&) = delete;
+    Buffer& operator=(const Buffer&) = delete;
+
+    Buffer(Buffer&& other) noexcept;
+    Buffer& operator=(Buffer&& other) noexcept;
+
+    uint8_t* data() const { return memory.get(); }
+    size_t size() const { return bytes; }
+
+  private:
+    friend class FilterPool;
+
+    Buffer(FilterPool* pool, std::unique_ptr<uint8_t[]> memory, size_t bytes);
+    void release();
+
+    FilterPool* pool = nullptr;
+    std::unique_ptr<uint8_t[]> memory;
+    size_t bytes = 0;
+  };
+
+  // Buffers in use and kept take at most max_bytes, or are unbounded if
+  // max_bytes is 0. A single request larger than that is still served once
+  // no other buffers are in use. There is a free list for each of the OpenMP
+  // threads at the time of construction.
+  explicit FilterPool(size_t max_bytes = 0);
+
+  FilterPool(const FilterPool&) = delete;
+  FilterPool& operator=(const FilterPool&) = delete;
+
+  // Smallest size class of at least bytes. Classes are 5, 6, 7 or 8 times a
+  // power of 2, so buffers are less than 25% larger than requested, and
+  // powers of 2 are classes of their own.
+  static size_t size_class(size_t bytes);
+
+  // Get count buffers of size_class(bytes) bytes, waiting for other batches
+  // to release theirs if they don't fit. They are acquired together, so that
+  // batches waiting for memory don't hold on to part of it.
+  std::vector<Buffer> acquire(size_t bytes, size_t count);
+
+private:
+  using FreeList = std::map<size_t, std::vector<std::unique_ptr<uint8_t[]>>>;
+
+  void release(std::unique_ptr<uint8_t[]> memory, size_t bytes);
+  // Free list of the calling thread
+  size_t own_free_list() const;
+
+  const size_t max_bytes;
+
+  std::mutex mutex;
+  std::condition_variable released;
+  // Cleared buffers not in use, by thread and size class
+  std::vector<FreeList> free_lists;
+  size_t kept_bytes = 0;
+  size_t in_use_bytes = 0;
+};
+
+// Budget of the filter memory of the batches being built. A batch is admitted
+// once the memory it is projected to take fits next to that of the admitted
+// batches, or once no other batch is admitted, so a batch larger than the
+// budget still runs on its own. The server waits to admit each batch before
+// starting its task, and holds off new batches while the budget is used up.
+// Time spent waiting is kept as queueing delay.
+class MemoryBudget
+{
+
+public:
+  // The share of the budget of an admitted batch, which returns to the budget
+  // when destroyed.
+  class Admission
+  {
+
+  public:
+    Admission() = default;
+    ~Admission();
+
+    Admission(const Admission&) = delete;
+    Admission& operator=(const Admission&) = delete;
+
+    Admission(Admission&& other) noexcept;
+    Admission& operator=(Admission&& other) noexcept;
+
+    // Seconds the batch waited to be admitted
+    double get_delay() const { return delay; }
+
+  private:
+    friend class MemoryBudget;
+
+    Admission(MemoryBudget* budget, size_t bytes, double delay);
+    void release();
+
+    MemoryBudget* budget = nullptr;
+    size_t bytes = 0;
+    double delay = 0;
+  };
+
+  // A max_bytes of 0 admits every batch right away.
+  explicit MemoryBudget(size_t max_bytes = 0);
+
+  MemoryBudget(const MemoryBudget&) = delete;
+  MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+  size_t get_max_bytes() const { return max_bytes; }
+
+  // Wait up to timeout until a new batch can be taken, i.e. the admitted
+  // batches leave some of the budget free. Returns whether one can.
+  bool wait_for_room(std::chrono::milliseconds timeout);
+
+  // Wait up to timeout until a batch taking bytes can be admitted. Returns
+  // whether it can.
+  bool wait_to_fit(size_t bytes, std::chrono::milliseconds timeout);
+
+  // Record time the server spent holding off new batches.
+  void add_hold_off(double seconds);
+
+  // Admit a batch taking bytes, once wait_to_fit allows it, after waiting
+  // delay seconds for it to.
+  Admission admit(size_t bytes, double delay);
+
+  // Log how many batches waited for admission, how long, and how long new
+  // batches were held off.
+  void log_delays() const;
+
+private:
+  void release(size_t bytes);
+  bool has_room() const;
+  bool fits(size_t bytes) const;
+
+  const size_t max_bytes;
+
+  mutable std::mutex mutex;
+  std::condition_variable changed;
+  size_t admitted_bytes = 0;
+  size_t admitted_batches = 0;
+
+  // Queueing delays
+  size_t batches = 0;
+  size_t delayed_batches = 0;
+  double total_delay = 0;
+  double max_delay = 0;
+  double hold_off = 0;
+};
+
+// Counting Bloom filter of 8-bit saturating counters in a pooled buffer,
+// used to find the k-mers seen often enough to go into the saved filters.
+// Like btllib's counting filters, it rounds its size up to a multiple of 8
+// bytes and indexes its counters by the hashes modulo their number, so a
+// filter of a given size counts the same way.
+class PooledCountingBloomFilter
+{
+
+public:
+  // The filter takes the first bytes_for(bytes) counters of the buffer, which
+  // must be at least that large.
+  PooledCountingBloomFilter(FilterPool::Buffer buffer,
+                            size_t bytes,
+                            unsigned hash_num);
+
+  // Buffer bytes of a filter of the given size
+  static size_t bytes_for(const size_t bytes)
+  {
+    return (bytes + sizeof(uint64_t) - 1) / sizeof(uint64_t) *
+           sizeof(uint64_t);
+  }
+
+  // Increment the count of the k-mer with the given hashes, unless it is at
+  // least threshold already, and return its new count. Only the counters at
+  // the minimum are incremented, which keeps overestimates low.
+  uint8_t insert_thresh_contains(const uint64_t* hashes, uint8_t threshold)
+  {
+    auto* const counters = buffer.data();
+    const auto count = contains(hashes);
+    if (count >= threshold || count == UINT8_MAX) {
+      return count;
+    }
+    for (unsigned i = 0; i < hash_num; i++) {
+      auto& counter = counters[index(hashes[i])];
+      if (counter == count) {
+        counter = count + 1;
+      }
+    }
+    return count + 1;
+  }
+
+  // Count of the k-mer with the given hashes
+  uint8_t contains(const uint64_t* hashes) const
+  {
+    const auto* const counters = buffer.data();
+    uint8_t count = UINT8_MAX;
+    for (unsigned i = 0; i < hash_num; i++) {
+      count = std::min(count, counters[index(hashes[i])]);
+    }
+    return count;
+  }
+
+  // Add the counters of a filter of the same size and number of hashes to
+  // this one's, saturating at UINT8_MAX. The summed count of a k-mer is at
+  // least the sum of its counts in both filters.
+  void merge(const PooledCountingBloomFilter& other);
+
+private:
+  // Sizes that are powers of 2 take a mask instead of the slower modulo
+  size_t index(const uint64_t hash) const
+  {
+    return mask != 0 ? hash & mask : hash % counters_num;
+  }
+
+  FilterPool::Buffer buffer;
+  size_t counters_num;
+  uint64_t mask;
+  unsigned hash_num;
+};
+
+// Exact counts of k-mers, keyed by their canonical hash, in an open
+// addressing table in a pooled buffer. Each slot holds the high 56 bits of a
+// hash and an 8-bit saturating count in the low bits, and is 0 while empty.
+// Unlike the counting Bloom filter, a k-mer's count never includes other
+// k-mers, so erroneous k-mers aren't promoted along with solid ones.
+class PooledKmerCountTable
+{
+
+public:
+  // The buffer size must be a power of 2, and at least bytes_for the number
+  // of k-mers to be counted.
+  explicit PooledKmerCountTable(FilterPool::Buffer buffer);
+
+  // Buffer bytes, a power of 2, to count up to kmers distinct k-mers
+  static size_t bytes_for(size_t kmers)
+  {
+    const auto slots = std::max<size_t>(kmers + (kmers + 2) / 3, 1);
+    size_t bytes = sizeof(uint64_t);
+    while (bytes < slots * sizeof(uint64_t)) {
+      bytes <<= 1U;
+    }
+    return bytes;
+  }
+
+  // Same as PooledCountingBloomFilter::insert_thresh_contains, for the
+  // k-mer with canonical hash hashes[0]. Slots are updated atomically and
+  // the counts are exact, so k-mers can be inserted from several threads in
+  // any order and reach the threshold the same as in serial.
+  uint8_t insert_thresh_contains(const uint64_t* hashes, uint8_t threshold)
+  {
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+    auto* const slots = reinterpret_cast<uint64_t*>(buffer.data());
+    const auto key = hashes[0] & ~COUNT_MASK;
+    for (auto i = mix(hashes[0]) & mask;; i = (i + 1) & mask) {
+      auto& slot = slots[i];
+      auto value = __atomic_load_n(&slot, __ATOMIC_RELAXED);
+      if (value == 0) {
+        if (__atomic_compare_exchange_n(&slot,
+                                        &value,
+                                        key | 1U,
+                                        false,
+                                        __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+          add_key();
+          return 1;
+        }
+        // Another thread took the slot, whose key is now in value
+      }
+      while ((value & ~COUNT_MASK) == key) {
+        const auto count = uint8_t(value & COUNT_MASK);
+        if (count >= threshold || count == UINT8_MAX) {
+          return count;
+        }
+        if (__atomic_compare_exchange_n(&slot,
+                                        &value,
+                                        value + 1,
+                                        false,
+                                        __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+          return count + 1;
+        }
+      }
+    }
+  }
+
+  // Count of the k-mer with canonical hash hashes[0]. Must not be called
+  // while k-mers are being inserted.
+  uint8_t contains(const uint64_t* hashes) const
+  {
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+    const auto* const slots = reinterpret_cast<const uint64_t*>(buffer.data());
+    const auto key = hashes[0] & ~COUNT_MASK;
+    for (auto i = mix(hashes[0]) & mask;; i = (i + 1) & mask) {
+      const auto value = slots[i];
+      if (value == 0) {
+        return 0;
+      }
+      if ((value & ~COUNT_MASK) == key) {
+        return uint8_t(value & COUNT_MASK);
+      }
+    }
+  }
+
+private:
+  static const uint64_t COUNT_MASK = 0xFF;
+  static const unsigned MIX_SHIFT = 33;
+  static const uint64_t MIX_MULTIPLIER = 0xff51afd7ed558ccdULL;
+
+  // ntHash values are rotated and xored, so their bits are mixed before
+  // picking slots, which keeps probe sequences short
+  static uint64_t mix(uint64_t hash)
+  {
+    hash ^= hash >> MIX_SHIFT;
+    hash *= MIX_MULTIPLIER;
+    return hash ^ (hash >> MIX_SHIFT);
+  }
+
+  void add_key();
+
+  FilterPool::Buffer buffer;
+  uint64_t mask;
+  std::atomic<size_t> keys{ 0 };
+  size_t max_keys;
+};
+
+#endif
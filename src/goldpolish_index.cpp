@@ -1,18 +1,43 @@
 #include "seqindex.hpp"
 
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include <unistd.h>
+
 int
 main(int argc, char** argv)
 {
-  if (argc != 3) {
+  unsigned threads = 1;
+  bool packed = false;
+  int opt = 0;
+  while ((opt = getopt(argc, argv, "t:p")) != -1) {
+    switch (opt) {
+      case 't':
+        threads = std::stoul(optarg);
+        break;
+      case 'p':
+        packed = true;
+        break;
+      default:
+        std::cerr << "Usage: goldpolish-index [-t threads] [-p] seqs index\n";
+        std::exit(EXIT_FAILURE); // NOLINT(concurrency-mt-unsafe)
+    }
+  }
+  if (argc - optind != 2 || threads == 0) {
     std::cerr << "Wrong args.\n";
     std::exit(EXIT_FAILURE); // NOLINT(concurrency-mt-unsafe)
   }
-  unsigned arg = 1;
+  int arg = optind;
   auto* const seqs_filepath = argv[arg++];
   auto* const index_filepath = argv[arg++];
 
-  SeqIndex index(seqs_filepath);
+  SeqIndex index(seqs_filepath, threads);
   index.save(index_filepath);
+  if (packed) {
+    index.save_packed(index_filepath, threads);
+  }
 
   return 0;
-}
\ No newline at end of file
+}
@@ -1,13 +1,19 @@
+#include "bam.hpp"
+#include "filter_pool.hpp"
 #include "mappings.hpp"
 #include "seqindex.hpp"
 #include "utils.hpp"
 
 #include "btllib/bloom_filter.hpp"
-#include "btllib/counting_bloom_filter.hpp"
 #include "btllib/status.hpp"
 #include "btllib/util.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
 #include <chrono>
+#include <climits>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
@@ -15,7 +21,10 @@
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <type_traits>
 #include <unordered_map>
@@ -27,12 +36,49 @@
 #include <omp.h>
 #endif
 
+#include <getopt.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 static const unsigned MX_THRESHOLD_MIN = 1;
 static const unsigned MX_THRESHOLD_MAX = 30;
+// Bases around the aligned part of mapped sequences that are also inserted.
+// Whole mapped sequences are inserted unless --padding is given.
+static const uint32_t DEFAULT_PADDING = UINT32_MAX;
+// Windows of targets also take the mappings this many bases around them, so
+// the filters of neighbouring windows overlap
+static const size_t DEFAULT_WINDOW_OVERLAP = 1000;
+// Minimizer parameters of the built-in mapper, the same as goldpolish's ntLink
+// defaults
+static const unsigned DEFAULT_MAP_K = 88;
+static const unsigned DEFAULT_MAP_W = 1000;
+// Fixed filter sizes and hash number, used unless filters are auto-sized
+static const size_t DEFAULT_CBF_BYTES = 10ULL * 1024ULL * 1024ULL;
+static const size_t DEFAULT_BF_BYTES = 512ULL * 1024ULL;
+static const unsigned DEFAULT_HASH_NUM = 4;
+// Auto-sized filters are sized for this false positive rate by default
+static const double DEFAULT_FPR = 0.05;
+// Bounds of the size of each auto-sized filter
+static const size_t MIN_FILTER_BYTES = 4096;
+static const size_t DEFAULT_MAX_FILTER_BYTES = 256ULL * 1024ULL * 1024ULL;
+// Highest k-mer threshold picked from the mapped bases or from a histogram
+static const unsigned MAX_KMER_THRESHOLD = 13;
+// K-mer count histograms are sampled from about this many k-mers of each k
+// value per batch
+static const size_t HISTOGRAM_SAMPLED_KMERS = 1ULL << 20U;
+// Lowest threshold picked from a histogram
+static const unsigned HISTOGRAM_MIN_THRESHOLD = 2;
+// Histograms bin the counts above this together. The peak of the target's
+// k-mers is looked for below it, so it can be well above the threshold.
+static const unsigned HISTOGRAM_MAX_COUNT = 255;
+// The peak of the target's k-mers is at least this many sampled k-mers and
+// this many times the valley before it
+static const double HISTOGRAM_MIN_PEAK_KMERS = 30;
+static const double HISTOGRAM_MIN_PEAK_TO_VALLEY = 2;
+// Batches with at least this many mapped bases fill their filters in parallel
+static const size_t PARALLEL_BATCH_MAPPINGS_BASES = 10'000'000;
 static const std::string BATCH_NAME_INPUT_PIPE = "batch_name_input";
 static const std::string BATCH_TARGET_IDS_INPUT_READY_PIPE =
   "batch_target_ids_input_ready";
@@ -41,125 +87,943 @@ static const std::string BFS_READY_PIPE = "bfs_ready";
 static const std::string SEPARATOR = "-";
 static const std::string BF_EXTENSION = ".bf";
 static const std::string END_SYMBOL = "x";
+// Replaces the filter paths in the reply to a malformed request, followed by
+// what is wrong with it
+static const std::string ERROR_REPLY = "error:";
+// Precedes the filter names in a reply whose filters are passed as
+// descriptors of memory files, in the same order
+static const std::string MEMORY_FILES_REPLY = "fd:";
+// Opens a descriptor's file, e.g. for btllib to save a filter to it
+static const std::string FD_PATH_PREFIX = "/dev/fd/";
+// Printed to stdout once the socket server accepts requests
+static const std::string SOCKET_READY = "ready";
+static const size_t SOCKET_READ_BYTES = 65536;
+// How often the server checks for room in the memory budget while holding off
+// new batches
+static const std::chrono::milliseconds HOLD_OFF_POLL_INTERVAL(10);
+
+// How k-mers are counted before the solid ones go into the saved filters
+enum class KmerCounterBackend
+{
+  COUNTING_BLOOM_FILTER,
+  EXACT
+};
+
+// Sizes of the filters of a batch and how they are filled. Zero sizes and
+// hash number are picked for each batch, from its expected number of k-mers
+// and the false positive rate. They are only zero if filters are auto-sized.
+struct FilterParams
+{
+  size_t cbf_bytes = 0;
+  size_t bf_bytes = 0;
+  unsigned hash_num = 0;
+  double fpr = DEFAULT_FPR;
+  size_t max_bytes = DEFAULT_MAX_FILTER_BYTES;
+  KmerCounterBackend counter = KmerCounterBackend::COUNTING_BLOOM_FILTER;
+  // Also fill the filters with the other counter, and log how both did
+  bool benchmark_counters = false;
+  // K-mers with bases of lower phred quality than this aren't inserted
+  unsigned min_base_quality = 0;
+  // Pick each k value's k-mer threshold from a histogram of the batch's
+  // sampled k-mer counts, or from the number of mapped bases if it doesn't
+  // have a clear valley
+  bool histogram_thresholds = false;
+  size_t window_overlap = DEFAULT_WINDOW_OVERLAP;
+};
+
+// A target of a batch, or the window [start, end) of it. Long targets can be
+// split into windows that get filters of their own, filled from the reads
+// mapped to each window.
+struct BatchTarget
+{
+  SeqId id;
+  size_t start, end;
+};
+
+// Counters, or bits, of a Bloom filter of elements with the given false
+// positive rate, using the optimal number of hashes
+static size_t
+optimal_filter_counters(const size_t elements, const double fpr)
+{
+  return size_t(
+    std::ceil(-double(elements) * std::log(fpr) / (M_LN2 * M_LN2)));
+}
+
+static unsigned
+optimal_hash_num(const double fpr)
+{
+  return unsigned(std::max(1.0, std::round(-std::log2(fpr))));
+}
+
+// Copy seq into masked with the bases of lower quality than min_quality
+// replaced by N, which the hashing skips the k-mers of.
+static std::string_view
+mask_low_quality(const std::string_view seq,
+                 const std::string_view qual,
+                 const unsigned min_quality,
+                 std::string& masked)
+{
+  masked.assign(seq);
+  for (size_t i = 0; i < masked.size(); i++) {
+    if (static_cast<unsigned char>(qual[i]) < PHRED_OFFSET + min_quality) {
+      masked[i] = 'N';
+    }
+  }
+  return masked;
+}
 
 int
 mappings_bases_to_kmer_threshold(const unsigned long mappings_bases)
 {
   static const double a = 4.66943;
   static const double b = 2.11391e-07;
-  static const int max_kmer_threshold = 13;
   const int kmer_threshold = int(std::round(a + double(mappings_bases) * b));
-  return std::min(kmer_threshold, max_kmer_threshold);
+  return std::min(kmer_threshold, int(MAX_KMER_THRESHOLD));
 }
 
-void
-serve_batch(const SeqIndex& target_seqs_index,
-            const SeqIndex& mapped_seqs_index,
-            const AllMappings& all_mappings,
-            const size_t cbf_bytes,
-            const size_t bf_bytes,
-            const std::string& batch_name,
-            const std::string& target_ids_input_pipe,
-            const std::string& bfs_ready_pipe,
-            const std::vector<std::string>& bf_names, // NOLINT
-            const unsigned hash_num,
-            const std::vector<unsigned>& k_values, // NOLINT
-            const double subsample_max_mapped_seqs_per_target_10kbp)
-{
-  // Initialize Bloom filters
-  std::vector<std::unique_ptr<btllib::KmerCountingBloomFilter8>> cbfs;
-  std::vector<std::unique_ptr<btllib::KmerBloomFilter>> bfs;
+// The count of the valley between the peak of erroneous k-mers, seen once or
+// a few times, and the peak of the target's k-mers, as the threshold of solid
+// k-mers. Returns 0 if the histogram of counts has no clear valley, and a
+// valley above MAX_KMER_THRESHOLD is capped there.
+static unsigned
+count_histogram_valley(const std::unordered_map<uint64_t, unsigned>& counts)
+{
+  std::array<size_t, HISTOGRAM_MAX_COUNT + 2> histogram{};
+  for (const auto& [hash, count] : counts) {
+    histogram[std::min(count, HISTOGRAM_MAX_COUNT + 1)]++;
+  }
+  // Sampled histograms are noisy, so each count is averaged with its
+  // neighbours
+  const auto smoothed = [&](const unsigned count) {
+    const auto first = std::max(count - 1, 1U);
+    const auto last = std::min(count + 1, HISTOGRAM_MAX_COUNT);
+    double sum = 0;
+    for (auto i = first; i <= last; i++) {
+      sum += double(histogram[i]);
+    }
+    return sum / double(last - first + 1);
+  };
+
+  unsigned valley = 1;
+  while (valley < HISTOGRAM_MAX_COUNT &&
+         smoothed(valley + 1) <= smoothed(valley)) {
+    valley++;
+  }
+  double peak = 0;
+  for (auto count = valley + 1; count <= HISTOGRAM_MAX_COUNT; count++) {
+    peak = std::max(peak, smoothed(count));
+  }
+  if (valley < HISTOGRAM_MIN_THRESHOLD || peak < HISTOGRAM_MIN_PEAK_KMERS ||
+      peak < HISTOGRAM_MIN_PEAK_TO_VALLEY * smoothed(valley)) {
+    return 0;
+  }
+  return std::min(valley, MAX_KMER_THRESHOLD);
+}
+
+// Sum the counting filters of the k value k_index of all shards into the
+// first shard's
+static void
+merge_shards(
+  std::vector<std::vector<std::unique_ptr<PooledCountingBloomFilter>>>& shards,
+  const size_t k_index)
+{
+  for (size_t shard = 1; shard < shards.size(); shard++) {
+    shards[0][k_index]->merge(*shards[shard][k_index]);
+  }
+}
+
+// Exact counters are shared by all threads, so there is a single shard
+static void
+merge_shards(
+  std::vector<std::vector<std::unique_ptr<PooledKmerCountTable>>>& /*shards*/,
+  const size_t /*k_index*/)
+{
+}
+
+// File names of the filters of a batch, one for each k value
+std::vector<std::string>
+get_bf_names(const std::string& batch_name,
+             const std::vector<unsigned>& k_values)
+{
+  std::vector<std::string> bf_names;
   for (const auto k : k_values) {
-    cbfs.push_back(std::unique_ptr<btllib::KmerCountingBloomFilter8>(
-      new btllib::KmerCountingBloomFilter8(cbf_bytes, hash_num, k)));
-    bfs.push_back(std::unique_ptr<btllib::KmerBloomFilter>(
-      new btllib::KmerBloomFilter(bf_bytes, hash_num, k)));
+    bf_names.push_back(batch_name + SEPARATOR + "k" + std::to_string(k) +
+                       BF_EXTENSION);
+  }
+  return bf_names;
+}
+
+// A mapped sequence part to insert, fetched as a whole. A sequence mapped to
+// several targets of a batch is inserted once, and only the disjoint pieces
+// of the span its mappings cover are hashed. Without pieces, all of it is.
+struct InsertSeq
+{
+  SeqId id;
+  MappedInterval span;
+  std::vector<MappedInterval> pieces;
+};
+
+// Mapped sequence parts to insert for a target, and their k-mer threshold
+using MappedSeqs = std::vector<InsertSeq>;
+struct TargetInserts
+{
+  MappedSeqs mapped_seqs;
+  int kmer_threshold;
+};
+
+// The mapped sequences a batch inserts and the sizes of its filters, which
+// are planned before the batch is admitted to the memory budget
+struct BatchPlan
+{
+  std::vector<TargetInserts> targets_inserts;
+  size_t mappings_bases = 0;
+  unsigned hash_num = 0;
+  size_t cbf_bytes = 0;
+  size_t bf_bytes = 0;
+  size_t count_table_bytes = 0;
+  // Large batches are counted in a part for each thread of the team, each in
+  // a shard of counting filters of its own
+  size_t fill_parts = 1;
+  // Filter memory the batch takes: its presence filters and its counters
+  size_t projected_bytes = 0;
+};
+
+// Add interval to the pieces of insert_seq, merging the pieces it overlaps or
+// touches, and widen its span to cover it
+static void
+add_insert_piece(InsertSeq& insert_seq, const MappedInterval& interval)
+{
+  auto& pieces = insert_seq.pieces;
+  if (pieces.empty()) {
+    pieces.push_back(insert_seq.span);
+  }
+  pieces.push_back(interval);
+  std::sort(pieces.begin(), pieces.end(), [](const auto& a, const auto& b) {
+    return a.start < b.start;
+  });
+  size_t merged = 0;
+  for (size_t i = 1; i < pieces.size(); i++) {
+    if (pieces[i].start <= pieces[merged].end) {
+      pieces[merged].end = std::max(pieces[merged].end, pieces[i].end);
+    } else {
+      pieces[++merged] = pieces[i];
+    }
   }
+  pieces.resize(merged + 1);
+  insert_seq.span = { pieces.front().start, pieces.back().end };
+  if (pieces.size() == 1) {
+    pieces.clear();
+  }
+}
 
-  // Set Bloom filter paths
-  std::vector<std::string> bf_full_names;
-  for (const auto& bf_name : bf_names) {
-    // NOLINTNEXTLINE
-    bf_full_names.push_back(batch_name + SEPARATOR + bf_name);
+// Bases of insert_seq that are hashed
+static size_t
+insert_bases(const InsertSeq& insert_seq)
+{
+  if (insert_seq.pieces.empty()) {
+    return insert_seq.span.end - insert_seq.span.start;
+  }
+  size_t bases = 0;
+  for (const auto& piece : insert_seq.pieces) {
+    bases += piece.end - piece.start;
   }
+  return bases;
+}
 
-  std::string target_seq_id;
-  std::ifstream inputstream(target_ids_input_pipe);
-  while (bool(inputstream >> target_seq_id) && target_seq_id != END_SYMBOL) {
-    const auto target_seq_len = target_seqs_index.get_seq_len(target_seq_id);
+// Select the mapped sequences of the batch with the given targets and size
+// its filters, one for each k value. Only the mappings are looked at, not
+// the sequences, so this is quick next to filling the filters.
+BatchPlan
+plan_batch(const SeqIndex& target_seqs_index,
+           const SeqIndex& mapped_seqs_index,
+           const AllMappings& all_mappings,
+           const FilterParams& filter_params,
+           const std::string& batch_name,
+           const std::vector<BatchTarget>& targets,
+           const std::vector<unsigned>& k_values, // NOLINT
+           const double subsample_max_mapped_seqs_per_target_10kbp)
+{
+  BatchPlan plan;
+  auto& targets_inserts = plan.targets_inserts;
+
+  // Solid k-mers, the elements of the presence filters, are bounded by the
+  // span of target bases the inserted sequences cover
+  size_t batch_mappings_bases = 0, batch_bf_elements = 0;
+  for (const auto& target : targets) {
+    const auto target_seq_len = target.end - target.start;
 
-    const auto& mappings = all_mappings.get_mappings(target_seq_id);
-    if (mappings.empty()) {
+    const auto mappings = all_mappings.get_mappings(target.id);
+    const auto mapped_intervals = all_mappings.get_mapped_intervals(target.id);
+    const auto target_intervals = all_mappings.get_target_intervals(target.id);
+
+    // Windows only take the mappings that overlap them or the window overlap
+    // around them. Mappings without target coordinates overlap every window.
+    const auto windowed = target.start > 0 ||
+                          target.end < target_seqs_index.get_seq_len(target.id);
+    const auto window_start =
+      target.start - std::min(target.start, filter_params.window_overlap);
+    const auto window_end = target.end + filter_params.window_overlap;
+
+    // Mappings are sorted by ID, so their positions break ties in ID order
+    std::vector<std::tuple<size_t, size_t>> mappings_phred;
+    for (size_t i = 0; i < mappings.size(); i++) {
+      if (windowed && (target_intervals[i].start >= window_end ||
+                       target_intervals[i].end <= window_start)) {
+        continue;
+      }
+      const auto mapped_seq_phred = mapped_seqs_index.get_phred_avg(mappings[i]);
+      mappings_phred.emplace_back(i, mapped_seq_phred);
+    }
+    if (mappings_phred.empty()) {
       continue;
     }
-    const auto mappings_num = mappings.size();
+    const auto mappings_num = mappings_phred.size();
     const auto mappings_num_max =
       std::remove_const<decltype(mappings_num)>::type(
         double(target_seq_len) * subsample_max_mapped_seqs_per_target_10kbp /
         10'000.0);
     const auto mappings_num_adjusted = std::min(mappings_num, mappings_num_max);
 
-    std::vector<std::tuple<SeqId, size_t>> mappings_phred;
-    for (const auto& mapped_id : mappings) {
-      const auto mapped_seq_phred = mapped_seqs_index.get_phred_avg(mapped_id);
-      mappings_phred.emplace_back(mapped_id, mapped_seq_phred);
-    }
-
     std::sort(mappings_phred.begin(),
               mappings_phred.end(),
               [](const auto& a, const auto& b) {
-                const auto& [a_id, a_phred] = a;
-                const auto& [b_id, b_phred] = b;
-                return (a_phred > b_phred) ||
-                       (a_phred == b_phred && a_id < b_id);
+                const auto& [a_i, a_phred] = a;
+                const auto& [b_i, b_phred] = b;
+                return (a_phred > b_phred) || (a_phred == b_phred && a_i < b_i);
               });
 
+    // Only the mapped intervals are inserted, so they set the k-mer threshold
     unsigned long mappings_bases = 0;
 
     for (size_t i = 0; i < mappings_num_adjusted; i++) {
-      const auto& [mapped_id, mapped_seq_phred] = mappings_phred[i];
-      const auto mapped_seq_len = mapped_seqs_index.get_seq_len(mapped_id);
-      mappings_bases += mapped_seq_len;
+      const auto& [mapping_i, mapped_seq_phred] = mappings_phred[i];
+      const auto& interval = mapped_intervals[mapping_i];
+      mappings_bases += interval.end - interval.start;
     }
     const auto kmer_threshold =
       mappings_bases_to_kmer_threshold(mappings_bases);
     btllib::check_error(kmer_threshold <= 0,
                         FN_NAME + ": k-mer threshold must be >0.");
 
-    // NOLINTNEXTLINE(google-readability-braces-around-statements,hicpp-braces-around-statements,readability-braces-around-statements)
+    auto& target_inserts = targets_inserts.emplace_back();
+    for (size_t i = 0; i < mappings_num_adjusted; i++) {
+      const auto& [mapping_i, mapped_seq_phred] = mappings_phred[i];
+      const auto& interval = mapped_intervals[mapping_i];
+      target_inserts.mapped_seqs.push_back(
+        { mappings[mapping_i], interval, {} });
+    }
+    target_inserts.kmer_threshold = kmer_threshold;
+    batch_mappings_bases += mappings_bases;
+
+    // The inserted sequences cover the target bases their mappings span, and
+    // at most the length of the longest one beyond either end. Mappings
+    // without target coordinates span the whole target.
+    const auto target_len = target_seqs_index.get_seq_len(target.id);
+    size_t covered_start = target_len, covered_end = 0, longest_interval = 0;
     for (size_t i = 0; i < mappings_num_adjusted; i++) {
-      const auto& [mapped_id, mapped_seq_phred] = mappings_phred[i];
-      const auto [seq, seq_len] = mapped_seqs_index.get_seq<1>(mapped_id);
-      fill_bfs(seq, seq_len, hash_num, k_values, kmer_threshold, cbfs, bfs);
+      const auto& [mapping_i, mapped_seq_phred] = mappings_phred[i];
+      const auto& target_interval = target_intervals[mapping_i];
+      const auto& interval = mapped_intervals[mapping_i];
+      covered_start = std::min<size_t>(covered_start, target_interval.start);
+      covered_end = std::max<size_t>(
+        covered_end, std::min<size_t>(target_interval.end, target_len));
+      longest_interval =
+        std::max<size_t>(longest_interval, interval.end - interval.start);
     }
+    const auto covered_bases =
+      covered_end > covered_start ? covered_end - covered_start : 0;
+    batch_bf_elements +=
+      std::min<size_t>(mappings_bases, covered_bases + 2 * longest_interval);
   }
-  inputstream.close();
 
+  // A sequence mapped to several targets of the batch, e.g. across adjacent
+  // contigs or windows, is inserted once, with the first of those targets'
+  // thresholds, so its k-mers aren't counted twice. Its intervals are kept
+  // as pieces, merged only where they overlap or touch, so the bases between
+  // them aren't inserted. Sequences kept by earlier targets don't move, so
+  // pointers to them stay valid.
+  //
+  // The thresholds aren't recomputed from the deduped bases. They follow the
+  // coverage of each target by its mapped sequences, which a sequence shared
+  // with another target still covers it with.
+  if (targets_inserts.size() > 1) {
+    std::unordered_map<SeqId, InsertSeq*> inserted_seqs;
+    size_t selected_seqs = 0;
+    batch_mappings_bases = 0;
+    for (auto& target_inserts : targets_inserts) {
+      auto& mapped_seqs = target_inserts.mapped_seqs;
+      selected_seqs += mapped_seqs.size();
+      size_t kept = 0;
+      for (size_t i = 0; i < mapped_seqs.size(); i++) {
+        const auto [it, inserted] =
+          inserted_seqs.emplace(mapped_seqs[i].id, nullptr);
+        if (inserted) {
+          if (kept != i) {
+            mapped_seqs[kept] = std::move(mapped_seqs[i]);
+          }
+          it->second = &mapped_seqs[kept];
+          kept++;
+        } else {
+          add_insert_piece(*it->second, mapped_seqs[i].span);
+        }
+      }
+      mapped_seqs.resize(kept);
+    }
+    for (const auto& target_inserts : targets_inserts) {
+      for (const auto& insert_seq : target_inserts.mapped_seqs) {
+        batch_mappings_bases += insert_bases(insert_seq);
+      }
+    }
+    const auto distinct_seqs = inserted_seqs.size();
+    btllib::log_info(
+      FN_NAME + ": Batch " + batch_name + ": " +
+      std::to_string(distinct_seqs) + " of " + std::to_string(selected_seqs) +
+      " selected sequences are distinct, a dedupe ratio of " +
+      std::to_string(distinct_seqs > 0
+                       ? double(selected_seqs) / double(distinct_seqs)
+                       : 1.0) +
+      ".");
+  }
+
+  // Every inserted k-mer goes into the counting filters, while only the
+  // solid ones, at most one per covered base, go into the presence filters
+  plan.mappings_bases = batch_mappings_bases;
+  plan.hash_num = filter_params.hash_num > 0
+                    ? filter_params.hash_num
+                    : optimal_hash_num(filter_params.fpr);
+  plan.cbf_bytes = PooledCountingBloomFilter::bytes_for(
+    filter_params.cbf_bytes > 0
+      ? filter_params.cbf_bytes
+      : std::clamp(
+          optimal_filter_counters(batch_mappings_bases, filter_params.fpr),
+          MIN_FILTER_BYTES,
+          filter_params.max_bytes));
+  plan.bf_bytes =
+    filter_params.bf_bytes > 0
+      ? filter_params.bf_bytes
+      : std::clamp(
+          (optimal_filter_counters(batch_bf_elements, filter_params.fpr) + 7) /
+            8,
+          MIN_FILTER_BYTES,
+          filter_params.max_bytes);
+
+  // The exact counters hold every k-mer of the batch, so they aren't bounded
+  // by the maximum filter size
+  plan.count_table_bytes =
+    std::max(PooledKmerCountTable::bytes_for(batch_mappings_bases),
+             MIN_FILTER_BYTES);
+
+  plan.fill_parts = batch_mappings_bases < PARALLEL_BATCH_MAPPINGS_BASES
+                      ? size_t(1)
+                      : size_t(std::max(omp_get_num_threads(), 1));
+
+  // Counters come from the pool in size classes. Benchmarking keeps the
+  // filters of both counters, which are used one after the other.
+  const auto cbfs_bytes =
+    plan.fill_parts * FilterPool::size_class(plan.cbf_bytes);
+  const auto count_tables_bytes =
+    FilterPool::size_class(plan.count_table_bytes);
+  const auto counters_bytes =
+    filter_params.benchmark_counters
+      ? std::max(cbfs_bytes, count_tables_bytes)
+      : (filter_params.counter == KmerCounterBackend::EXACT
+           ? count_tables_bytes
+           : cbfs_bytes);
+  const size_t bfs_num = filter_params.benchmark_counters ? 2 : 1;
+  plan.projected_bytes =
+    k_values.size() * (counters_bytes + bfs_num * plan.bf_bytes);
+
+  return plan;
+}
+
+// Build the filters of a planned batch, one for each k value.
+std::vector<std::unique_ptr<btllib::KmerBloomFilter>>
+build_batch_bfs(const SeqIndex& mapped_seqs_index,
+                const FilterParams& filter_params,
+                FilterPool& filter_pool,
+                const std::string& batch_name,
+                const BatchPlan& plan,
+                const std::vector<unsigned>& k_values) // NOLINT
+{
+  const auto& targets_inserts = plan.targets_inserts;
+  const auto batch_mappings_bases = plan.mappings_bases;
+  const auto hash_num = plan.hash_num;
+  const auto cbf_bytes = plan.cbf_bytes;
+  const auto bf_bytes = plan.bf_bytes;
+  const auto count_table_bytes = plan.count_table_bytes;
+  const auto fill_parts = plan.fill_parts;
+  const auto cbf_shards = fill_parts;
+
+  const auto mask_quals =
+    filter_params.min_base_quality > 0 && mapped_seqs_index.has_quals();
+
+  const auto prefetch_inserts = [&](const MappedSeqs& mapped_seqs) {
+    for (const auto& [mapped_id, span, pieces] : mapped_seqs) {
+      mapped_seqs_index.prefetch_seq(
+        mapped_id, span.start, span.end - span.start);
+      if (mask_quals) {
+        mapped_seqs_index.prefetch_qual(
+          mapped_id, span.start, span.end - span.start);
+      }
+    }
+  };
+
+  // Call f with each piece of the mapped part of a sequence, with low
+  // quality bases masked. The part is fetched once for all its pieces.
+  const auto for_each_piece = [&](const InsertSeq& insert_seq,
+                                  std::string& seq_buffer,
+                                  std::string& masked_buffer,
+                                  const auto& f) {
+    const auto& [mapped_id, span, pieces] = insert_seq;
+    auto seq = mapped_seqs_index.get_seq(
+      mapped_id, span.start, span.end - span.start, seq_buffer);
+    if (mask_quals) {
+      seq = mask_low_quality(
+        seq,
+        mapped_seqs_index.get_qual(
+          mapped_id, span.start, span.end - span.start),
+        filter_params.min_base_quality,
+        masked_buffer);
+    }
+    if (pieces.empty()) {
+      f(seq);
+    }
+    for (const auto& piece : pieces) {
+      f(seq.substr(piece.start - span.start, piece.end - piece.start));
+    }
+  };
+
+  const auto make_bfs = [&]() {
+    std::vector<std::unique_ptr<btllib::KmerBloomFilter>> bfs;
+    for (const auto k : k_values) {
+      bfs.push_back(std::unique_ptr<btllib::KmerBloomFilter>(
+        new btllib::KmerBloomFilter(bf_bytes, hash_num, k)));
+    }
+    return bfs;
+  };
+
+  // Insert the k-mers of the batch in serial order
+  const auto fill_serial = [&](auto& counters, auto& bfs) {
+    std::string seq_buffer, masked_buffer;
+    for (const auto& target_inserts : targets_inserts) {
+      prefetch_inserts(target_inserts.mapped_seqs);
+      for (const auto& insert_seq : target_inserts.mapped_seqs) {
+        for_each_piece(
+          insert_seq, seq_buffer, masked_buffer, [&](const auto& seq) {
+            fill_bfs(seq.data(),
+                     seq.size(),
+                     hash_num,
+                     k_values,
+                     target_inserts.kmer_threshold,
+                     counters,
+                     bfs);
+          });
+      }
+    }
+  };
+
+  // Exact counts don't depend on the order k-mers are inserted in, so the
+  // mapped sequences of a large batch are split between all threads of the
+  // team, which share the counters.
+  const auto fill_counted = [&](auto& counters, auto& bfs) {
+    if (batch_mappings_bases < PARALLEL_BATCH_MAPPINGS_BASES) {
+      fill_serial(counters, bfs);
+      return;
+    }
+    for (const auto& target_inserts : targets_inserts) {
+      const auto& mapped_seqs = target_inserts.mapped_seqs;
+      prefetch_inserts(mapped_seqs);
+#pragma omp taskloop default(shared)
+      for (size_t i = 0; i < mapped_seqs.size(); i++) {
+        std::string seq_buffer, masked_buffer;
+        for_each_piece(
+          mapped_seqs[i], seq_buffer, masked_buffer, [&](const auto& seq) {
+            fill_bfs(seq.data(),
+                     seq.size(),
+                     hash_num,
+                     k_values,
+                     target_inserts.kmer_threshold,
+                     counters,
+                     bfs);
+          });
+      }
+    }
+  };
+
+  // Call f with the pieces of each of the mapped sequences [begin, end) of
+  // the batch, in the order of its targets, and their target's k-mer
+  // threshold
+  const auto for_each_insert_seq =
+    [&](const size_t begin, const size_t end, const auto& f) {
+      std::string seq_buffer, masked_buffer;
+      size_t i = 0;
+      for (const auto& target_inserts : targets_inserts) {
+        for (const auto& insert_seq : target_inserts.mapped_seqs) {
+          if (i >= begin && i < end) {
+            for_each_piece(
+              insert_seq, seq_buffer, masked_buffer, [&](const auto& seq) {
+                f(seq, target_inserts.kmer_threshold);
+              });
+          }
+          i++;
+        }
+      }
+    };
+
+  // Conservative counting depends on the order k-mers are inserted in,
+  // wherever counters are shared between k-mers, so threads don't share
+  // counting filters. Each shard counts a part of the mapped sequences, the
+  // shards are summed, and a second pass over the sequences inserts the
+  // k-mers whose summed counts reach their thresholds. Counts are capped at
+  // the threshold in each shard, and summed counts are at least the true
+  // counts, so every k-mer seen often enough is inserted as in serial, but
+  // counter collisions can promote a few different k-mers than serial
+  // counting would. Exact counters are a single shard shared by all parts.
+  //
+  // With histogram thresholds, the thresholds are only known once the k-mers
+  // are counted. Counts are capped at the highest threshold a k-mer can get,
+  // and a sample of the k-mers of each k value is counted exactly along the
+  // way. Each k value's threshold is the valley of its sample's histogram,
+  // for the whole batch, which the counters are shared by, and the target's
+  // threshold from its mapped bases where there is no clear valley.
+  size_t histogram_k_values = 0;
+  const auto fill_two_pass =
+    [&](auto& shards, const size_t parts_num, auto& bfs) {
+      size_t seqs_num = 0;
+      for (const auto& target_inserts : targets_inserts) {
+        prefetch_inserts(target_inserts.mapped_seqs);
+        seqs_num += target_inserts.mapped_seqs.size();
+      }
+      const auto histograms = filter_params.histogram_thresholds;
+      uint64_t sample_rate = 1;
+      while (histograms &&
+             sample_rate * HISTOGRAM_SAMPLED_KMERS < batch_mappings_bases) {
+        sample_rate *= 2;
+      }
+      std::vector<SampledKmerCounts> sampled_counts(
+        histograms ? parts_num : 0, SampledKmerCounts(k_values.size()));
+#pragma omp taskloop default(shared) grainsize(1)
+      for (size_t part = 0; part < parts_num; part++) {
+        for_each_insert_seq(
+          seqs_num * part / parts_num,
+          seqs_num * (part + 1) / parts_num,
+          [&](const auto& seq, const int kmer_threshold) {
+            auto count_thresholds =
+              adjusted_kmer_thresholds(kmer_threshold, k_values.size());
+            if (histograms) {
+              for (auto& threshold : count_thresholds) {
+                threshold = std::max(threshold, MAX_KMER_THRESHOLD);
+              }
+            }
+            count_kmers(seq.data(),
+                        seq.size(),
+                        hash_num,
+                        k_values,
+                        count_thresholds,
+                        shards[part % shards.size()],
+                        histograms ? &sampled_counts[part] : nullptr,
+                        sample_rate - 1);
+          });
+      }
+
+      std::vector<unsigned> valleys(k_values.size(), 0);
+#pragma omp taskloop default(shared) grainsize(1)
+      for (size_t k_index = 0; k_index < k_values.size(); k_index++) {
+        merge_shards(shards, k_index);
+        if (histograms) {
+          auto& counts = sampled_counts[0][k_index];
+          for (size_t part = 1; part < parts_num; part++) {
+            for (const auto& [hash, count] : sampled_counts[part][k_index]) {
+              counts[hash] += count;
+            }
+          }
+          valleys[k_index] = count_histogram_valley(counts);
+        }
+      }
+      histogram_k_values =
+        valleys.size() - size_t(std::count(valleys.begin(), valleys.end(), 0U));
+
+#pragma omp taskloop default(shared) grainsize(1)
+      for (size_t part = 0; part < parts_num; part++) {
+        for_each_insert_seq(
+          seqs_num * part / parts_num,
+          seqs_num * (part + 1) / parts_num,
+          [&](const auto& seq, const int kmer_threshold) {
+            auto kmer_thresholds =
+              adjusted_kmer_thresholds(kmer_threshold, k_values.size());
+            for (size_t i = 0; i < kmer_thresholds.size(); i++) {
+              if (valleys[i] > 0) {
+                kmer_thresholds[i] = valleys[i];
+              }
+            }
+            promote_kmers(seq.data(),
+                          seq.size(),
+                          hash_num,
+                          k_values,
+                          kmer_thresholds,
+                          shards[0],
+                          bfs);
+          });
+      }
+    };
+
+  // Fill bfs with the k-mers counted enough times by the given counters, and
+  // return the seconds it took. The counters are only used while inserting,
+  // so their memory comes from the pool and goes back to it.
+  const auto fill_with = [&](const KmerCounterBackend counter, auto& bfs) {
+    const auto start = std::chrono::steady_clock::now();
+    if (counter == KmerCounterBackend::EXACT) {
+      std::vector<std::unique_ptr<PooledKmerCountTable>> count_tables;
+      for (auto& buffer :
+           filter_pool.acquire(count_table_bytes, k_values.size())) {
+        count_tables.push_back(
+          std::make_unique<PooledKmerCountTable>(std::move(buffer)));
+      }
+      if (filter_params.histogram_thresholds) {
+        std::vector<std::vector<std::unique_ptr<PooledKmerCountTable>>> shards;
+        shards.push_back(std::move(count_tables));
+        fill_two_pass(shards, fill_parts, bfs);
+      } else {
+        fill_counted(count_tables, bfs);
+      }
+    } else {
+      std::vector<std::vector<std::unique_ptr<PooledCountingBloomFilter>>>
+        shards(cbf_shards);
+      auto buffers =
+        filter_pool.acquire(cbf_bytes, cbf_shards * k_values.size());
+      for (size_t i = 0; i < buffers.size(); i++) {
+        shards[i / k_values.size()].push_back(
+          std::make_unique<PooledCountingBloomFilter>(
+            std::move(buffers[i]), cbf_bytes, hash_num));
+      }
+      if (cbf_shards == 1 && !filter_params.histogram_thresholds) {
+        fill_serial(shards[0], bfs);
+      } else {
+        fill_two_pass(shards, cbf_shards, bfs);
+      }
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+      .count();
+  };
+
+  auto bfs = make_bfs();
+  const auto seconds = fill_with(filter_params.counter, bfs);
+  if (filter_params.histogram_thresholds) {
+    btllib::log_info(FN_NAME + ": Batch " + batch_name + ": " +
+                     std::to_string(histogram_k_values) + " of " +
+                     std::to_string(k_values.size()) +
+                     " k values have k-mer thresholds from count histograms.");
+  }
+
+  if (filter_params.benchmark_counters) {
+    // Counting Bloom filter false positives promote k-mers that aren't
+    // solid, which set more bits than the exact counts do
+    const auto other_counter =
+      filter_params.counter == KmerCounterBackend::EXACT
+        ? KmerCounterBackend::COUNTING_BLOOM_FILTER
+        : KmerCounterBackend::EXACT;
+    auto other_bfs = make_bfs();
+    const auto other_seconds = fill_with(other_counter, other_bfs);
+
+    const auto describe = [](const KmerCounterBackend counter,
+                             const double seconds,
+                             const auto& bfs) {
+      uint64_t bits_set = 0;
+      for (const auto& bf : bfs) {
+        bits_set += bf->get_pop_cnt();
+      }
+      return std::string(counter == KmerCounterBackend::EXACT ? "exact"
+                                                              : "cbf") +
+             " " + std::to_string(seconds) + " s, " +
+             std::to_string(bits_set) + " bits set";
+    };
+    btllib::log_info(FN_NAME + ": Batch " + batch_name + ": " +
+                     describe(filter_params.counter, seconds, bfs) + "; " +
+                     describe(other_counter, other_seconds, other_bfs));
+  }
+
+  return bfs;
+}
+
+// Save the filters of a batch in files named by get_bf_names in the working
+// directory
+void
+save_batch_bfs(const std::vector<std::unique_ptr<btllib::KmerBloomFilter>>& bfs,
+               const std::vector<std::string>& bf_names)
+{
   for (size_t i = 0; i < bfs.size(); i++) {
-    bfs[i]->save(bf_full_names[i]);
+    bfs[i]->save(bf_names[i]);
   }
+}
 
-  confirm_pipe(bfs_ready_pipe);
+// Save the filters of a batch in memory files, and return their descriptors
+std::vector<int>
+save_batch_bfs_to_memory(
+  const std::vector<std::unique_ptr<btllib::KmerBloomFilter>>& bfs,
+  const std::vector<std::string>& bf_names)
+{
+  std::vector<int> fds;
+  for (size_t i = 0; i < bfs.size(); i++) {
+    const auto fd = create_memory_file(bf_names[i]);
+    btllib::check_error(fd == -1,
+                        FN_NAME + ": Creating a memory file failed: " +
+                          btllib::get_strerror());
+    fds.push_back(fd);
+    bfs[i]->save(FD_PATH_PREFIX + std::to_string(fd));
+  }
+  return fds;
+}
+
+// Find the target named target_seq_name, or if there is none, the window of
+// a target given as name:start-end, in 1-based inclusive coordinates like
+// samtools regions. Returns why the name is invalid, or an empty string.
+std::string
+find_batch_target(const SeqIndex& target_seqs_index,
+                  const std::string& target_seq_name,
+                  BatchTarget& target)
+{
+  auto target_id = target_seqs_index.get_seq_id(target_seq_name);
+  if (target_id != INVALID_SEQ_ID) {
+    target = { target_id, 0, target_seqs_index.get_seq_len(target_id) };
+    return "";
+  }
+
+  const auto colon = target_seq_name.rfind(':');
+  const auto dash = target_seq_name.rfind('-');
+  if (colon == std::string::npos || dash == std::string::npos ||
+      dash < colon) {
+    return target_seq_name + " not found in the index.";
+  }
+  target_id = target_seqs_index.get_seq_id(
+    std::string_view(target_seq_name).substr(0, colon));
+  if (target_id == INVALID_SEQ_ID) {
+    return target_seq_name.substr(0, colon) + " not found in the index.";
+  }
+
+  size_t start = 0, end = 0;
+  const auto* const start_first = target_seq_name.data() + colon + 1;
+  const auto* const end_first = target_seq_name.data() + dash + 1;
+  const auto* const last = target_seq_name.data() + target_seq_name.size();
+  const auto start_result = std::from_chars(start_first, end_first - 1, start);
+  const auto end_result = std::from_chars(end_first, last, end);
+  if (start_result.ec != std::errc() || start_result.ptr != end_first - 1 ||
+      end_result.ec != std::errc() || end_result.ptr != last || start == 0 ||
+      start > end || end > target_seqs_index.get_seq_len(target_id)) {
+    return target_seq_name + " is not a valid window.";
+  }
+  target = { target_id, start - 1, end };
+  return "";
+}
+
+BatchTarget
+get_batch_target(const SeqIndex& target_seqs_index,
+                 const std::string& target_seq_name)
+{
+  BatchTarget target{};
+  const auto error =
+    find_batch_target(target_seqs_index, target_seq_name, target);
+  btllib::check_error(!error.empty(), FN_NAME + ": " + error);
+  return target;
+}
 
+// Read the targets of a batch from target_ids_input_pipe, all of them
+// first, so the filters can be sized for their mappings
+std::vector<BatchTarget>
+read_batch_targets(const SeqIndex& target_seqs_index,
+                   const std::string& target_ids_input_pipe)
+{
+  std::vector<BatchTarget> targets;
+  std::string target_seq_name;
+  std::ifstream inputstream(target_ids_input_pipe);
+  while (bool(inputstream >> target_seq_name) &&
+         target_seq_name != END_SYMBOL) {
+    targets.push_back(get_batch_target(target_seqs_index, target_seq_name));
+  }
+  inputstream.close();
   std::remove(target_ids_input_pipe.c_str());
+  return targets;
+}
+
+void
+serve_batch(const SeqIndex& mapped_seqs_index,
+            const FilterParams& filter_params,
+            FilterPool& filter_pool,
+            const std::string& batch_name,
+            const BatchPlan& plan,
+            const std::string& bfs_ready_pipe,
+            const std::vector<unsigned>& k_values) // NOLINT
+{
+  const auto bfs = build_batch_bfs(
+    mapped_seqs_index, filter_params, filter_pool, batch_name, plan, k_values);
+  save_batch_bfs(bfs, get_bf_names(batch_name, k_values));
+
+  confirm_pipe(bfs_ready_pipe);
+
   std::remove(bfs_ready_pipe.c_str());
 }
 
+// Wait until the memory budget has room for another batch before taking one,
+// so the client is held off instead of batches queueing up for memory.
+// Batches taken before may run on this thread meanwhile.
+static void
+hold_off_batches(MemoryBudget& memory_budget)
+{
+  const auto start = std::chrono::steady_clock::now();
+  if (memory_budget.wait_for_room(std::chrono::milliseconds(0))) {
+    return;
+  }
+  while (!memory_budget.wait_for_room(HOLD_OFF_POLL_INTERVAL)) {
+#pragma omp taskyield
+  }
+  memory_budget.add_hold_off(
+    std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+      .count());
+}
+
+// Wait until the filter memory a batch is projected to take fits in the
+// memory budget and admit it. This is done before the batch's task is
+// started, so tasks never wait for the budget. Batches taken before may run
+// on this thread meanwhile.
+MemoryBudget::Admission
+admit_batch(MemoryBudget& memory_budget,
+            const std::string& batch_name,
+            const size_t projected_bytes)
+{
+  const auto start = std::chrono::steady_clock::now();
+  double delay = 0;
+  if (!memory_budget.wait_to_fit(projected_bytes,
+                                 std::chrono::milliseconds(0))) {
+    while (!memory_budget.wait_to_fit(projected_bytes,
+                                      HOLD_OFF_POLL_INTERVAL)) {
+#pragma omp taskyield
+    }
+    delay = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                          start)
+              .count();
+    btllib::log_info(FN_NAME + ": Batch " + batch_name + " waited " +
+                     std::to_string(delay) + " s for " +
+                     std::to_string(projected_bytes) +
+                     " bytes of filter memory.");
+  }
+  return memory_budget.admit(projected_bytes, delay);
+}
+
 bool
 process_batch_name(const SeqIndex& target_seqs_index,
                    const SeqIndex& mapped_seqs_index,
                    const AllMappings& all_mappings,
-                   const size_t cbf_bytes,
-                   const size_t bf_bytes,
+                   const FilterParams& filter_params,
+                   FilterPool& filter_pool,
+                   MemoryBudget& memory_budget,
                    const std::string& batch_name_input_pipe,
                    const std::string& batch_target_ids_input_ready_pipe,
                    const std::string& target_ids_input_pipe,
                    const std::string& bfs_ready_pipe,
-                   const unsigned hash_num,
-                   const std::vector<unsigned>& k_values,    // NOLINT
-                   const std::vector<std::string>& bf_names, // NOLINT
+                   const std::vector<unsigned>& k_values, // NOLINT
                    const double subsample_max_mapped_seqs_per_target_10kbp)
 {
+  hold_off_batches(memory_budget);
   const auto batch_name = read_pipe(batch_name_input_pipe);
   if (batch_name.empty() || batch_name == END_SYMBOL) {
     return false;
@@ -174,22 +1038,30 @@ process_batch_name(const SeqIndex& target_seqs_index,
 
   confirm_pipe(batch_target_ids_input_ready_pipe);
 
+  // The batch is planned and admitted here, and its task only builds it. The
+  // task's copies of the plan and admission keep them until it is done.
+  const auto plan = std::make_shared<const BatchPlan>(plan_batch(
+    target_seqs_index,
+    mapped_seqs_index,
+    all_mappings,
+    filter_params,
+    batch_name,
+    read_batch_targets(target_seqs_index, batch_target_ids_input_pipe),
+    k_values,
+    subsample_max_mapped_seqs_per_target_10kbp));
+  const auto admission = std::make_shared<const MemoryBudget::Admission>(
+    admit_batch(memory_budget, batch_name, plan->projected_bytes));
+
 #pragma omp task firstprivate(                                                 \
-    batch_name, batch_target_ids_input_pipe, batch_bfs_ready_pipe)             \
-  shared(                                                                      \
-      target_seqs_index, mapped_seqs_index, all_mappings, bf_names, k_values)
-  serve_batch(target_seqs_index,
-              mapped_seqs_index,
-              all_mappings,
-              cbf_bytes,
-              bf_bytes,
+    batch_name, batch_bfs_ready_pipe, plan, admission)                         \
+  shared(mapped_seqs_index, filter_params, filter_pool, k_values)
+  serve_batch(mapped_seqs_index,
+              filter_params,
+              filter_pool,
               batch_name,
-              batch_target_ids_input_pipe,
+              *plan,
               batch_bfs_ready_pipe,
-              bf_names,
-              hash_num,
-              k_values,
-              subsample_max_mapped_seqs_per_target_10kbp);
+              k_values);
 
   return true;
 }
@@ -198,25 +1070,19 @@ void
 serve(const SeqIndex& target_seqs_index,
       const SeqIndex& mapped_seqs_index,
       const AllMappings& all_mappings,
-      const size_t cbf_bytes,
-      const size_t bf_bytes,
+      const FilterParams& filter_params,
+      FilterPool& filter_pool,
+      MemoryBudget& memory_budget,
       const std::string& batch_name_input_pipe,
       const std::string& batch_target_ids_input_ready_pipe,
       const std::string& target_ids_input_pipe,
       const std::string& bfs_ready_pipe,
-      const unsigned hash_num,
       const std::vector<unsigned>& k_values, // NOLINT
       const double subsample_max_mapped_seqs_per_target_10kbp)
 {
   make_pipe(batch_name_input_pipe);
   make_pipe(batch_target_ids_input_ready_pipe);
 
-  std::vector<std::string> bf_names;
-  for (const auto k : k_values) {
-    // NOLINTNEXTLINE
-    bf_names.push_back("k" + std::to_string(k) + BF_EXTENSION);
-  }
-
   btllib::log_info(FN_NAME + ": Accepting batch names at " +
                    batch_name_input_pipe);
 
@@ -225,38 +1091,543 @@ serve(const SeqIndex& target_seqs_index,
   while (process_batch_name(target_seqs_index,
                             mapped_seqs_index,
                             all_mappings,
-                            cbf_bytes,
-                            bf_bytes,
+                            filter_params,
+                            filter_pool,
+                            memory_budget,
                             batch_name_input_pipe,
                             batch_target_ids_input_ready_pipe,
                             target_ids_input_pipe,
                             bfs_ready_pipe,
-                            hash_num,
                             k_values,
-                            bf_names,
                             subsample_max_mapped_seqs_per_target_10kbp)) {
   }
 
   std::remove(batch_name_input_pipe.c_str());
   std::remove(batch_target_ids_input_ready_pipe.c_str());
 
+  if (memory_budget.get_max_bytes() > 0) {
+    memory_budget.log_delays();
+  }
+  btllib::log_info(FN_NAME + ": Targeted BF builder done!");
+}
+
+// A client of the socket server. Batch tasks write the replies to its
+// requests as they finish, and the socket is closed once the client stops
+// sending and no batch of it is left.
+class SocketClient
+{
+
+public:
+  explicit SocketClient(const int fd)
+    : fd(fd)
+  {
+  }
+  ~SocketClient() { close(fd); }
+
+  SocketClient(const SocketClient&) = delete;
+  SocketClient& operator=(const SocketClient&) = delete;
+
+  int get_fd() const { return fd; }
+
+  // Read what the client sent and append its complete request lines to
+  // requests. Returns false once the client stops sending.
+  bool receive(std::vector<std::string>& requests)
+  {
+    std::array<char, SOCKET_READ_BYTES> buffer{};
+    const auto ret = read(fd, buffer.data(), buffer.size());
+    if (ret < 0 && errno == EINTR) {
+      return true;
+    }
+    if (ret <= 0) {
+      return false;
+    }
+    input.append(buffer.data(), size_t(ret));
+    size_t start = 0, newline = 0;
+    while ((newline = input.find('\n', start)) != std::string::npos) {
+      requests.push_back(input.substr(start, newline - start));
+      start = newline + 1;
+    }
+    input.erase(0, start);
+    return true;
+  }
+
+  // Reply with line, passing the descriptors fds along with it
+  void reply(const std::string& line, const std::vector<int>& fds = {})
+  {
+    const std::unique_lock<std::mutex> lock(write_mutex);
+    if (!send_all(fd, line + '\n', fds)) {
+      btllib::log_warning(FN_NAME + ": Client is gone, dropping reply.");
+    }
+  }
+
+private:
+  const int fd;
+  // Received bytes not ending in a newline yet
+  std::string input;
+  std::mutex write_mutex;
+};
+
+// Build the filters of a batch and reply to the client that requested them,
+// as described at process_request
+void
+reply_batch_bfs(const SeqIndex& mapped_seqs_index,
+                const FilterParams& filter_params,
+                FilterPool& filter_pool,
+                SocketClient& client,
+                const std::string& batch_name,
+                const BatchPlan& plan,
+                const std::string& bfs_dir,
+                const bool memory_files,
+                const std::vector<unsigned>& k_values) // NOLINT
+{
+  const auto bfs = build_batch_bfs(
+    mapped_seqs_index, filter_params, filter_pool, batch_name, plan, k_values);
+  const auto bf_names = get_bf_names(batch_name, k_values);
+  std::string reply = batch_name;
+  if (memory_files) {
+    const auto fds = save_batch_bfs_to_memory(bfs, bf_names);
+    reply += ' ' + MEMORY_FILES_REPLY;
+    for (const auto& bf_name : bf_names) {
+      reply += ' ' + bf_name;
+    }
+    client.reply(reply, fds);
+    for (const auto fd : fds) {
+      close(fd);
+    }
+  } else {
+    save_batch_bfs(bfs, bf_names);
+    for (const auto& bf_name : bf_names) {
+      reply += ' ' + bfs_dir + '/' + bf_name;
+    }
+    client.reply(reply);
+  }
+}
+
+// Parse a request line of the form "batch_name k1,k2,... target_id..." and
+// start a task building the batch's filters, which replies with
+// "batch_name bf_path..." when they are saved. With memory_files, the filters
+// are saved in memory files instead, and the reply is
+// "batch_name fd: bf_name..." with their descriptors passed along. The
+// builder closes its descriptors once they are sent, so a memory file is
+// freed once the client closes its own. Returns false for the end request.
+bool
+process_request(const SeqIndex& target_seqs_index,
+                const SeqIndex& mapped_seqs_index,
+                const AllMappings& all_mappings,
+                const FilterParams& filter_params,
+                FilterPool& filter_pool,
+                MemoryBudget& memory_budget,
+                const std::shared_ptr<SocketClient>& client,
+                const std::string& request,
+                const std::string& bfs_dir,
+                const bool memory_files,
+                const std::vector<unsigned>& k_values, // NOLINT
+                const double subsample_max_mapped_seqs_per_target_10kbp)
+{
+  std::istringstream tokens(request);
+  std::string batch_name, k_list, target_seq_name;
+  if (!(tokens >> batch_name)) {
+    return true;
+  }
+  if (batch_name == END_SYMBOL) {
+    return false;
+  }
+
+  // A malformed request fails only its own batch, and the client is told why
+  const auto warning_prefix = FN_NAME + ": Batch " + batch_name + " request ";
+  const auto reject = [&](const std::string& error) {
+    btllib::log_warning(warning_prefix + error);
+    client->reply(batch_name + ' ' + ERROR_REPLY + ' ' + error);
+    return true;
+  };
+  if (!(tokens >> k_list)) {
+    return reject("has no k values.");
+  }
+
+  // The k values of a batch are a subset of the builder's, and thresholds
+  // rise with each k value in the order given, as with the builder's
+  std::vector<unsigned> batch_k_values;
+  std::istringstream k_tokens(k_list);
+  std::string k;
+  while (std::getline(k_tokens, k, ',')) {
+    unsigned k_value = 0;
+    const auto result = std::from_chars(k.data(), k.data() + k.size(), k_value);
+    if (result.ec != std::errc() || result.ptr != k.data() + k.size() ||
+        std::find(k_values.begin(), k_values.end(), k_value) ==
+          k_values.end()) {
+      return reject("asks for k = " + k +
+                    ", which the builder was not started with.");
+    }
+    batch_k_values.push_back(k_value);
+  }
+  if (batch_k_values.empty()) {
+    return reject("has no k values.");
+  }
+
+  std::vector<BatchTarget> targets;
+  while (tokens >> target_seq_name) {
+    targets.emplace_back();
+    const auto error =
+      find_batch_target(target_seqs_index, target_seq_name, targets.back());
+    if (!error.empty()) {
+      return reject("has an invalid target: " + error);
+    }
+  }
+
+  hold_off_batches(memory_budget);
+
+  // As with pipes, the batch is admitted before its task is started
+  const auto plan = std::make_shared<const BatchPlan>(
+    plan_batch(target_seqs_index,
+               mapped_seqs_index,
+               all_mappings,
+               filter_params,
+               batch_name,
+               targets,
+               batch_k_values,
+               subsample_max_mapped_seqs_per_target_10kbp));
+  const auto admission = std::make_shared<const MemoryBudget::Admission>(
+    admit_batch(memory_budget, batch_name, plan->projected_bytes));
+
+  // A lone thread would never get to a deferred task while it waits for
+  // requests, so it builds the batch right away
+  const bool deferred = omp_get_num_threads() > 1;
+#pragma omp task if (deferred)                                                 \
+  firstprivate(client, batch_name, batch_k_values, plan, admission)            \
+  shared(mapped_seqs_index, filter_params, filter_pool, bfs_dir)
+  {
+    reply_batch_bfs(mapped_seqs_index,
+                    filter_params,
+                    filter_pool,
+                    *client,
+                    batch_name,
+                    *plan,
+                    bfs_dir,
+                    memory_files,
+                    batch_k_values);
+  }
+
+  return true;
+}
+
+// Serve batch requests from clients connecting to a Unix socket. Clients
+// can send several requests without waiting for replies, and replies come in
+// the order the batches are done. After the end request, no new clients are
+// accepted and the server ends once the connected ones are served. Filters
+// are handed to clients in memory files where the system has them, unless
+// filter_files is set, and saved in the working directory otherwise.
+void
+serve_socket(const SeqIndex& target_seqs_index,
+             const SeqIndex& mapped_seqs_index,
+             const AllMappings& all_mappings,
+             const FilterParams& filter_params,
+             FilterPool& filter_pool,
+             MemoryBudget& memory_budget,
+             const std::string& socket_path,
+             const bool filter_files,
+             const std::vector<unsigned>& k_values, // NOLINT
+             const double subsample_max_mapped_seqs_per_target_10kbp)
+{
+  std::array<char, PATH_MAX> cwd{};
+  btllib::check_error(getcwd(cwd.data(), cwd.size()) == nullptr,
+                      FN_NAME + ": getcwd failed: " + btllib::get_strerror());
+  const std::string bfs_dir(cwd.data());
+
+  auto memory_files = !filter_files;
+  if (memory_files) {
+    const auto fd = create_memory_file(FN_NAME);
+    if (fd == -1) {
+      btllib::log_info(FN_NAME + ": No memory files (" +
+                       btllib::get_strerror() +
+                       "), saving filters in " + bfs_dir + " instead.");
+      memory_files = false;
+    } else {
+      close(fd);
+    }
+  }
+
+  auto listen_fd = listen_socket(socket_path);
+  btllib::log_info(FN_NAME + ": Accepting batch requests at " + socket_path);
+  // Clients wait for this line instead of polling for the socket
+  std::cout << SOCKET_READY << std::endl;
+
+  std::vector<std::shared_ptr<SocketClient>> clients;
+  std::vector<pollfd> fds;
+  std::vector<std::string> requests;
+
+#pragma omp parallel
+#pragma omp single
+  while (listen_fd != -1 || !clients.empty()) {
+    fds.clear();
+    for (const auto& client : clients) {
+      fds.push_back(pollfd{ client->get_fd(), POLLIN, 0 });
+    }
+    if (listen_fd != -1) {
+      fds.push_back(pollfd{ listen_fd, POLLIN, 0 });
+    }
+    const auto ready = poll(fds.data(), fds.size(), -1);
+    btllib::check_error(ready < 0 && errno != EINTR,
+                        FN_NAME + ": poll failed: " + btllib::get_strerror());
+    if (ready <= 0) {
+      continue;
+    }
+
+    // Clients are served before new ones are accepted, so the requests of
+    // clients that connected before the end request are all read
+    std::vector<std::shared_ptr<SocketClient>> remaining_clients;
+    for (size_t i = 0; i < clients.size(); i++) {
+      const auto& client = clients[i];
+      requests.clear();
+      const auto sending =
+        fds[i].revents == 0 || client->receive(requests);
+      for (const auto& request : requests) {
+        if (!process_request(target_seqs_index,
+                             mapped_seqs_index,
+                             all_mappings,
+                             filter_params,
+                             filter_pool,
+                             memory_budget,
+                             client,
+                             request,
+                             bfs_dir,
+                             memory_files,
+                             k_values,
+                             subsample_max_mapped_seqs_per_target_10kbp) &&
+            listen_fd != -1) {
+          close(listen_fd);
+          listen_fd = -1;
+        }
+      }
+      if (sending) {
+        remaining_clients.push_back(client);
+      }
+    }
+    clients.swap(remaining_clients);
+
+    if (listen_fd != -1 && fds.back().revents != 0) {
+      const auto client_fd = accept_socket(listen_fd);
+      btllib::check_error(client_fd == -1 && errno != EINTR &&
+                            errno != ECONNABORTED,
+                          FN_NAME + ": accept failed: " +
+                            btllib::get_strerror());
+      if (client_fd != -1) {
+        clients.push_back(std::make_shared<SocketClient>(client_fd));
+      }
+    }
+  }
+
+  std::remove(socket_path.c_str());
+
+  if (memory_budget.get_max_bytes() > 0) {
+    memory_budget.log_delays();
+  }
   btllib::log_info(FN_NAME + ": Targeted BF builder done!");
 }
 
+static void
+print_usage()
+{
+  std::cerr
+    << "Usage: goldpolish-targeted-bfs [--skip-secondary] "
+       "[--skip-supplementary] [--padding bases] [--no-mappings-cache] "
+       "[--mappings-format ntlink|paf|sam|bam] [--target-sorted] "
+       "[--auto-size-filters] [--fpr rate] [--max-filter-bytes bytes] "
+       "[--cbf-bytes bytes] "
+       "[--bf-bytes bytes] [--hash-num n] [--max-pool-bytes bytes] "
+       "[--memory-budget bytes] "
+       "[--kmer-counter cbf|exact] [--benchmark-counters] "
+       "[--min-base-quality phred] [--histogram-thresholds] "
+       "[--window-overlap bases] [--socket path] [--filter-files] "
+       "target_seqs target_seqs_index mappings "
+       "mapped_seqs mapped_seqs_index mx_max_mapped_seqs_per_target_10kbp "
+       "subsample_max_mapped_seqs_per_target_10kbp threads k...\n"
+    << "       goldpolish-targeted-bfs --map [--map-k k] [--map-w w] "
+       "target_seqs target_seqs_index "
+       "mapped_seqs mapped_seqs_index mx_max_mapped_seqs_per_target_10kbp "
+       "subsample_max_mapped_seqs_per_target_10kbp threads k...\n"
+    << "--max-pool-bytes only bounds the pooled counting filters and exact "
+       "counters. Presence filters aren't pooled; --memory-budget covers "
+       "them too.\n"
+    << "With --socket, filters are passed to clients as descriptors of "
+       "memory files where the system has them. --filter-files saves them in "
+       "the working directory instead.\n"
+    << "Batches of at least 10 Mbp of mapped sequence are filled by all "
+       "threads. With --kmer-counter cbf, each thread counts its part in "
+       "counting filters of its own, which take --cbf-bytes each.\n";
+}
+
 int
 main(int argc, char** argv)
 {
+  uint16_t skip_flags = 0;
+  uint32_t padding = DEFAULT_PADDING;
+  bool mappings_cache = true;
+  auto mappings_format = MappingsFormat::FROM_EXTENSION;
+  bool target_sorted = false;
+  bool map = false;
+  unsigned map_k = DEFAULT_MAP_K;
+  unsigned map_w = DEFAULT_MAP_W;
+  FilterParams filter_params;
+  bool auto_size_filters = false;
+  size_t max_pool_bytes = 0;
+  size_t memory_budget_bytes = 0;
+  std::string socket_path;
+  bool filter_files = false;
+  // NOLINTNEXTLINE(cppcoreguidelines-avoid-c-arrays,hicpp-avoid-c-arrays,modernize-avoid-c-arrays)
+  static const struct option long_options[] = {
+    { "skip-secondary", no_argument, nullptr, 's' },
+    { "skip-supplementary", no_argument, nullptr, 'S' },
+    { "padding", required_argument, nullptr, 'p' },
+    { "no-mappings-cache", no_argument, nullptr, 'n' },
+    { "mappings-format", required_argument, nullptr, 'f' },
+    { "target-sorted", no_argument, nullptr, 't' },
+    { "map", no_argument, nullptr, 'm' },
+    { "map-k", required_argument, nullptr, 'k' },
+    { "map-w", required_argument, nullptr, 'w' },
+    { "auto-size-filters", no_argument, nullptr, 'a' },
+    { "fpr", required_argument, nullptr, 'r' },
+    { "max-filter-bytes", required_argument, nullptr, 'M' },
+    { "cbf-bytes", required_argument, nullptr, 'c' },
+    { "bf-bytes", required_argument, nullptr, 'b' },
+    { "hash-num", required_argument, nullptr, 'h' },
+    { "max-pool-bytes", required_argument, nullptr, 'P' },
+    { "memory-budget", required_argument, nullptr, 'g' },
+    { "socket", required_argument, nullptr, 'u' },
+    { "filter-files", no_argument, nullptr, 'F' },
+    { "kmer-counter", required_argument, nullptr, 'K' },
+    { "benchmark-counters", no_argument, nullptr, 'B' },
+    { "min-base-quality", required_argument, nullptr, 'q' },
+    { "histogram-thresholds", no_argument, nullptr, 'H' },
+    { "window-overlap", required_argument, nullptr, 'W' },
+    { nullptr, 0, nullptr, 0 }
+  };
+  int opt = 0;
+  while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+    switch (opt) {
+      case 's':
+        skip_flags |= BAM_FLAG_SECONDARY;
+        break;
+      case 'S':
+        skip_flags |= BAM_FLAG_SUPPLEMENTARY;
+        break;
+      case 'p':
+        padding =
+          uint32_t(std::min<unsigned long>(std::stoul(optarg), UINT32_MAX));
+        break;
+      case 'n':
+        mappings_cache = false;
+        break;
+      case 'f':
+        // Needed for mappings read from stdin or a pipe without an extension
+        btllib::check_error(std::string(optarg) != "ntlink" &&
+                              std::string(optarg) != "paf" &&
+                              std::string(optarg) != "sam" &&
+                              std::string(optarg) != "bam",
+                            FN_NAME + ": Invalid mappings format " + optarg +
+                              ".");
+        mappings_format =
+          mappings_format_from_extension(std::string(".") + optarg);
+        break;
+      case 't':
+        target_sorted = true;
+        break;
+      case 'm':
+        map = true;
+        break;
+      case 'k':
+        map_k = std::stoul(optarg);
+        break;
+      case 'w':
+        map_w = std::stoul(optarg);
+        break;
+      case 'a':
+        auto_size_filters = true;
+        break;
+      case 'r':
+        filter_params.fpr = std::stod(optarg);
+        btllib::check_error(filter_params.fpr <= 0 || filter_params.fpr >= 1,
+                            FN_NAME + ": --fpr must be in (0, 1).");
+        break;
+      case 'M':
+        filter_params.max_bytes = std::stoull(optarg);
+        btllib::check_error(filter_params.max_bytes < MIN_FILTER_BYTES,
+                            FN_NAME + ": --max-filter-bytes must be at least " +
+                              std::to_string(MIN_FILTER_BYTES) + ".");
+        break;
+      case 'c':
+        filter_params.cbf_bytes = std::stoull(optarg);
+        break;
+      case 'b':
+        filter_params.bf_bytes = std::stoull(optarg);
+        break;
+      case 'h':
+        filter_params.hash_num = std::stoul(optarg);
+        break;
+      case 'P':
+        max_pool_bytes = std::stoull(optarg);
+        break;
+      case 'g':
+        memory_budget_bytes = std::stoull(optarg);
+        break;
+      case 'u':
+        socket_path = optarg;
+        break;
+      case 'F':
+        filter_files = true;
+        break;
+      case 'K':
+        btllib::check_error(std::string(optarg) != "cbf" &&
+                              std::string(optarg) != "exact",
+                            FN_NAME + ": Invalid k-mer counter " + optarg +
+                              ".");
+        filter_params.counter = std::string(optarg) == "exact"
+                                  ? KmerCounterBackend::EXACT
+                                  : KmerCounterBackend::COUNTING_BLOOM_FILTER;
+        break;
+      case 'B':
+        filter_params.benchmark_counters = true;
+        break;
+      case 'q':
+        filter_params.min_base_quality = std::stoul(optarg);
+        break;
+      case 'H':
+        filter_params.histogram_thresholds = true;
+        break;
+      case 'W':
+        filter_params.window_overlap = std::stoull(optarg);
+        break;
+      default:
+        print_usage();
+        std::exit(EXIT_FAILURE); // NOLINT(concurrency-mt-unsafe)
+    }
+  }
   // NOLINTNEXTLINE(readability-magic-numbers,cppcoreguidelines-avoid-magic-numbers)
-  btllib::check_error(argc < 8, "Wrong args.");
+  if (argc - optind < (map ? 8 : 9)) {
+    print_usage();
+    std::exit(EXIT_FAILURE); // NOLINT(concurrency-mt-unsafe)
+  }
+
+  // Unless filters are auto-sized, sizes that aren't given are fixed
+  if (!auto_size_filters) {
+    if (filter_params.cbf_bytes == 0) {
+      filter_params.cbf_bytes = DEFAULT_CBF_BYTES;
+    }
+    if (filter_params.bf_bytes == 0) {
+      filter_params.bf_bytes = DEFAULT_BF_BYTES;
+    }
+    if (filter_params.hash_num == 0) {
+      filter_params.hash_num = DEFAULT_HASH_NUM;
+    }
+  }
 
   bind_to_parent();
 
   std::vector<unsigned> k_values;
 
-  int arg = 1;
+  int arg = optind;
   auto* const target_seqs_filepath = argv[arg++];
   auto* const target_seqs_index_filepath = argv[arg++];
-  auto* const mappings_filepath = argv[arg++];
+  const std::string mappings_filepath = map ? "" : argv[arg++];
   auto* const mapped_seqs_filepath = argv[arg++];
   auto* const mapped_seqs_index_filepath = argv[arg++];
   const auto mx_max_mapped_seqs_per_target_10kbp = std::stod(argv[arg++]);
@@ -267,34 +1638,76 @@ main(int argc, char** argv)
     k_values.push_back(std::stoi(argv[arg++]));
   }
 
-  size_t cbf_bytes = 10ULL * 1024ULL * 1024ULL; // NOLINT
-  size_t bf_bytes = 512ULL * 1024ULL;           // NOLINT
-  unsigned hash_num = 4;                        // NOLINT
-
   omp_set_nested(1);
   omp_set_num_threads(int(threads));
 
   SeqIndex target_seqs_index(target_seqs_index_filepath, target_seqs_filepath);
   SeqIndex mapped_seqs_index(mapped_seqs_index_filepath, mapped_seqs_filepath);
+  if (filter_params.min_base_quality > 0 && !mapped_seqs_index.has_quals()) {
+    btllib::log_warning(FN_NAME + ": " + mapped_seqs_filepath +
+                        " has no qualities, so --min-base-quality is ignored.");
+  }
 
-  AllMappings all_mappings(mappings_filepath,
-                           target_seqs_index,
-                           MX_THRESHOLD_MIN,
-                           MX_THRESHOLD_MAX,
-                           mx_max_mapped_seqs_per_target_10kbp);
-
-  serve(target_seqs_index,
-        mapped_seqs_index,
-        all_mappings,
-        cbf_bytes,
-        bf_bytes,
-        BATCH_NAME_INPUT_PIPE,
-        BATCH_TARGET_IDS_INPUT_READY_PIPE,
-        TARGET_IDS_INPUT_PIPE,
-        BFS_READY_PIPE,
-        hash_num,
-        k_values,
-        subsample_max_mapped_seqs_per_target_10kbp);
+  std::unique_ptr<AllMappings> all_mappings;
+  if (map) {
+    all_mappings =
+      std::make_unique<AllMappings>(target_seqs_filepath,
+                                    mapped_seqs_filepath,
+                                    map_k,
+                                    map_w,
+                                    target_seqs_index,
+                                    mapped_seqs_index,
+                                    MX_THRESHOLD_MIN,
+                                    MX_THRESHOLD_MAX,
+                                    mx_max_mapped_seqs_per_target_10kbp,
+                                    threads);
+  } else {
+    all_mappings = std::make_unique<AllMappings>(
+      mappings_filepath,
+      target_seqs_index,
+      mapped_seqs_index,
+      MX_THRESHOLD_MIN,
+      MX_THRESHOLD_MAX,
+      mx_max_mapped_seqs_per_target_10kbp,
+      threads,
+      padding,
+      skip_flags,
+      mappings_cache ? mappings_filepath + MAPPINGS_CACHE_EXTENSION : "",
+      mappings_format,
+      target_sorted);
+  }
+
+  // Buffers kept for reuse are bounded by the memory budget too, unless the
+  // pool has a bound of its own
+  FilterPool filter_pool(max_pool_bytes > 0 ? max_pool_bytes
+                                            : memory_budget_bytes);
+  MemoryBudget memory_budget(memory_budget_bytes);
+
+  if (socket_path.empty()) {
+    serve(target_seqs_index,
+          mapped_seqs_index,
+          *all_mappings,
+          filter_params,
+          filter_pool,
+          memory_budget,
+          BATCH_NAME_INPUT_PIPE,
+          BATCH_TARGET_IDS_INPUT_READY_PIPE,
+          TARGET_IDS_INPUT_PIPE,
+          BFS_READY_PIPE,
+          k_values,
+          subsample_max_mapped_seqs_per_target_10kbp);
+  } else {
+    serve_socket(target_seqs_index,
+                 mapped_seqs_index,
+                 *all_mappings,
+                 filter_params,
+                 filter_pool,
+                 memory_budget,
+                 socket_path,
+                 filter_files,
+                 k_values,
+                 subsample_max_mapped_seqs_per_target_10kbp);
+  }
 
   return 0;
 }
\ No newline at end of file
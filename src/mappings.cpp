@@ -1,330 +1,1278 @@
 #include "mappings.hpp"
 #include "utils.hpp"
 
+#include "bam.hpp"
+
 #include "seqindex.hpp"
 
 #include "btllib/data_stream.hpp"
+#include "btllib/indexlr.hpp"
 #include "btllib/status.hpp"
 #include "btllib/util.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <numeric>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 
-const std::vector<SeqId> AllMappings::EMPTY_MAPPINGS;
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 AllMappings::AllMappings(const std::string& filepath,
                          const SeqIndex& target_seqs_index,
+                         const SeqIndex& mapped_seqs_index,
                          unsigned mx_threshold_min,
                          unsigned mx_threshold_max,
-                         double mx_max_mapped_seqs_per_target_10kbp)
+                         double mx_max_mapped_seqs_per_target_10kbp,
+                         unsigned threads,
+                         uint32_t padding,
+                         uint16_t skip_flags,
+                         const std::string& cache_filepath,
+                         MappingsFormat format,
+                         bool target_sorted)
+  : target_seqs_index(target_seqs_index)
+  , mapped_seqs_index(mapped_seqs_index)
+  , threads(threads)
+  , padding(padding)
+  , skip_flags(skip_flags)
+  , target_sorted(target_sorted)
 {
-  if (btllib::endswith(filepath, ".sam") ||
-      btllib::endswith(filepath, ".bam")) {
-    load_sam(filepath, target_seqs_index);
-  } else if (btllib::endswith(filepath, ".paf")) {
-    load_paf(filepath, target_seqs_index);
-  } else {
-    load_ntlink(filepath, target_seqs_index, mx_threshold_min);
-    filter(mx_max_mapped_seqs_per_target_10kbp,
-           mx_threshold_min,
-           mx_threshold_max,
-           target_seqs_index);
+  if (format == MappingsFormat::FROM_EXTENSION) {
+    format = mappings_format_from_extension(filepath);
   }
-  all_mx_in_common.clear();
-  all_inserted_mappings.clear();
-}
 
-void
-AllMappings::load_mapping(const std::string& mapped_seq_id,
-                          const std::string& target_seq_id,
-                          const SeqIndex& target_seqs_index,
-                          const unsigned mx)
-{
-  if (target_seqs_index.seq_exists(target_seq_id)) {
-    decltype(all_mappings)::iterator it_all_mappings;
-    decltype(all_inserted_mappings)::iterator it_all_inserted_mappings;
-    decltype(all_mx_in_common)::iterator it_all_mx_in_common;
-
-    it_all_mappings = all_mappings.find(target_seq_id);
-    if (it_all_mappings == all_mappings.end()) {
-      const auto emplacement_all_mappings = all_mappings.emplace(
-        target_seq_id, decltype(all_mappings)::mapped_type());
-      const auto emplacement_all_inserted_mappings =
-        all_inserted_mappings.emplace(
-          target_seq_id, decltype(all_inserted_mappings)::mapped_type());
-      const auto emplacement_all_mx_in_common = all_mx_in_common.emplace(
-        target_seq_id, decltype(all_mx_in_common)::mapped_type());
-      it_all_mappings = emplacement_all_mappings.first;
-      it_all_inserted_mappings = emplacement_all_inserted_mappings.first;
-      it_all_mx_in_common = emplacement_all_mx_in_common.first;
-    } else {
-      it_all_inserted_mappings = all_inserted_mappings.find(target_seq_id);
-      it_all_mx_in_common = all_mx_in_common.find(target_seq_id);
+  // Mappings are streamed from stdin, pipes and character devices, like
+  // /dev/stdin, while regular files are loaded whole
+  struct stat st
+  {};
+  if (filepath != "-") {
+    btllib::check_error(stat(filepath.c_str(), &st) != 0,
+                        FN_NAME + ": stat " + filepath + ": " +
+                          btllib::get_strerror());
+    btllib::check_error(!S_ISREG(st.st_mode) && !S_ISFIFO(st.st_mode) &&
+                          !S_ISCHR(st.st_mode),
+                        FN_NAME + ": " + filepath +
+                          " is not a file or a pipe.");
+  }
+  if (filepath == "-" || !S_ISREG(st.st_mode)) {
+    streaming = true;
+    if (target_sorted) {
+      streamed_targets.resize(target_seqs_index.size());
+      finalized_targets.assign(target_seqs_index.size(), 0);
+    }
+    stream_thread = std::thread([=]() {
+      stream_mappings(filepath,
+                      format,
+                      mx_threshold_min,
+                      mx_threshold_max,
+                      mx_max_mapped_seqs_per_target_10kbp);
+    });
+    return;
+  }
+
+  MappingsCacheKey cache_key{};
+  const auto cacheable =
+    !cache_filepath.empty() && make_cache_key(filepath,
+                                              mx_threshold_min,
+                                              mx_threshold_max,
+                                              mx_max_mapped_seqs_per_target_10kbp,
+                                              cache_key);
+
+  if (!cacheable || !load_cache(cache_filepath, cache_key)) {
+    switch (format) {
+      case MappingsFormat::BAM:
+        load_bam(filepath);
+        break;
+      case MappingsFormat::SAM:
+        load_sam(filepath);
+        break;
+      case MappingsFormat::PAF:
+        load_paf(filepath);
+        break;
+      default:
+        load_ntlink(filepath, mx_threshold_min);
+        break;
     }
+    build_loaded_mappings(format == MappingsFormat::NTLINK,
+                          mx_threshold_min,
+                          mx_threshold_max,
+                          mx_max_mapped_seqs_per_target_10kbp);
 
-    if (it_all_inserted_mappings->second.find(mapped_seq_id) ==
-        it_all_inserted_mappings->second.end()) {
-      it_all_mappings->second.emplace_back(mapped_seq_id);
-      it_all_inserted_mappings->second.emplace(mapped_seq_id);
-      it_all_mx_in_common->second.emplace_back(mx);
+    if (cacheable) {
+      save_cache(cache_filepath, cache_key);
     }
   }
+
+  btllib::check_warning(unindexed_mapped_seqs > 0,
+                        FN_NAME + ": Skipped " +
+                          std::to_string(unindexed_mapped_seqs) +
+                          " mappings of sequences missing from the index.");
 }
 
-void
-AllMappings::load_ntlink(const std::string& filepath,
+AllMappings::AllMappings(const std::string& target_seqs_filepath,
+                         const std::string& mapped_seqs_filepath,
+                         const unsigned k,
+                         const unsigned w,
                          const SeqIndex& target_seqs_index,
-                         const unsigned mx_threshold_min)
+                         const SeqIndex& mapped_seqs_index,
+                         const unsigned mx_threshold_min,
+                         const unsigned mx_threshold_max,
+                         const double mx_max_mapped_seqs_per_target_10kbp,
+                         const unsigned threads)
+  : target_seqs_index(target_seqs_index)
+  , mapped_seqs_index(mapped_seqs_index)
+  , threads(threads)
+  , padding(0)
+  , skip_flags(0)
 {
-  btllib::log_info(FN_NAME + ": Loading ntLink mappings from " + filepath +
+  load_minimizers(
+    target_seqs_filepath, mapped_seqs_filepath, k, w, mx_threshold_min);
+  build_loaded_mappings(true,
+                        mx_threshold_min,
+                        mx_threshold_max,
+                        mx_max_mapped_seqs_per_target_10kbp);
+
+  btllib::check_warning(unindexed_mapped_seqs > 0,
+                        FN_NAME + ": Skipped " +
+                          std::to_string(unindexed_mapped_seqs) +
+                          " sequences missing from the index.");
+}
+
+AllMappings::~AllMappings()
+{
+  if (stream_thread.joinable()) {
+    stream_thread.join();
+  }
+}
+
+MappingsFormat
+mappings_format_from_extension(const std::string& filepath)
+{
+  static const std::array<std::string_view, 7> COMPRESSION_EXTENSIONS = {
+    ".gz", ".bz2", ".xz", ".zst", ".lrz", ".7z", ".zip"
+  };
+  std::string uncompressed_filepath = filepath;
+  for (const auto extension : COMPRESSION_EXTENSIONS) {
+    if (btllib::endswith(filepath, std::string(extension))) {
+      uncompressed_filepath.resize(filepath.size() - extension.size());
+      break;
+    }
+  }
+
+  if (btllib::endswith(uncompressed_filepath, ".bam")) {
+    return MappingsFormat::BAM;
+  }
+  if (btllib::endswith(uncompressed_filepath, ".sam")) {
+    return MappingsFormat::SAM;
+  }
+  if (btllib::endswith(uncompressed_filepath, ".paf")) {
+    return MappingsFormat::PAF;
+  }
+  return MappingsFormat::NTLINK;
+}
+
+// Hash evenly spaced blocks of the file, so that edits that keep its size and
+// modification time are still likely to be noticed.
+static uint64_t
+sample_hash(const std::string& filepath, const uint64_t size)
+{
+  static const uint64_t SAMPLE_BLOCKS = 16;
+  static const uint64_t SAMPLE_BLOCK_BYTES = 64ULL * 1024ULL;
+
+  std::ifstream ifs(filepath, std::ios::binary);
+  std::string block(SAMPLE_BLOCK_BYTES, '\0');
+  uint64_t hash = FNV1A_OFFSET_BASIS;
+  const auto last_block_start = size > block.size() ? size - block.size() : 0;
+  for (uint64_t i = 0; i < SAMPLE_BLOCKS; i++) {
+    ifs.seekg(std::streamoff(last_block_start * i / (SAMPLE_BLOCKS - 1)));
+    ifs.read(block.data(), std::streamsize(block.size()));
+    hash = fnv1a_hash(block.data(), size_t(ifs.gcount()), hash);
+    ifs.clear();
+  }
+  return hash;
+}
+
+bool
+AllMappings::make_cache_key(const std::string& filepath,
+                            const unsigned mx_threshold_min,
+                            const unsigned mx_threshold_max,
+                            const double mx_max_mapped_seqs_per_target_10kbp,
+                            MappingsCacheKey& key) const
+{
+  struct stat st
+  {};
+  if (stat(filepath.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+    return false;
+  }
+  key.mappings_size = uint64_t(st.st_size);
+  key.mappings_mtime_ns = get_mtime_ns(st);
+  key.mappings_sample_hash = sample_hash(filepath, key.mappings_size);
+  key.target_seqs_fingerprint = target_seqs_index.fingerprint();
+  key.mapped_seqs_fingerprint = mapped_seqs_index.fingerprint();
+  key.mx_threshold_min = mx_threshold_min;
+  key.mx_threshold_max = mx_threshold_max;
+  key.mx_max_mapped_seqs_per_target_10kbp = mx_max_mapped_seqs_per_target_10kbp;
+  key.padding = padding;
+  key.skip_flags = skip_flags;
+  return true;
+}
+
+bool
+AllMappings::load_cache(const std::string& cache_filepath,
+                        const MappingsCacheKey& key)
+{
+  if (access(cache_filepath.c_str(), R_OK) != 0) {
+    return false;
+  }
+  cache_file = MappedFile(cache_filepath);
+
+  MappingsCacheHeader header{};
+  if (cache_file.size() >= sizeof(header)) {
+    std::memcpy(&header, cache_file.data(), sizeof(header));
+  }
+  const auto target_num = target_seqs_index.size();
+  if (cache_file.size() < sizeof(header) ||
+      std::memcmp(
+        header.magic, MAPPINGS_CACHE_MAGIC, sizeof(MAPPINGS_CACHE_MAGIC)) !=
+        0 ||
+      header.version != MAPPINGS_CACHE_VERSION ||
+      std::memcmp(&header.key, &key, sizeof(key)) != 0 ||
+      header.target_num != target_num ||
+      cache_file.size() !=
+        sizeof(header) + (target_num + 1) * sizeof(uint64_t) +
+          header.mapping_num *
+            (sizeof(SeqId) + 2 * sizeof(MappedInterval))) {
+    btllib::log_info(FN_NAME + ": " + cache_filepath +
+                     " does not match the mappings. Rebuilding it.");
+    cache_file = MappedFile();
+    return false;
+  }
+
+  // NOLINTBEGIN(cppcoreguidelines-pro-type-reinterpret-cast)
+  const auto* const data = cache_file.data() + sizeof(header);
+  offsets = reinterpret_cast<const uint64_t*>(data);
+  mapped_ids = reinterpret_cast<const SeqId*>(
+    data + (target_num + 1) * sizeof(uint64_t));
+  mapped_intervals = reinterpret_cast<const MappedInterval*>(
+    data + (target_num + 1) * sizeof(uint64_t) +
+    header.mapping_num * sizeof(SeqId));
+  target_intervals = mapped_intervals + header.mapping_num;
+  // NOLINTEND(cppcoreguidelines-pro-type-reinterpret-cast)
+  unindexed_mapped_seqs = header.unindexed_mapped_seqs;
+
+  btllib::log_info(FN_NAME + ": Loaded " + std::to_string(header.mapping_num) +
+                   " mappings from " + cache_filepath + ".");
+  return true;
+}
+
+void
+AllMappings::save_cache(const std::string& cache_filepath,
+                        const MappingsCacheKey& key) const
+{
+  btllib::log_info(FN_NAME + ": Saving mappings to " + cache_filepath +
                    "... ");
 
-  std::ifstream ifs(filepath);
-  btllib::check_stream(ifs, filepath);
-  std::string token, mapped_seq_id, target_seq_id;
-  unsigned long i = 0;
-  while (bool(ifs >> token)) {
-    switch (i % 3) {
-      case 0:
-        mapped_seq_id = std::move(token);
-        break;
-      case 1:
-        target_seq_id = std::move(token);
-        break;
-      case 2: {
-        const auto minimizers = std::stoul(token);
-        if (minimizers >= mx_threshold_min) {
-          load_mapping(
-            mapped_seq_id, target_seq_id, target_seqs_index, minimizers);
-        }
-        break;
+  MappingsCacheHeader header{};
+  std::memcpy(header.magic, MAPPINGS_CACHE_MAGIC, sizeof(MAPPINGS_CACHE_MAGIC));
+  header.version = MAPPINGS_CACHE_VERSION;
+  header.key = key;
+  header.target_num = target_seqs_index.size();
+  header.mapping_num = owned_mapped_ids.size();
+  header.unindexed_mapped_seqs = unindexed_mapped_seqs;
+
+  // Write to a temporary file first, so a cache file is always complete
+  const auto tmp_filepath = cache_filepath + ".tmp" + std::to_string(getpid());
+  std::ofstream cachefile(tmp_filepath, std::ios::binary);
+  // NOLINTBEGIN(cppcoreguidelines-pro-type-reinterpret-cast)
+  cachefile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  cachefile.write(
+    reinterpret_cast<const char*>(owned_offsets.data()),
+    std::streamsize(owned_offsets.size() * sizeof(owned_offsets[0])));
+  cachefile.write(
+    reinterpret_cast<const char*>(owned_mapped_ids.data()),
+    std::streamsize(owned_mapped_ids.size() * sizeof(owned_mapped_ids[0])));
+  cachefile.write(reinterpret_cast<const char*>(owned_mapped_intervals.data()),
+                  std::streamsize(owned_mapped_intervals.size() *
+                                  sizeof(owned_mapped_intervals[0])));
+  cachefile.write(reinterpret_cast<const char*>(owned_target_intervals.data()),
+                  std::streamsize(owned_target_intervals.size() *
+                                  sizeof(owned_target_intervals[0])));
+  // NOLINTEND(cppcoreguidelines-pro-type-reinterpret-cast)
+  cachefile.close();
+
+  // Failing to cache is not fatal, the mappings are rebuilt next time
+  if (!cachefile ||
+      std::rename(tmp_filepath.c_str(), cache_filepath.c_str()) != 0) {
+    btllib::log_warning(FN_NAME + ": Failed to save mappings to " +
+                        cache_filepath + ": " + btllib::get_strerror());
+    std::remove(tmp_filepath.c_str());
+    return;
+  }
+  btllib::log_info(FN_NAME + ": Done!");
+}
+
+MappedInterval
+AllMappings::pad_interval(const SeqId mapped_id,
+                          const uint64_t start,
+                          const uint64_t end) const
+{
+  const auto seq_len = mapped_seqs_index.get_seq_len(mapped_id);
+  btllib::check_error(seq_len > UINT32_MAX,
+                      FN_NAME + ": " +
+                        std::string(mapped_seqs_index.get_seq_name(mapped_id)) +
+                        " is too long.");
+  const auto padded_end = end > seq_len - std::min<uint64_t>(seq_len, padding)
+                            ? seq_len
+                            : end + padding;
+  const auto padded_start = start > padding ? start - padding : 0;
+  return { uint32_t(std::min(padded_start, padded_end)),
+           uint32_t(padded_end) };
+}
+
+// Target intervals are clipped to 32 bits like mapped intervals, so mappings
+// past the first 4 Gbp of a target overlap the end of it.
+static MappedInterval
+clip_target_interval(const uint64_t start, const uint64_t end)
+{
+  return { uint32_t(std::min<uint64_t>(start, UINT32_MAX)),
+           uint32_t(std::min<uint64_t>(end, UINT32_MAX)) };
+}
+
+void
+AllMappings::load_mapping(const ParsedMapping& parsed,
+                          std::vector<Mapping>& mappings,
+                          unsigned long& unindexed) const
+{
+  const auto target_id = target_seqs_index.get_seq_id(parsed.target_seq_name);
+  if (target_id == INVALID_SEQ_ID) {
+    return;
+  }
+  const auto mapped_id = mapped_seqs_index.get_seq_id(parsed.mapped_seq_name);
+  if (mapped_id == INVALID_SEQ_ID) {
+    unindexed++;
+    return;
+  }
+  mappings.push_back(
+    Mapping{ target_id,
+             mapped_id,
+             parsed.mx,
+             pad_interval(mapped_id, parsed.mapped_start, parsed.mapped_end),
+             clip_target_interval(parsed.target_start, parsed.target_end) });
+}
+
+// Compressed files, and files that cannot be memory mapped such as pipes, are
+// streamed through btllib::DataSource instead of being parsed in parallel.
+static bool
+is_mappable(const std::string& filepath)
+{
+  static const std::array<std::string_view, 7> COMPRESSION_MAGICS = {
+    std::string_view("\x1f\x8b", 2),             // gzip
+    std::string_view("BZh", 3),                  // bzip2
+    std::string_view("\xfd" "7zXZ\0", 6),        // xz
+    std::string_view("\x28\xb5\x2f\xfd", 4),     // zstd
+    std::string_view("LRZI", 4),                 // lrzip
+    std::string_view("7z\xbc\xaf\x27\x1c", 6),   // 7z
+    std::string_view("PK\x03\x04", 4),           // zip
+  };
+
+  struct stat st
+  {};
+  if (stat(filepath.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+    return false;
+  }
+  std::ifstream ifs(filepath, std::ios::binary);
+  std::array<char, 6> magic{};
+  ifs.read(magic.data(), magic.size());
+  const std::string_view start(magic.data(), size_t(ifs.gcount()));
+  return std::none_of(COMPRESSION_MAGICS.begin(),
+                      COMPRESSION_MAGICS.end(),
+                      [&](const std::string_view compression_magic) {
+                        return start.substr(0, compression_magic.size()) ==
+                               compression_magic;
+                      });
+}
+
+void
+AllMappings::load_lines(const std::string& filepath,
+                        const LineParser parse_line,
+                        const unsigned mx_threshold_min,
+                        const LoadedCallback& loaded)
+{
+  if (!is_mappable(filepath)) {
+    char* line = nullptr;
+    size_t n = 0;
+    btllib::DataSource data_source(filepath);
+    ssize_t len = 0;
+    while ((len = getline(&line, &n, data_source)) > 0) {
+      parse_lines(line,
+                  line + len,
+                  parse_line,
+                  skip_flags,
+                  mx_threshold_min,
+                  loaded_mappings,
+                  unindexed_mapped_seqs);
+      if (loaded) {
+        loaded();
       }
-      default: {
-        btllib::log_error(FN_NAME + ": Invalid switch branch.");
-        std::exit(EXIT_FAILURE); // NOLINT(concurrency-mt-unsafe)
+    }
+    free(line); // NOLINT(cppcoreguidelines-no-malloc,hicpp-no-malloc)
+    return;
+  }
+
+  const MappedFile file(filepath);
+  file.advise(MADV_SEQUENTIAL);
+  const auto* const data = file.data();
+  const auto size = file.size();
+
+  // Chunks start at the line following their nominal start, so each line is
+  // parsed by exactly one chunk
+  const auto chunk_num = std::max(
+    size_t(1), std::min(threads * CHUNKS_PER_THREAD, size / MIN_CHUNK_BYTES));
+  std::vector<const char*> chunk_starts(chunk_num + 1, data + size);
+  chunk_starts[0] = data;
+  for (size_t i = 1; i < chunk_num; i++) {
+    const auto* const pos = data + size * i / chunk_num;
+    chunk_starts[i] = pos[-1] == '\n' ? pos : next_line(pos, data + size);
+  }
+
+  std::vector<std::vector<Mapping>> chunk_mappings(chunk_num);
+  std::vector<unsigned long> chunk_unindexed(chunk_num, 0);
+#pragma omp parallel for num_threads(threads) schedule(dynamic)
+  for (size_t i = 0; i < chunk_num; i++) {
+    parse_lines(chunk_starts[i],
+                chunk_starts[i + 1],
+                parse_line,
+                skip_flags,
+                mx_threshold_min,
+                chunk_mappings[i],
+                chunk_unindexed[i]);
+  }
+
+  // Concatenate the chunks in file order, so the result is the same as
+  // parsing the file serially
+  size_t total = loaded_mappings.size();
+  for (const auto& mappings : chunk_mappings) {
+    total += mappings.size();
+  }
+  loaded_mappings.reserve(total);
+  for (size_t i = 0; i < chunk_num; i++) {
+    loaded_mappings.insert(loaded_mappings.end(),
+                           chunk_mappings[i].begin(),
+                           chunk_mappings[i].end());
+    decltype(chunk_mappings)::value_type().swap(chunk_mappings[i]);
+    unindexed_mapped_seqs += chunk_unindexed[i];
+  }
+}
+
+void
+AllMappings::parse_lines(const char* start,
+                         const char* end,
+                         const LineParser parse_line,
+                         const uint16_t skip_flags,
+                         const unsigned mx_threshold_min,
+                         std::vector<Mapping>& mappings,
+                         unsigned long& unindexed) const
+{
+  ParsedMapping mapping;
+  for (const auto* line = start; line < end;) {
+    const auto* const next = next_line(line, end);
+    const auto* line_end = next;
+    while (line_end > line && (line_end[-1] == '\n' || line_end[-1] == '\r')) {
+      line_end--;
+    }
+    if (line_end > line && parse_line(line, line_end, skip_flags, mapping) &&
+        mapping.mx >= mx_threshold_min) {
+      load_mapping(mapping, mappings, unindexed);
+    }
+    line = next;
+  }
+}
+
+// Split off the field at pos, up to the next separator, and move pos past the
+// separator.
+static std::string_view
+next_field(const char*& pos, const char* const end, const char separator)
+{
+  const auto* field_end =
+    static_cast<const char*>(std::memchr(pos, separator, end - pos));
+  if (field_end == nullptr) {
+    field_end = end;
+  }
+  const std::string_view field(pos, field_end - pos);
+  pos = field_end == end ? end : field_end + 1;
+  return field;
+}
+
+// Split off the next whitespace separated token.
+static std::string_view
+next_token(const char*& pos, const char* const end)
+{
+  while (pos < end && std::isspace(static_cast<unsigned char>(*pos)) != 0) {
+    pos++;
+  }
+  const auto* const token_start = pos;
+  while (pos < end && std::isspace(static_cast<unsigned char>(*pos)) == 0) {
+    pos++;
+  }
+  return { token_start, size_t(pos - token_start) };
+}
+
+template<typename T>
+static bool
+parse_number(const std::string_view field, T& value)
+{
+  const auto result =
+    std::from_chars(field.data(), field.data() + field.size(), value);
+  return result.ec == std::errc() && !field.empty() &&
+         result.ptr == field.data() + field.size();
+}
+
+static bool
+parse_ntlink_line(const char* line,
+                  const char* const end,
+                  const uint16_t /*skip_flags*/,
+                  ParsedMapping& mapping)
+{
+  mapping.mapped_seq_name = next_token(line, end);
+  mapping.target_seq_name = next_token(line, end);
+  const auto minimizers = next_token(line, end);
+  if (mapping.mapped_seq_name.empty()) {
+    return false;
+  }
+  mapping.target_start = 0;
+  mapping.target_end = UINT64_MAX;
+  btllib::check_error(!parse_number(minimizers, mapping.mx),
+                      FN_NAME + ": Invalid ntLink mapping line: " +
+                        std::string(mapping.mapped_seq_name) + " " +
+                        std::string(mapping.target_seq_name) + " " +
+                        std::string(minimizers));
+  return true;
+}
+
+static bool
+parse_sam_line(const char* line,
+               const char* const end,
+               const uint16_t skip_flags,
+               ParsedMapping& mapping)
+{
+  if (*line == '@') {
+    return false;
+  }
+  mapping.mapped_seq_name = next_field(line, end, '\t'); // QNAME
+  const auto flag_field = next_field(line, end, '\t');
+  mapping.target_seq_name = next_field(line, end, '\t'); // RNAME
+  const auto pos_field = next_field(line, end, '\t');
+  next_field(line, end, '\t'); // MAPQ
+  const auto cigar = next_field(line, end, '\t');
+
+  uint16_t flag = 0;
+  btllib::check_error(!parse_number(flag_field, flag),
+                      FN_NAME + ": Invalid SAM flag: " +
+                        std::string(flag_field));
+  if ((flag & skip_flags) != 0) {
+    return false;
+  }
+
+  mapping.mx = 0;
+  mapping.mapped_start = 0;
+  mapping.mapped_end = UINT64_MAX;
+  mapping.target_start = 0;
+  mapping.target_end = UINT64_MAX;
+  if (!cigar.empty() && cigar != "*") {
+    CigarSpans spans;
+    uint32_t len = 0;
+    for (const auto c : cigar) {
+      if (c >= '0' && c <= '9') {
+        len = len * 10 + uint32_t(c - '0'); // NOLINT
+        continue;
       }
+      const auto op = CigarSpans::CIGAR_OPS.find(c);
+      btllib::check_error(op == std::string_view::npos,
+                          FN_NAME + ": Invalid CIGAR: " + std::string(cigar));
+      spans.add(len, unsigned(op));
+      len = 0;
+    }
+    mapping.mapped_start = spans.query_start((flag & BAM_FLAG_REVERSE) != 0);
+    mapping.mapped_end = mapping.mapped_start + spans.query_span;
+    // POS is 1-based
+    uint64_t pos = 0;
+    if (parse_number(pos_field, pos) && pos > 0) {
+      mapping.target_start = pos - 1;
+      mapping.target_end = mapping.target_start + spans.ref_span;
     }
-    i++;
   }
-  btllib::log_info(FN_NAME + ": Done!");
+  return true;
+}
+
+static bool
+parse_paf_line(const char* line,
+               const char* const end,
+               const uint16_t /*skip_flags*/,
+               ParsedMapping& mapping)
+{
+  if (*line == '@') {
+    return false;
+  }
+  mapping.mapped_seq_name = next_field(line, end, '\t'); // Query name
+  next_field(line, end, '\t');                           // Query length
+  const auto query_start = next_field(line, end, '\t');
+  const auto query_end = next_field(line, end, '\t');
+  next_field(line, end, '\t');                           // Strand
+  mapping.target_seq_name = next_field(line, end, '\t'); // Target name
+  next_field(line, end, '\t');                           // Target length
+  const auto target_start = next_field(line, end, '\t');
+  const auto target_end = next_field(line, end, '\t');
+  mapping.mx = 0;
+  btllib::check_error(!parse_number(query_start, mapping.mapped_start) ||
+                        !parse_number(query_end, mapping.mapped_end),
+                      FN_NAME + ": Invalid PAF query coordinates: " +
+                        std::string(query_start) + " " +
+                        std::string(query_end));
+  btllib::check_error(!parse_number(target_start, mapping.target_start) ||
+                        !parse_number(target_end, mapping.target_end),
+                      FN_NAME + ": Invalid PAF target coordinates: " +
+                        std::string(target_start) + " " +
+                        std::string(target_end));
+  return true;
 }
 
 void
-AllMappings::load_sam(const std::string& filepath,
-                      const SeqIndex& target_seqs_index)
+AllMappings::sort_mappings(std::vector<Mapping>& mappings)
 {
-  enum Column
-  {
-    QNAME = 1,
-    FLAG,
-    RNAME,
-    POS,
-    MAPQ,
-    CIGAR,
-    RNEXT,
-    PNEXT,
-    TLEN,
-    SEQ,
-    QUAL
+  // Stable LSD radix sort, one byte at a time, skipping the bytes that are the
+  // same for all mappings. Stability keeps the first loaded of duplicate
+  // mappings first.
+  const auto key = [](const Mapping& mapping) {
+    return (uint64_t(mapping.target_id) << 32U) | mapping.mapped_id;
   };
+  static const unsigned RADIX_BITS = 8;
+  static const size_t RADIX = 1ULL << RADIX_BITS;
+  std::vector<Mapping> sorted(mappings.size());
+  for (unsigned shift = 0; shift < 64; shift += RADIX_BITS) {
+    std::vector<size_t> counts(RADIX + 1, 0);
+    for (const auto& mapping : mappings) {
+      counts[((key(mapping) >> shift) & (RADIX - 1)) + 1]++;
+    }
+    if (std::any_of(counts.begin(), counts.end(), [&](const size_t count) {
+          return count == mappings.size();
+        })) {
+      continue;
+    }
+    std::partial_sum(counts.begin(), counts.end(), counts.begin());
+    for (const auto& mapping : mappings) {
+      sorted[counts[(key(mapping) >> shift) & (RADIX - 1)]++] = mapping;
+    }
+    mappings.swap(sorted);
+  }
+}
 
+// Extend interval to the span of it and other
+static void
+merge_intervals(MappedInterval& interval, const MappedInterval& other)
+{
+  interval.start = std::min(interval.start, other.start);
+  interval.end = std::max(interval.end, other.end);
+}
+
+void
+AllMappings::build_mappings()
+{
+  btllib::log_info(FN_NAME + ": Sorting " +
+                   std::to_string(loaded_mappings.size()) + " mappings... ");
+
+  sort_mappings(loaded_mappings);
+
+  // Duplicate mappings keep the first minimizer count and the span of all
+  // their intervals
+  owned_offsets.assign(target_seqs_index.size() + 1, 0);
+  owned_mapped_ids.reserve(loaded_mappings.size());
+  owned_mapped_intervals.reserve(loaded_mappings.size());
+  owned_target_intervals.reserve(loaded_mappings.size());
+  mx_in_common.reserve(loaded_mappings.size());
+  for (size_t i = 0; i < loaded_mappings.size(); i++) {
+    const auto& mapping = loaded_mappings[i];
+    if (i > 0 && mapping.target_id == loaded_mappings[i - 1].target_id &&
+        mapping.mapped_id == loaded_mappings[i - 1].mapped_id) {
+      merge_intervals(owned_mapped_intervals.back(), mapping.interval);
+      merge_intervals(owned_target_intervals.back(), mapping.target_interval);
+      continue;
+    }
+    owned_offsets[mapping.target_id + 1]++;
+    owned_mapped_ids.push_back(mapping.mapped_id);
+    owned_mapped_intervals.push_back(mapping.interval);
+    owned_target_intervals.push_back(mapping.target_interval);
+    mx_in_common.push_back(mapping.mx);
+  }
+  std::partial_sum(
+    owned_offsets.begin(), owned_offsets.end(), owned_offsets.begin());
+  decltype(loaded_mappings)().swap(loaded_mappings);
+
+  btllib::log_info(FN_NAME + ": Done!");
+}
+
+void
+AllMappings::build_loaded_mappings(
+  const bool filter_mx,
+  const unsigned mx_threshold_min,
+  const unsigned mx_threshold_max,
+  const double mx_max_mapped_seqs_per_target_10kbp)
+{
+  build_mappings();
+  if (filter_mx) {
+    filter(mx_max_mapped_seqs_per_target_10kbp,
+           mx_threshold_min,
+           mx_threshold_max);
+  }
+  decltype(mx_in_common)().swap(mx_in_common);
+
+  offsets = owned_offsets.data();
+  mapped_ids = owned_mapped_ids.data();
+  mapped_intervals = owned_mapped_intervals.data();
+  target_intervals = owned_target_intervals.data();
+}
+
+void
+AllMappings::load_ntlink(const std::string& filepath,
+                         const unsigned mx_threshold_min,
+                         const LoadedCallback& loaded)
+{
+  btllib::log_info(FN_NAME + ": Loading ntLink mappings from " + filepath +
+                   "... ");
+  load_lines(filepath, parse_ntlink_line, mx_threshold_min, loaded);
+  btllib::log_info(FN_NAME + ": Done!");
+}
+
+void
+AllMappings::load_sam(const std::string& filepath,
+                      const LoadedCallback& loaded)
+{
   btllib::log_info(FN_NAME + ": Loading SAM mappings from " + filepath +
                    "... ");
+  load_lines(filepath, parse_sam_line, 0, loaded);
+  btllib::log_info(FN_NAME + ": Done!");
+}
 
-  size_t n = 2048; // NOLINT
-  char* line = new char[n];
-  btllib::DataSource data_source(filepath);
+void
+AllMappings::load_bam(const std::string& filepath,
+                      const LoadedCallback& loaded)
+{
+  btllib::log_info(FN_NAME + ": Loading BAM mappings from " + filepath +
+                   "... ");
 
-  std::string token, mapped_seq_id, target_seq_id;
-  while (getline(&line, &n, data_source) > 0) {
-    if (line[0] == '@') {
-      continue;
+  BamReader reader(filepath, threads);
+
+  // Reference names are looked up once, records only refer to their index
+  const auto& ref_names = reader.get_ref_names();
+  std::vector<SeqId> ref_target_ids(ref_names.size());
+  for (size_t i = 0; i < ref_names.size(); i++) {
+    ref_target_ids[i] = target_seqs_index.get_seq_id(ref_names[i]);
+  }
+  const auto is_loaded = [&](const BamRecord& record) {
+    return record.ref_id >= 0 && size_t(record.ref_id) < ref_names.size() &&
+           ref_target_ids[record.ref_id] != INVALID_SEQ_ID &&
+           (record.flag & skip_flags) == 0;
+  };
+
+  std::vector<BamRecord> records;
+  std::vector<SeqId> record_mapped_ids;
+  while (reader.read_records(records)) {
+    record_mapped_ids.resize(records.size());
+#pragma omp parallel for num_threads(threads) schedule(dynamic, 1024)
+    for (size_t i = 0; i < records.size(); i++) {
+      record_mapped_ids[i] =
+        is_loaded(records[i])
+          ? mapped_seqs_index.get_seq_id(records[i].name)
+          : INVALID_SEQ_ID;
     }
-    std::stringstream ss(line);
-    Column column = QNAME;
-    while (bool(ss >> token)) {
-      switch (column) {
-        case QNAME:
-          mapped_seq_id = std::move(token);
-          break;
-        case RNAME:
-          target_seq_id = std::move(token);
-          break;
-        default: {
-          break;
-        }
+    for (size_t i = 0; i < records.size(); i++) {
+      if (!is_loaded(records[i])) {
+        continue;
+      }
+      if (record_mapped_ids[i] == INVALID_SEQ_ID) {
+        unindexed_mapped_seqs++;
+        continue;
       }
-      column = Column(int(column) + 1);
+      const auto mapped_id = record_mapped_ids[i];
+      loaded_mappings.push_back(
+        Mapping{ ref_target_ids[records[i].ref_id],
+                 mapped_id,
+                 0,
+                 pad_interval(mapped_id,
+                              records[i].query_start,
+                              records[i].query_end == UINT32_MAX
+                                ? UINT64_MAX
+                                : records[i].query_end),
+                 records[i].pos >= 0 && records[i].query_end != UINT32_MAX
+                   ? clip_target_interval(uint64_t(records[i].pos),
+                                          uint64_t(records[i].pos) +
+                                            records[i].ref_span)
+                   : WHOLE_TARGET });
+    }
+    if (loaded) {
+      loaded();
     }
-    load_mapping(mapped_seq_id, target_seq_id, target_seqs_index, 0);
   }
   btllib::log_info(FN_NAME + ": Done!");
 }
 
 void
 AllMappings::load_paf(const std::string& filepath,
-                      const SeqIndex& target_seqs_index)
+                      const LoadedCallback& loaded)
 {
-  enum Column
-  {
-    QUERY_ID = 1,
-    QUERY_LEN,
-    QUERY_START,
-    QUERY_END,
-    STRAND,
-    TARGET_ID,
-    TARGET_LEN,
-    TARGET_START,
-    TARGET_END,
-    RESIDUE_MATCHES,
-    ALIGNMENT_LEN,
-    MAPPING_QUAL
-  };
-
   btllib::log_info(FN_NAME + ": Loading PAF mappings from " + filepath +
                    "... ");
+  load_lines(filepath, parse_paf_line, 0, loaded);
+  btllib::log_info(FN_NAME + ": Done!");
+}
 
-  size_t n = 2048; // NOLINT
-  char* line = new char[n];
-  btllib::DataSource data_source(filepath);
+void
+AllMappings::load_minimizers(const std::string& target_seqs_filepath,
+                             const std::string& mapped_seqs_filepath,
+                             const unsigned k,
+                             const unsigned w,
+                             const unsigned mx_threshold_min)
+{
+  static const size_t MAPPED_SEQS_PER_BATCH = 4096;
 
-  std::string token, mapped_seq_id, target_seq_id;
-  while (getline(&line, &n, data_source) > 0) {
-    if (line[0] == '@') {
-      continue;
+  btllib::log_info(FN_NAME + ": Indexing minimizers of " +
+                   target_seqs_filepath + "... ");
+  // Minimizers found more than once in the targets don't tell where a mapped
+  // sequence belongs, so they are kept with an invalid ID and not counted
+  std::unordered_map<uint64_t, SeqId> target_minimizers;
+  {
+    btllib::Indexlr indexlr(target_seqs_filepath,
+                            k,
+                            w,
+                            btllib::Indexlr::Flag::LONG_MODE,
+                            threads);
+    btllib::Indexlr::Record record;
+    while ((record = indexlr.read())) {
+      const auto target_id = target_seqs_index.get_seq_id(record.id);
+      if (target_id == INVALID_SEQ_ID) {
+        continue;
+      }
+      for (const auto& minimizer : record.minimizers) {
+        const auto inserted =
+          target_minimizers.emplace(minimizer.out_hash, target_id);
+        if (!inserted.second) {
+          inserted.first->second = INVALID_SEQ_ID;
+        }
+      }
     }
-    std::stringstream ss(line);
-    Column column = QUERY_ID;
-    while (bool(ss >> token)) {
-      switch (column) {
-        case QUERY_ID:
-          mapped_seq_id = std::move(token);
-          break;
-        case TARGET_ID:
-          target_seq_id = std::move(token);
-          break;
-        default: {
-          break;
+  }
+  btllib::log_info(FN_NAME + ": Done!");
+
+  btllib::log_info(FN_NAME + ": Mapping " + mapped_seqs_filepath +
+                   " by minimizers... ");
+  btllib::Indexlr indexlr(mapped_seqs_filepath,
+                          k,
+                          w,
+                          btllib::Indexlr::Flag::LONG_MODE,
+                          threads);
+  // Records are read serially and the minimizers of each batch are looked up
+  // in parallel
+  std::vector<btllib::Indexlr::Record> records;
+  std::vector<std::vector<Mapping>> record_mappings;
+  std::vector<char> record_unindexed;
+  for (;;) {
+    records.clear();
+    btllib::Indexlr::Record record;
+    while (records.size() < MAPPED_SEQS_PER_BATCH &&
+           (record = indexlr.read())) {
+      records.push_back(std::move(record));
+    }
+    if (records.empty()) {
+      break;
+    }
+
+    record_mappings.resize(records.size());
+    record_unindexed.assign(records.size(), 0);
+#pragma omp parallel num_threads(threads)
+    {
+      std::vector<SeqId> hits;
+#pragma omp for schedule(dynamic, 64)
+      for (size_t i = 0; i < records.size(); i++) {
+        record_mappings[i].clear();
+        hits.clear();
+        for (const auto& minimizer : records[i].minimizers) {
+          const auto it = target_minimizers.find(minimizer.out_hash);
+          if (it != target_minimizers.end() && it->second != INVALID_SEQ_ID) {
+            hits.push_back(it->second);
+          }
+        }
+        if (hits.empty()) {
+          continue;
+        }
+        const auto mapped_id = mapped_seqs_index.get_seq_id(records[i].id);
+        if (mapped_id == INVALID_SEQ_ID) {
+          record_unindexed[i] = 1;
+          continue;
+        }
+        // The minimizers in common with each target are its run of hits
+        std::sort(hits.begin(), hits.end());
+        for (size_t start = 0, end = 0; start < hits.size(); start = end) {
+          while (end < hits.size() && hits[end] == hits[start]) {
+            end++;
+          }
+          if (end - start >= mx_threshold_min) {
+            record_mappings[i].push_back(
+              Mapping{ hits[start],
+                       mapped_id,
+                       unsigned(end - start),
+                       pad_interval(mapped_id, 0, UINT64_MAX),
+                       WHOLE_TARGET });
+          }
         }
       }
-      column = Column(int(column) + 1);
     }
-    load_mapping(mapped_seq_id, target_seq_id, target_seqs_index, 0);
+
+    for (size_t i = 0; i < records.size(); i++) {
+      loaded_mappings.insert(loaded_mappings.end(),
+                             record_mappings[i].begin(),
+                             record_mappings[i].end());
+      unindexed_mapped_seqs += record_unindexed[i];
+    }
   }
   btllib::log_info(FN_NAME + ": Done!");
 }
 
-unsigned
-mapped_seqs_for_threshold(const std::vector<unsigned>& mx_in_common,
-                          const unsigned mx_threshold)
+// Smallest threshold in [mx_threshold_min, mx_threshold_max] that keeps at
+// most max_mapped_seqs mappings, or mx_threshold_max if none does. counts is
+// reused between calls.
+static unsigned
+find_mx_threshold(const Span<unsigned>& mx_in_common,
+                  const size_t max_mapped_seqs,
+                  const unsigned mx_threshold_min,
+                  const unsigned mx_threshold_max,
+                  std::vector<size_t>& counts)
 {
-  unsigned mapped_seq_num = 0;
+  if (mx_in_common.size() <= max_mapped_seqs) {
+    return mx_threshold_min;
+  }
+  // Counts above the max threshold are clamped to it, which doesn't change
+  // how many mappings any threshold up to it keeps
+  counts.assign(mx_threshold_max + 1, 0);
   for (const auto mx : mx_in_common) {
-    if (mx >= mx_threshold) {
-      mapped_seq_num++;
+    counts[std::min(mx, mx_threshold_max)]++;
+  }
+  // The mappings kept by a threshold are the suffix sum of the counts
+  size_t kept = 0;
+  for (unsigned mx_threshold = mx_threshold_max;
+       mx_threshold > mx_threshold_min;
+       mx_threshold--) {
+    kept += counts[mx_threshold];
+    if (kept > max_mapped_seqs) {
+      return std::min(mx_threshold + 1, mx_threshold_max);
     }
   }
-  return mapped_seq_num;
+  return mx_threshold_min + 1;
 }
 
-void
-AllMappings::filter(const double max_mapped_seqs_per_target_10kbp,
+static void
+check_filter_params(const double max_mapped_seqs_per_target_10kbp,
                     const unsigned mx_threshold_min,
-                    const unsigned mx_threshold_max,
-                    const SeqIndex& target_seqs_index)
+                    const unsigned mx_threshold_max)
 {
-  btllib::log_info(FN_NAME + ": Filtering contig mapped_seqs... ");
-
   btllib::check_error(max_mapped_seqs_per_target_10kbp <= 0,
                       FN_NAME +
                         ": max_mapped_seqs_per_target_10kbp is not positive.");
   btllib::check_error(
     mx_threshold_min >= mx_threshold_max,
     FN_NAME + ": mx_threshold_min is not smaller than mx_threshold_max.");
+}
 
-  for (auto& target_mappings : all_mappings) {
-    const auto& target_seq_id = target_mappings.first;
-    const auto& mappings = target_mappings.second;
-    if (mappings.empty()) {
-      continue;
+// Most mappings a target of target_seq_len bases keeps
+static size_t
+max_mapped_seqs(const size_t target_seq_len,
+                const double max_mapped_seqs_per_target_10kbp)
+{
+  const int max_mapped_seqs = std::ceil(
+    double(target_seq_len) * max_mapped_seqs_per_target_10kbp / 10'000.0);
+  btllib::check_error(max_mapped_seqs <= 0, FN_NAME + ": max_mapped_seqs <= 0.");
+  return size_t(max_mapped_seqs);
+}
+
+void
+AllMappings::filter(const double max_mapped_seqs_per_target_10kbp,
+                    const unsigned mx_threshold_min,
+                    const unsigned mx_threshold_max)
+{
+  btllib::log_info(FN_NAME + ": Filtering contig mapped_seqs... ");
+
+  check_filter_params(max_mapped_seqs_per_target_10kbp,
+                      mx_threshold_min,
+                      mx_threshold_max);
+
+  // Pick every target's threshold and count the mappings it keeps, then
+  // copy the kept mappings into their new positions
+  const auto target_num = target_seqs_index.size();
+  std::vector<unsigned> mx_thresholds(target_num, 0);
+  std::vector<uint64_t> kept_offsets(target_num + 1, 0);
+#pragma omp parallel num_threads(threads)
+  {
+    std::vector<size_t> counts;
+#pragma omp for schedule(dynamic, 64)
+    for (size_t target_id = 0; target_id < target_num; target_id++) {
+      const auto mappings_start = owned_offsets[target_id];
+      const Span<unsigned> target_mx_in_common(
+        mx_in_common.data() + mappings_start,
+        owned_offsets[target_id + 1] - mappings_start);
+      if (target_mx_in_common.empty()) {
+        continue;
+      }
+
+      const auto mx_threshold = find_mx_threshold(
+        target_mx_in_common,
+        max_mapped_seqs(target_seqs_index.get_seq_len(target_id),
+                        max_mapped_seqs_per_target_10kbp),
+        mx_threshold_min,
+        mx_threshold_max,
+        counts);
+      mx_thresholds[target_id] = mx_threshold;
+      kept_offsets[target_id + 1] = std::count_if(
+        target_mx_in_common.begin(),
+        target_mx_in_common.end(),
+        [&](const unsigned mx) { return mx >= mx_threshold; });
     }
-    const auto& mx_in_common = all_mx_in_common.at(target_seq_id);
+  }
+  std::partial_sum(
+    kept_offsets.begin(), kept_offsets.end(), kept_offsets.begin());
+
+  std::vector<SeqId> kept_mapped_ids(kept_offsets.back());
+  std::vector<MappedInterval> kept_mapped_intervals(kept_offsets.back());
+  std::vector<MappedInterval> kept_target_intervals(kept_offsets.back());
+  std::vector<unsigned> kept_mx_in_common(kept_offsets.back());
+#pragma omp parallel for num_threads(threads) schedule(dynamic, 64)
+  for (size_t target_id = 0; target_id < target_num; target_id++) {
+    auto kept = kept_offsets[target_id];
+    for (auto i = owned_offsets[target_id]; i < owned_offsets[target_id + 1];
+         i++) {
+      if (mx_in_common[i] >= mx_thresholds[target_id]) {
+        kept_mapped_ids[kept] = owned_mapped_ids[i];
+        kept_mapped_intervals[kept] = owned_mapped_intervals[i];
+        kept_target_intervals[kept] = owned_target_intervals[i];
+        kept_mx_in_common[kept] = mx_in_common[i];
+        kept++;
+      }
+    }
+  }
+  owned_offsets.swap(kept_offsets);
+  owned_mapped_ids.swap(kept_mapped_ids);
+  owned_mapped_intervals.swap(kept_mapped_intervals);
+  owned_target_intervals.swap(kept_target_intervals);
+  mx_in_common.swap(kept_mx_in_common);
+  btllib::log_info(FN_NAME + ": Done!");
+}
+
+void
+AllMappings::stream_mappings(const std::string& filepath,
+                             const MappingsFormat format,
+                             const unsigned mx_threshold_min,
+                             const unsigned mx_threshold_max,
+                             const double mx_max_mapped_seqs_per_target_10kbp)
+{
+  const auto filter_mx = format == MappingsFormat::NTLINK;
+  if (filter_mx) {
+    check_filter_params(
+      mx_max_mapped_seqs_per_target_10kbp, mx_threshold_min, mx_threshold_max);
+  }
+  LoadedCallback loaded;
+  if (target_sorted) {
+    loaded = [&]() {
+      finalize_targets(false,
+                       filter_mx,
+                       mx_threshold_min,
+                       mx_threshold_max,
+                       mx_max_mapped_seqs_per_target_10kbp);
+    };
+  }
+
+  switch (format) {
+    case MappingsFormat::BAM:
+      load_bam(filepath, loaded);
+      break;
+    case MappingsFormat::SAM:
+      load_sam(filepath, loaded);
+      break;
+    case MappingsFormat::PAF:
+      load_paf(filepath, loaded);
+      break;
+    default:
+      load_ntlink(filepath, mx_threshold_min, loaded);
+      break;
+  }
+
+  if (target_sorted) {
+    finalize_targets(true,
+                     filter_mx,
+                     mx_threshold_min,
+                     mx_threshold_max,
+                     mx_max_mapped_seqs_per_target_10kbp);
+  } else {
+    build_loaded_mappings(filter_mx,
+                          mx_threshold_min,
+                          mx_threshold_max,
+                          mx_max_mapped_seqs_per_target_10kbp);
+  }
+
+  btllib::check_warning(unindexed_mapped_seqs > 0,
+                        FN_NAME + ": Skipped " +
+                          std::to_string(unindexed_mapped_seqs) +
+                          " mappings of sequences missing from the index.");
 
-    if (!target_seqs_index.seq_exists(target_seq_id)) {
+  const std::unique_lock<std::mutex> lock(stream_mutex);
+  stream_done = true;
+  stream_cv.notify_all();
+}
+
+void
+AllMappings::finalize_targets(const bool stream_ended,
+                              const bool filter_mx,
+                              const unsigned mx_threshold_min,
+                              const unsigned mx_threshold_max,
+                              const double mx_max_mapped_seqs_per_target_10kbp)
+{
+  // Mappings of a single target are still being streamed
+  if (!stream_ended &&
+      (loaded_mappings.empty() ||
+       loaded_mappings.front().target_id == loaded_mappings.back().target_id)) {
+    return;
+  }
+
+  size_t run_start = 0;
+  for (size_t i = 1; i <= loaded_mappings.size(); i++) {
+    if (i < loaded_mappings.size()
+          ? loaded_mappings[i].target_id ==
+              loaded_mappings[run_start].target_id
+          : !stream_ended) {
       continue;
     }
-    const auto target_seq_len = target_seqs_index.get_seq_len(target_seq_id);
-    const int max_mapped_seqs = std::ceil(
-      double(target_seq_len) * max_mapped_seqs_per_target_10kbp / 10'000.0);
-    btllib::check_error(max_mapped_seqs <= 0,
-                        FN_NAME + ": max_mapped_seqs <= 0.");
-
-    int updated_mx_threshold_min = int(mx_threshold_min);
-    int updated_mx_threshold_min_mapped_seqs = int(mappings.size());
-
-    int updated_mx_threshold_max = int(mx_threshold_max);
-    int updated_mx_threshold_max_mapped_seqs =
-      int(mapped_seqs_for_threshold(mx_in_common, updated_mx_threshold_max));
-
-    int mx_threshold = -1;
-    if (updated_mx_threshold_min_mapped_seqs <= max_mapped_seqs) {
-      mx_threshold = updated_mx_threshold_min;
-    } else if (updated_mx_threshold_max_mapped_seqs > max_mapped_seqs) {
-      mx_threshold = updated_mx_threshold_max;
-    } else {
-      while (updated_mx_threshold_max - updated_mx_threshold_min > 1) {
-        const int mx_threshold_mid =
-          (updated_mx_threshold_max + updated_mx_threshold_min) / 2;
-        const int mx_threshold_mid_mapped_seqs =
-          int(mapped_seqs_for_threshold(mx_in_common, mx_threshold_mid));
-        if (mx_threshold_mid_mapped_seqs > max_mapped_seqs) {
-          updated_mx_threshold_min = mx_threshold_mid;
-          updated_mx_threshold_min_mapped_seqs = mx_threshold_mid_mapped_seqs;
-        } else {
-          updated_mx_threshold_max = mx_threshold_mid;
-          updated_mx_threshold_max_mapped_seqs = mx_threshold_mid_mapped_seqs;
-        }
-      }
-      mx_threshold = updated_mx_threshold_max;
-
-      btllib::check_error(
-        std::abs(updated_mx_threshold_min - updated_mx_threshold_max) > 1,
-        FN_NAME +
-          ": abs(updated_mx_threshold_min - updated_mx_threshold_max) > 1.");
-      btllib::check_error(updated_mx_threshold_min_mapped_seqs <=
-                            max_mapped_seqs,
-                          FN_NAME + ": Min threshold wrongly calculated.");
-      btllib::check_error(updated_mx_threshold_max_mapped_seqs >
-                            max_mapped_seqs,
-                          FN_NAME + ": Max threshold wrongly calculated.");
-      btllib::check_error(
-        updated_mx_threshold_min >= updated_mx_threshold_max,
-        FN_NAME + ": updated_mx_threshold_min >= updated_mx_threshold_max.");
+    const auto target_id = loaded_mappings[run_start].target_id;
+    btllib::check_error(
+      finalized_targets[target_id] != 0,
+      FN_NAME + ": Mappings are not sorted by target, " +
+        std::string(target_seqs_index.get_seq_name(target_id)) +
+        " appears more than once.");
+    finalize_target(
+      Span<Mapping>(loaded_mappings.data() + run_start, i - run_start),
+      filter_mx,
+      mx_threshold_min,
+      mx_threshold_max,
+      mx_max_mapped_seqs_per_target_10kbp);
+    run_start = i;
+  }
+  loaded_mappings.erase(loaded_mappings.begin(),
+                        loaded_mappings.begin() + ssize_t(run_start));
+}
+
+void
+AllMappings::finalize_target(const Span<Mapping>& mappings,
+                             const bool filter_mx,
+                             const unsigned mx_threshold_min,
+                             const unsigned mx_threshold_max,
+                             const double mx_max_mapped_seqs_per_target_10kbp)
+{
+  const auto target_id = mappings[0].target_id;
+  std::vector<Mapping> sorted(mappings.begin(), mappings.end());
+  sort_mappings(sorted);
+
+  // Same deduplication as build_mappings
+  std::vector<Mapping> deduped;
+  deduped.reserve(sorted.size());
+  for (const auto& mapping : sorted) {
+    if (!deduped.empty() && mapping.mapped_id == deduped.back().mapped_id) {
+      merge_intervals(deduped.back().interval, mapping.interval);
+      merge_intervals(deduped.back().target_interval, mapping.target_interval);
+      continue;
     }
+    deduped.push_back(mapping);
+  }
 
-    btllib::check_error(mx_threshold < 0, FN_NAME + ": mx_threshold < 0.");
-    btllib::check_error(mx_threshold < int(mx_threshold_min),
-                        FN_NAME + ": mx_threshold < mx_threshold_min.");
-    btllib::check_error(mx_threshold > int(mx_threshold_max),
-                        FN_NAME + ": mx_threshold > mx_threshold_max.");
+  auto mx_threshold = 0U;
+  if (filter_mx) {
+    std::vector<unsigned> target_mx_in_common(deduped.size());
+    for (size_t i = 0; i < deduped.size(); i++) {
+      target_mx_in_common[i] = deduped[i].mx;
+    }
+    std::vector<size_t> counts;
+    mx_threshold = find_mx_threshold(
+      Span<unsigned>(target_mx_in_common.data(), target_mx_in_common.size()),
+      max_mapped_seqs(target_seqs_index.get_seq_len(target_id),
+                      mx_max_mapped_seqs_per_target_10kbp),
+      mx_threshold_min,
+      mx_threshold_max,
+      counts);
+  }
 
-    std::vector<SeqId> new_mappings;
-    for (size_t i = 0; i < mappings.size(); i++) {
-      if (int(mx_in_common[i]) >= mx_threshold) {
-        new_mappings.push_back(mappings[i]);
-      }
+  auto& target = streamed_targets[target_id];
+  for (const auto& mapping : deduped) {
+    if (mapping.mx >= mx_threshold) {
+      target.mapped_ids.push_back(mapping.mapped_id);
+      target.mapped_intervals.push_back(mapping.interval);
+      target.target_intervals.push_back(mapping.target_interval);
     }
-    target_mappings.second = new_mappings;
   }
-  btllib::log_info(FN_NAME + ": Done!");
+
+  const std::unique_lock<std::mutex> lock(stream_mutex);
+  finalized_targets[target_id] = 1;
+  stream_cv.notify_all();
 }
 
-const std::vector<SeqId>&
-AllMappings::get_mappings(const std::string& id) const
+void
+AllMappings::wait_for_target(const SeqId target_id) const
 {
-  const auto it = all_mappings.find(id);
-  if (it == all_mappings.end()) {
-    return EMPTY_MAPPINGS;
+  if (!streaming) {
+    return;
   }
-  return it->second;
-}
\ No newline at end of file
+  std::unique_lock<std::mutex> lock(stream_mutex);
+  stream_cv.wait(lock, [&]() {
+    return stream_done ||
+           (target_sorted && finalized_targets[target_id] != 0);
+  });
+}
+
+Span<SeqId>
+AllMappings::get_mappings(const SeqId target_id) const
+{
+  wait_for_target(target_id);
+  if (!streamed_targets.empty()) {
+    const auto& target = streamed_targets[target_id];
+    return { target.mapped_ids.data(), target.mapped_ids.size() };
+  }
+  return { mapped_ids + offsets[target_id],
+           offsets[target_id + 1] - offsets[target_id] };
+}
+
+Span<MappedInterval>
+AllMappings::get_mapped_intervals(const SeqId target_id) const
+{
+  wait_for_target(target_id);
+  if (!streamed_targets.empty()) {
+    const auto& target = streamed_targets[target_id];
+    return { target.mapped_intervals.data(), target.mapped_intervals.size() };
+  }
+  return { mapped_intervals + offsets[target_id],
+           offsets[target_id + 1] - offsets[target_id] };
+}
+
+Span<MappedInterval>
+AllMappings::get_target_intervals(const SeqId target_id) const
+{
+  wait_for_target(target_id);
+  if (!streamed_targets.empty()) {
+    const auto& target = streamed_targets[target_id];
+    return { target.target_intervals.data(), target.target_intervals.size() };
+  }
+  return { target_intervals + offsets[target_id],
+           offsets[target_id + 1] - offsets[target_id] };
+}
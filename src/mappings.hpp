@@ -2,12 +2,92 @@
 #define MAPPINGS_HPP
 
 #include "seqindex.hpp"
+#include "utils.hpp"
 
-#include <set>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <thread>
+#include <vector>
 
-using SeqId = std::string;
+// Part of a mapped sequence, [start, end), that is inserted into the Bloom
+// filters of the target it maps to. Also used for the part of the target that
+// a sequence maps to.
+struct MappedInterval
+{
+  uint32_t start, end;
+};
+
+// Target interval of mappings that don't say where on the target they are,
+// which overlaps every part of the target
+static const MappedInterval WHOLE_TARGET = { 0, UINT32_MAX };
+
+// A mapping as parsed from a line of a mappings file.
+struct ParsedMapping
+{
+  std::string_view mapped_seq_name, target_seq_name;
+  unsigned mx = 0;
+  // Aligned part of the mapped sequence, all of it if unknown
+  uint64_t mapped_start = 0, mapped_end = UINT64_MAX;
+  // Part of the target it is aligned to, all of it if unknown
+  uint64_t target_start = 0, target_end = UINT64_MAX;
+};
+
+// Filtered mappings are cached next to the mappings file, in native byte
+// order:
+//   MappingsCacheHeader
+//   uint64_t[target_num + 1], offsets of each target's mappings
+//   SeqId[mapping_num], mapped sequences
+//   MappedInterval[mapping_num], their mapped intervals
+//   MappedInterval[mapping_num], the target intervals they map to
+static const char MAPPINGS_CACHE_MAGIC[8] = { 'G', 'P', 'M', 'A', 'P', 0, 0, 0 };
+static const uint32_t MAPPINGS_CACHE_VERSION = 2;
+static const std::string MAPPINGS_CACHE_EXTENSION = ".gpmap";
+
+// Everything that the cached mappings depend on. The cache is only used if
+// all of it matches.
+struct MappingsCacheKey
+{
+  uint64_t mappings_size;
+  int64_t mappings_mtime_ns;
+  uint64_t mappings_sample_hash;
+  uint64_t target_seqs_fingerprint;
+  uint64_t mapped_seqs_fingerprint;
+  uint64_t mx_threshold_min;
+  uint64_t mx_threshold_max;
+  double mx_max_mapped_seqs_per_target_10kbp;
+  uint64_t padding;
+  uint64_t skip_flags;
+};
+
+struct MappingsCacheHeader
+{
+  char magic[sizeof(MAPPINGS_CACHE_MAGIC)];
+  uint32_t version;
+  uint32_t flags;
+  MappingsCacheKey key;
+  uint64_t target_num;
+  uint64_t mapping_num;
+  uint64_t unindexed_mapped_seqs;
+};
+
+enum class MappingsFormat
+{
+  FROM_EXTENSION,
+  NTLINK,
+  PAF,
+  SAM,
+  BAM
+};
+
+// Format of a mappings file named filepath: SAM, BAM and PAF by their
+// extensions, which may be followed by a compression extension as in
+// mappings.paf.gz, ntLink otherwise.
+MappingsFormat
+mappings_format_from_extension(const std::string& filepath);
 
 class AllMappings
 {
@@ -15,37 +95,202 @@ class AllMappings
 public:
   AllMappings(const std::string& filepath,
               const SeqIndex& target_seqs_index,
+              const SeqIndex& mapped_seqs_index,
               unsigned mx_threshold_min,
               unsigned mx_threshold_max,
-              double mx_max_mapped_seqs_per_target_10kbp);
+              double mx_max_mapped_seqs_per_target_10kbp,
+              unsigned threads,
+              uint32_t padding,
+              uint16_t skip_flags = 0,
+              const std::string& cache_filepath = "",
+              MappingsFormat format = MappingsFormat::FROM_EXTENSION,
+              bool target_sorted = false);
+  // Map the mapped sequences to the targets in process instead, by the number
+  // of (k, w) minimizers they have in common, like ntLink mappings.
+  AllMappings(const std::string& target_seqs_filepath,
+              const std::string& mapped_seqs_filepath,
+              unsigned k,
+              unsigned w,
+              const SeqIndex& target_seqs_index,
+              const SeqIndex& mapped_seqs_index,
+              unsigned mx_threshold_min,
+              unsigned mx_threshold_max,
+              double mx_max_mapped_seqs_per_target_10kbp,
+              unsigned threads);
+  ~AllMappings();
 
   AllMappings(const AllMappings&) = delete;
   AllMappings& operator=(const AllMappings&) = delete;
 
-  const std::vector<SeqId>& get_mappings(const std::string& id) const;
+  // Mappings read from stdin ("-") or a pipe are streamed in the background
+  // and the constructor returns right away. Getting a target's mappings then
+  // waits until they are complete: when the stream moves on to another target
+  // if it is sorted by target, or when the stream ends otherwise.
+  Span<SeqId> get_mappings(SeqId target_id) const;
+  // Parts of the sequences returned by get_mappings to use, in the same order.
+  Span<MappedInterval> get_mapped_intervals(SeqId target_id) const;
+  // Parts of the target that the sequences returned by get_mappings map to,
+  // in the same order, or WHOLE_TARGET for mappings without target
+  // coordinates, like ntLink mappings.
+  Span<MappedInterval> get_target_intervals(SeqId target_id) const;
 
 private:
+  // Called after mappings have been appended to loaded_mappings, so streamed
+  // mappings can be handed out before the whole file is loaded.
+  using LoadedCallback = std::function<void()>;
+
   void load_ntlink(const std::string& filepath,
-                   const SeqIndex& target_seqs_index,
-                   unsigned mx_threshold_min);
-  void load_sam(const std::string& filepath, const SeqIndex& target_seqs_index);
-  void load_paf(const std::string& filepath, const SeqIndex& target_seqs_index);
+                   unsigned mx_threshold_min,
+                   const LoadedCallback& loaded = nullptr);
+  void load_sam(const std::string& filepath,
+                const LoadedCallback& loaded = nullptr);
+  void load_bam(const std::string& filepath,
+                const LoadedCallback& loaded = nullptr);
+  void load_paf(const std::string& filepath,
+                const LoadedCallback& loaded = nullptr);
+  void load_minimizers(const std::string& target_seqs_filepath,
+                       const std::string& mapped_seqs_filepath,
+                       unsigned k,
+                       unsigned w,
+                       unsigned mx_threshold_min);
 
   void filter(double max_mapped_seqs_per_target_10kbp,
               unsigned mx_threshold_min,
-              unsigned mx_threshold_max,
-              const SeqIndex& target_seqs_index);
+              unsigned mx_threshold_max);
+
+  struct Mapping
+  {
+    SeqId target_id, mapped_id;
+    unsigned mx;
+    MappedInterval interval;
+    MappedInterval target_interval;
+  };
+
+  // Parse a line, without its line terminator, into mapping. Returns false for
+  // lines that are not mappings, like headers, or that have any of skip_flags
+  // set.
+  using LineParser = bool (*)(const char* line,
+                              const char* end,
+                              uint16_t skip_flags,
+                              ParsedMapping& mapping);
+
+  // Memory map the file and parse it in chunks in parallel, keeping the
+  // mappings in file order. Files that cannot be memory mapped are parsed one
+  // line at a time, calling loaded after each line.
+  void load_lines(const std::string& filepath,
+                  LineParser parse_line,
+                  unsigned mx_threshold_min,
+                  const LoadedCallback& loaded = nullptr);
+
+  void parse_lines(const char* start,
+                   const char* end,
+                   LineParser parse_line,
+                   uint16_t skip_flags,
+                   unsigned mx_threshold_min,
+                   std::vector<Mapping>& mappings,
+                   unsigned long& unindexed) const;
+
+  void load_mapping(const ParsedMapping& parsed,
+                    std::vector<Mapping>& mappings,
+                    unsigned long& unindexed) const;
+
+  // Pad the aligned part of a mapped sequence and clip it to the sequence.
+  MappedInterval pad_interval(SeqId mapped_id,
+                              uint64_t start,
+                              uint64_t end) const;
+
+  void build_mappings();
+  // Build, and filter by minimizer counts if filter_mx, the loaded mappings
+  // and point the arrays below at them.
+  void build_loaded_mappings(bool filter_mx,
+                             unsigned mx_threshold_min,
+                             unsigned mx_threshold_max,
+                             double mx_max_mapped_seqs_per_target_10kbp);
+
+  // Sort mappings by (target, mapped sequence), keeping the order of
+  // duplicates.
+  static void sort_mappings(std::vector<Mapping>& mappings);
+
+  void stream_mappings(const std::string& filepath,
+                       MappingsFormat format,
+                       unsigned mx_threshold_min,
+                       unsigned mx_threshold_max,
+                       double mx_max_mapped_seqs_per_target_10kbp);
+  // Finalize the targets of loaded_mappings that the stream has moved past,
+  // or all of them once the stream has ended, and remove their mappings.
+  void finalize_targets(bool stream_ended,
+                        bool filter_mx,
+                        unsigned mx_threshold_min,
+                        unsigned mx_threshold_max,
+                        double mx_max_mapped_seqs_per_target_10kbp);
+  // Deduplicate and filter the mappings of one target and hand them out.
+  void finalize_target(const Span<Mapping>& mappings,
+                       bool filter_mx,
+                       unsigned mx_threshold_min,
+                       unsigned mx_threshold_max,
+                       double mx_max_mapped_seqs_per_target_10kbp);
+  void wait_for_target(SeqId target_id) const;
+
+  bool make_cache_key(const std::string& filepath,
+                      unsigned mx_threshold_min,
+                      unsigned mx_threshold_max,
+                      double mx_max_mapped_seqs_per_target_10kbp,
+                      MappingsCacheKey& key) const;
+  bool load_cache(const std::string& cache_filepath,
+                  const MappingsCacheKey& key);
+  void save_cache(const std::string& cache_filepath,
+                  const MappingsCacheKey& key) const;
+
+  const SeqIndex& target_seqs_index;
+  const SeqIndex& mapped_seqs_index;
+  const unsigned threads;
+  // Bases to add on each side of the aligned part of mapped sequences
+  const uint32_t padding;
+  // SAM flags of alignments that are not loaded
+  const uint16_t skip_flags;
+
+  // Mappings as they are loaded, before being sorted into the arrays below
+  std::vector<Mapping> loaded_mappings;
+
+  // Compressed sparse row layout: the sequences mapped to target i are
+  // mapped_ids[offsets[i], offsets[i + 1]), sorted and without duplicates,
+  // mapped_intervals holds the parts of them to use, target_intervals the
+  // parts of the target they map to, and mx_in_common their common minimizer
+  // counts. The arrays are either owned, when built from the
+  // mappings file, or point into the memory mapped cache file.
+  std::vector<uint64_t> owned_offsets;
+  std::vector<SeqId> owned_mapped_ids;
+  std::vector<MappedInterval> owned_mapped_intervals;
+  std::vector<MappedInterval> owned_target_intervals;
+  std::vector<unsigned> mx_in_common;
+  MappedFile cache_file;
 
-  void load_mapping(const std::string& mapped_seq_id,
-                    const std::string& target_seq_id,
-                    const SeqIndex& target_seqs_index,
-                    unsigned mx = 0);
+  const uint64_t* offsets = nullptr;
+  const SeqId* mapped_ids = nullptr;
+  const MappedInterval* mapped_intervals = nullptr;
+  const MappedInterval* target_intervals = nullptr;
 
-  std::unordered_map<SeqId, std::vector<SeqId>> all_mappings;
-  std::unordered_map<SeqId, std::set<SeqId>> all_inserted_mappings;
-  std::unordered_map<SeqId, std::vector<unsigned>> all_mx_in_common;
+  // Mapped sequences that are not in the mapped sequences index
+  unsigned long unindexed_mapped_seqs = 0;
 
-  static const std::vector<SeqId> EMPTY_MAPPINGS;
+  // Streamed mappings. Targets sorted streams store each target's mappings
+  // separately as soon as they are complete, others fill the arrays above
+  // once the stream ends.
+  struct StreamedTarget
+  {
+    std::vector<SeqId> mapped_ids;
+    std::vector<MappedInterval> mapped_intervals;
+    std::vector<MappedInterval> target_intervals;
+  };
+  bool streaming = false;
+  bool target_sorted = false;
+  std::vector<StreamedTarget> streamed_targets;
+  std::thread stream_thread;
+  // Guard finalized_targets and stream_done
+  mutable std::mutex stream_mutex;
+  mutable std::condition_variable stream_cv;
+  std::vector<char> finalized_targets;
+  bool stream_done = false;
 };
 
 #endif
@@ -4,80 +4,381 @@
 #include "btllib/status.hpp"
 #include "btllib/util.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <numeric>
 #include <string>
+#include <string_view>
+#include <utility>
 
-SeqIndex::SeqIndex(const std::string& seqs_filepath)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Find the first record starting at or after pos. A FASTQ record header is
+// recognized by the '+' line two lines below it, as a quality line can also
+// start with '@'.
+static size_t
+resync_to_record(const char* data,
+                 const size_t size,
+                 const size_t pos,
+                 const bool fastq)
+{
+  const auto* const end = data + size;
+  const auto* line = data + pos;
+  if (pos > 0 && data[pos - 1] != '\n') {
+    line = next_line(line, end);
+  }
+  for (; line < end; line = next_line(line, end)) {
+    if (fastq) {
+      const auto* const plus_line = next_line(next_line(line, end), end);
+      if (*line == '@' && plus_line < end && *plus_line == '+') {
+        break;
+      }
+    } else if (*line == '>') {
+      break;
+    }
+  }
+  return line - data;
+}
+
+// Index the records in [start, end), which has to start at a record boundary.
+static void
+index_chunk(const char* data,
+            const size_t start,
+            const size_t end,
+            const bool fastq,
+            std::vector<IndexedSeq>& seqs,
+            std::string& ids)
+{
+  const auto* const chunk_end = data + end;
+  const auto lines_per_record = fastq ? 4 : 2;
+  std::string qual;
+  size_t seq_start = 0, seq_len = 0;
+  unsigned i = 0;
+  for (const auto* line = data + start; line < chunk_end; i++) {
+    const auto* const next = next_line(line, chunk_end);
+    auto line_len = size_t(next - line);
+    if (line_len > 0 && line[line_len - 1] == '\n') {
+      line_len--;
+    }
+    switch (i % lines_per_record) {
+      case 0: {
+        // The ID ends at the first space, or tab for FASTQ
+        size_t id_len = 1;
+        while (id_len < line_len && line[id_len] != ' ' &&
+               (!fastq || line[id_len] != '\t')) {
+          id_len++;
+        }
+        seqs.push_back(IndexedSeq{ ids.size(), id_len - 1, 0, 0, 0.0 });
+        ids.append(line + 1, id_len - 1);
+        break;
+      }
+      case 1:
+        seq_start = line - data;
+        seq_len = line_len;
+        if (!fastq) {
+          seqs.back().seq_start = seq_start;
+          seqs.back().seq_len = seq_len;
+        }
+        break;
+      case 3:
+        qual.assign(line, line_len);
+        seqs.back().seq_start = seq_start;
+        seqs.back().seq_len = seq_len;
+        seqs.back().phred_avg =
+          btllib::calc_phred_avg(qual, 0, qual.size() - 1);
+        break;
+      default:
+        break;
+    }
+    line = next;
+  }
+  // Drop a trailing record that is missing its sequence or qualities
+  if (i % lines_per_record != 0) {
+    ids.resize(seqs.back().id_start);
+    seqs.pop_back();
+  }
+}
+
+SeqIndex::SeqIndex(const std::string& seqs_filepath, const unsigned threads)
   : seqs_filepath(seqs_filepath)
 {
   btllib::log_info(FN_NAME + ": Building index for " + seqs_filepath + "... ");
 
-  std::ifstream seqsfile(seqs_filepath);
-  btllib::check_stream(seqsfile, seqs_filepath);
+  const MappedFile seqs_mapping(seqs_filepath);
+  seqs_mapping.advise(MADV_SEQUENTIAL);
+  const auto* const data = seqs_mapping.data();
+  const auto size = seqs_mapping.size();
 
-  const auto fastq = (seqsfile.peek() == '@');
+  const auto fastq = (size > 0 && data[0] == '@');
 
-  std::string line;
-  std::string id;
-  long i = 0, byte = 0 /*, id_startbyte = 0*/, id_endbyte = 0, seq_start = 0,
-       seq_len = 0;
-  while (bool(std::getline(seqsfile, line))) {
-    const long endbyte = byte + long(line.size());
-    if (fastq) {
-      if (i % 4 == 0) {
-        /*id_startbyte = byte + 1;*/
-        id_endbyte = endbyte;
-        id = btllib::split(line, " ")[0].substr(1);
-        id = btllib::split(id, "\t")[0];
-      } else if (i % 4 == 1) {
-        seq_start = id_endbyte + 1;
-        seq_len = endbyte - id_endbyte - 1;
-
-      } else if (i % 4 == 3) {
-
-        seqs_coords_and_phred_avg.emplace(
-          std::piecewise_construct,
-          std::make_tuple(id),
-          std::make_tuple(seq_start,
-                          seq_len,
-                          btllib::calc_phred_avg(line, 0, line.size() - 1)));
-      }
-    } else {
-      if (i % 2 == 0) {
-        /*id_startbyte = byte + 1;*/
-        id_endbyte = endbyte;
-        id = btllib::split(line, " ")[0].substr(1);
-      } else {
-        const auto seq_start = id_endbyte + 1;
-        const auto seq_len = endbyte - id_endbyte - 1;
-        seqs_coords_and_phred_avg.emplace(
-          std::piecewise_construct,
-          std::make_tuple(id),
-          std::make_tuple(seq_start, seq_len, 0.0));
-      }
+  const auto chunk_num = std::max(
+    size_t(1), std::min(threads * CHUNKS_PER_THREAD, size / MIN_CHUNK_BYTES));
+  std::vector<size_t> chunk_starts(chunk_num + 1, size);
+  chunk_starts[0] = 0;
+#pragma omp parallel for num_threads(threads)
+  for (size_t i = 1; i < chunk_num; i++) {
+    chunk_starts[i] = resync_to_record(data, size, size * i / chunk_num, fastq);
+  }
+
+  std::vector<std::vector<IndexedSeq>> chunk_seqs(chunk_num);
+  std::vector<std::string> chunk_ids(chunk_num);
+#pragma omp parallel for num_threads(threads) schedule(dynamic)
+  for (size_t i = 0; i < chunk_num; i++) {
+    index_chunk(data,
+                chunk_starts[i],
+                chunk_starts[i + 1],
+                fastq,
+                chunk_seqs[i],
+                chunk_ids[i]);
+  }
+
+  // Concatenate the chunks in file order, so that the first occurrence of a
+  // duplicate ID is kept
+  for (size_t i = 0; i < chunk_num; i++) {
+    for (auto& seq : chunk_seqs[i]) {
+      seq.id_start += owned_ids.size();
     }
-    byte = endbyte + 1;
-    i++;
+    owned_seqs.insert(
+      owned_seqs.end(), chunk_seqs[i].begin(), chunk_seqs[i].end());
+    owned_ids += chunk_ids[i];
+    decltype(chunk_seqs)::value_type().swap(chunk_seqs[i]);
+    decltype(chunk_ids)::value_type().swap(chunk_ids[i]);
   }
+  finalize();
 
   btllib::log_info(FN_NAME + ": Done.");
 }
 
+void
+SeqIndex::add_seq(const std::string& id,
+                  const size_t seq_start,
+                  const size_t seq_len,
+                  const double phred_avg)
+{
+  owned_seqs.push_back(
+    IndexedSeq{ owned_ids.size(), id.size(), seq_start, seq_len, phred_avg });
+  owned_ids += id;
+}
+
+void
+SeqIndex::finalize()
+{
+  const auto id_of = [&](const IndexedSeq& seq) {
+    return std::string_view(owned_ids.data() + seq.id_start, seq.id_len);
+  };
+
+  // Sort by ID and keep the first occurrence of duplicate IDs
+  std::stable_sort(owned_seqs.begin(),
+                   owned_seqs.end(),
+                   [&](const IndexedSeq& a, const IndexedSeq& b) {
+                     return id_of(a) < id_of(b);
+                   });
+  owned_seqs.erase(std::unique(owned_seqs.begin(),
+                               owned_seqs.end(),
+                               [&](const IndexedSeq& a, const IndexedSeq& b) {
+                                 return id_of(a) == id_of(b);
+                               }),
+                   owned_seqs.end());
+
+  // Lay the IDs out in the same order as the records
+  std::string sorted_ids;
+  sorted_ids.reserve(owned_ids.size());
+  for (auto& seq : owned_seqs) {
+    const auto id = id_of(seq);
+    seq.id_start = sorted_ids.size();
+    sorted_ids += id;
+  }
+  owned_ids = std::move(sorted_ids);
+
+  btllib::check_error(owned_seqs.size() >= INVALID_SEQ_ID,
+                      FN_NAME + ": Too many sequences to index.");
+
+  seqs = owned_seqs.data();
+  seq_num = owned_seqs.size();
+  ids = owned_ids.data();
+}
+
 void
 SeqIndex::save(const std::string& filepath)
 {
   btllib::log_info(FN_NAME + ": Saving index to " + filepath + "... ");
 
-  std::ofstream indexfile(filepath);
-  for (const auto& seq_coords : seqs_coords_and_phred_avg) {
-    const auto id = seq_coords.first;
-    const auto seq_start = seq_coords.second.seq_start;
-    const auto seq_len = seq_coords.second.seq_len;
-    const auto phred_avg = seq_coords.second.phred_avg;
-    indexfile << id << '\t' << seq_start << '\t' << seq_len << '\t' << phred_avg
-              << '\n';
+  SeqIndexHeader header{};
+  std::memcpy(header.magic, SEQ_INDEX_MAGIC, sizeof(SEQ_INDEX_MAGIC));
+  header.version = SEQ_INDEX_VERSION;
+  header.seq_num = seq_num;
+  header.ids_bytes = seq_num > 0 ? seqs[seq_num - 1].id_start +
+                                     seqs[seq_num - 1].id_len
+                                 : 0;
+
+  std::ofstream indexfile(filepath, std::ios::binary);
+  btllib::check_stream(indexfile, filepath);
+  // NOLINTBEGIN(cppcoreguidelines-pro-type-reinterpret-cast)
+  indexfile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  indexfile.write(reinterpret_cast<const char*>(seqs),
+                  std::streamsize(seq_num * sizeof(IndexedSeq)));
+  // NOLINTEND(cppcoreguidelines-pro-type-reinterpret-cast)
+  indexfile.write(ids, std::streamsize(header.ids_bytes));
+  btllib::check_stream(indexfile, filepath);
+
+  btllib::log_info(FN_NAME + ": Done.");
+}
+
+static const std::array<uint8_t, 256> BASE_TO_BITS = [] {
+  std::array<uint8_t, 256> table{};
+  table.fill(uint8_t(-1));
+  table['A'] = table['a'] = 0;
+  table['C'] = table['c'] = 1;
+  table['G'] = table['g'] = 2;
+  table['T'] = table['t'] = 3;
+  return table;
+}();
+
+// Each packed byte unpacks into 4 bases
+static const std::array<std::array<char, 4>, 256> BYTE_TO_BASES = [] {
+  static const char bases[] = { 'A', 'C', 'G', 'T' };
+  std::array<std::array<char, 4>, 256> table{};
+  for (unsigned byte = 0; byte < table.size(); byte++) {
+    for (unsigned i = 0; i < 4; i++) {
+      table[byte][i] = bases[(byte >> (2 * i)) & 3];
+    }
+  }
+  return table;
+}();
+
+// Returns the number of bytes seq packs into, and packs it into packed if
+// it's not null.
+static size_t
+pack_seq(const char* seq, const size_t seq_len, char* packed)
+{
+  uint32_t runs = 0;
+  auto* const runs_start = packed + sizeof(runs);
+  for (size_t i = 0; i < seq_len;) {
+    if (BASE_TO_BITS[uint8_t(seq[i])] != uint8_t(-1)) {
+      i++;
+      continue;
+    }
+    const auto run_start = uint32_t(i);
+    while (i < seq_len && BASE_TO_BITS[uint8_t(seq[i])] == uint8_t(-1)) {
+      i++;
+    }
+    if (packed != nullptr) {
+      const uint32_t run[] = { run_start, uint32_t(i) - run_start };
+      std::memcpy(runs_start + runs * sizeof(run), run, sizeof(run));
+    }
+    runs++;
+  }
+  const auto header_bytes = sizeof(runs) + runs * 2 * sizeof(uint32_t);
+  const auto bases_bytes = (seq_len + 3) / 4;
+  if (packed != nullptr) {
+    std::memcpy(packed, &runs, sizeof(runs));
+    auto* const bases = packed + header_bytes;
+    std::memset(bases, 0, bases_bytes);
+    for (size_t i = 0; i < seq_len; i++) {
+      const auto bits = BASE_TO_BITS[uint8_t(seq[i])] & 3;
+      bases[i / 4] = char(uint8_t(bases[i / 4]) | (bits << (2 * (i % 4))));
+    }
+  }
+  return header_bytes + bases_bytes;
+}
+
+// Unpack the bases [start, start + len) of a packed sequence into seq.
+static void
+unpack_seq(const char* packed,
+           const size_t start,
+           const size_t len,
+           std::string& seq)
+{
+  uint32_t runs = 0;
+  std::memcpy(&runs, packed, sizeof(runs));
+  const auto* const runs_start = packed + sizeof(runs);
+  const auto* const bases = runs_start + runs * 2 * sizeof(uint32_t);
+
+  // Whole bytes are unpacked, then the bases before start are dropped
+  const auto first_byte = start / 4;
+  const auto bytes = (start + len + 3) / 4 - first_byte;
+  seq.resize(bytes * 4);
+  for (size_t i = 0; i < bytes; i++) {
+    std::memcpy(&seq[i * 4],
+                BYTE_TO_BASES[uint8_t(bases[first_byte + i])].data(),
+                4); // NOLINT
+  }
+  seq.erase(0, start % 4);
+  seq.resize(len);
+
+  for (uint32_t i = 0; i < runs; i++) {
+    uint32_t run[2];
+    std::memcpy(run, runs_start + i * sizeof(run), sizeof(run));
+    const auto run_start = std::max<size_t>(run[0], start);
+    const auto run_end = std::min<size_t>(size_t(run[0]) + run[1], start + len);
+    if (run_start < run_end) {
+      std::memset(&seq[run_start - start], 'N', run_end - run_start);
+    }
+  }
+}
+
+// Header of the packed store of the indexed sequences, as they are now
+PackedSeqsHeader
+SeqIndex::make_packed_header() const
+{
+  struct stat st
+  {};
+  btllib::check_error(stat(seqs_filepath.c_str(), &st) != 0,
+                      FN_NAME + ": stat " + seqs_filepath + ": " +
+                        btllib::get_strerror());
+  PackedSeqsHeader header{};
+  std::memcpy(header.magic, PACKED_SEQS_MAGIC, sizeof(PACKED_SEQS_MAGIC));
+  header.version = PACKED_SEQS_VERSION;
+  header.seq_num = seq_num;
+  header.index_fingerprint = fingerprint();
+  header.seqs_size = uint64_t(st.st_size);
+  header.seqs_mtime_ns = get_mtime_ns(st);
+  return header;
+}
+
+void
+SeqIndex::save_packed(const std::string& filepath,
+                      const unsigned threads) const
+{
+  const auto packed_filepath = filepath + PACKED_SEQS_EXTENSION;
+  btllib::log_info(FN_NAME + ": Saving packed sequences to " +
+                   packed_filepath + "... ");
+
+  const MappedFile seqs_mapping(seqs_filepath);
+  seqs_mapping.advise(MADV_SEQUENTIAL);
+
+  // Size all the packed sequences first, so they can be packed in parallel
+  // straight into the output file.
+  std::vector<uint64_t> offsets(seq_num + 1);
+  const auto data_start =
+    sizeof(PackedSeqsHeader) + offsets.size() * sizeof(uint64_t);
+#pragma omp parallel for num_threads(threads) schedule(dynamic, 1024)
+  for (size_t i = 0; i < seq_num; i++) {
+    offsets[i + 1] =
+      pack_seq(seqs_mapping.data() + seqs[i].seq_start, seqs[i].seq_len, nullptr);
+  }
+  offsets[0] = data_start;
+  std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+  MappedFile packed(packed_filepath, offsets.back());
+  const auto header = make_packed_header();
+  std::memcpy(packed.data(), &header, sizeof(header));
+  std::memcpy(packed.data() + sizeof(header),
+              offsets.data(),
+              offsets.size() * sizeof(uint64_t));
+#pragma omp parallel for num_threads(threads) schedule(dynamic, 1024)
+  for (size_t i = 0; i < seq_num; i++) {
+    pack_seq(seqs_mapping.data() + seqs[i].seq_start,
+             seqs[i].seq_len,
+             packed.data() + offsets[i]);
   }
 
   btllib::log_info(FN_NAME + ": Done.");
@@ -85,9 +386,112 @@ SeqIndex::save(const std::string& filepath)
 
 SeqIndex::SeqIndex(const std::string& index_filepath, std::string seqs_filepath)
   : seqs_filepath(std::move(seqs_filepath))
+  , seqs_file(this->seqs_filepath)
 {
   btllib::log_info(FN_NAME + ": Loading index from " + index_filepath + "... ");
 
+  // Sequences are fetched in batches of reads scattered across the file.
+  // Readahead would mostly load unrelated reads, so it's disabled and the
+  // reads of a batch are requested explicitly with prefetch_seq.
+  seqs_file.advise(MADV_RANDOM);
+
+  index_file = MappedFile(index_filepath);
+  if (index_file.size() < sizeof(SeqIndexHeader) ||
+      std::memcmp(index_file.data(),
+                  SEQ_INDEX_MAGIC,
+                  sizeof(SEQ_INDEX_MAGIC)) != 0) {
+    index_file = MappedFile();
+    btllib::log_warning(FN_NAME + ": " + index_filepath +
+                        " is a legacy text index. Rebuild it with "
+                        "goldpolish-index for faster loading.");
+    load_legacy(index_filepath);
+  } else {
+    load_binary(index_filepath);
+  }
+
+  const auto packed_filepath = index_filepath + PACKED_SEQS_EXTENSION;
+  if (access(packed_filepath.c_str(), F_OK) == 0) {
+    load_packed(packed_filepath);
+  }
+
+  btllib::log_info(FN_NAME + ": Done!");
+}
+
+void
+SeqIndex::load_binary(const std::string& index_filepath)
+{
+
+  SeqIndexHeader header{};
+  std::memcpy(&header, index_file.data(), sizeof(header));
+  btllib::check_error(header.version != SEQ_INDEX_VERSION,
+                      FN_NAME + ": " + index_filepath +
+                        " has unsupported index version " +
+                        std::to_string(header.version) + ".");
+  btllib::check_error(index_file.size() !=
+                        sizeof(header) + header.seq_num * sizeof(IndexedSeq) +
+                          header.ids_bytes,
+                      FN_NAME + ": " + index_filepath + " is truncated.");
+  btllib::check_error(header.seq_num >= INVALID_SEQ_ID,
+                      FN_NAME + ": " + index_filepath +
+                        " has too many sequences.");
+
+  // Lookups binary search the records, so don't let the kernel read ahead
+  index_file.advise(MADV_RANDOM);
+
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  seqs = reinterpret_cast<const IndexedSeq*>(index_file.data() +
+                                             sizeof(header));
+  seq_num = header.seq_num;
+  ids = index_file.data() + sizeof(header) + seq_num * sizeof(IndexedSeq);
+}
+
+void
+SeqIndex::load_packed(const std::string& packed_filepath)
+{
+  packed_file = MappedFile(packed_filepath);
+
+  PackedSeqsHeader header{};
+  if (packed_file.size() >= sizeof(header)) {
+    std::memcpy(&header, packed_file.data(), sizeof(header));
+  }
+  if (packed_file.size() < sizeof(header) ||
+      std::memcmp(header.magic, PACKED_SEQS_MAGIC, sizeof(PACKED_SEQS_MAGIC)) !=
+        0 ||
+      header.version != PACKED_SEQS_VERSION) {
+    btllib::log_warning(FN_NAME + ": " + packed_filepath +
+                        " is not a packed sequences store of this version. "
+                        "Ignoring it.");
+    packed_file = MappedFile();
+    return;
+  }
+  const auto expected = make_packed_header();
+  if (header.seq_num != expected.seq_num ||
+      header.index_fingerprint != expected.index_fingerprint ||
+      header.seqs_size != expected.seqs_size ||
+      header.seqs_mtime_ns != expected.seqs_mtime_ns) {
+    btllib::log_warning(FN_NAME + ": " + packed_filepath +
+                        " was written from another index or sequences file. "
+                        "Ignoring it.");
+    packed_file = MappedFile();
+    return;
+  }
+  if (packed_file.size() < sizeof(header) + (seq_num + 1) * sizeof(uint64_t)) {
+    btllib::log_warning(FN_NAME + ": " + packed_filepath +
+                        " is truncated. Ignoring it.");
+    packed_file = MappedFile();
+    return;
+  }
+
+  packed_file.advise(MADV_RANDOM);
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  packed_offsets = reinterpret_cast<const uint64_t*>(packed_file.data() +
+                                                     sizeof(header));
+  btllib::log_info(FN_NAME + ": Serving sequences from " + packed_filepath);
+}
+
+void
+SeqIndex::load_legacy(const std::string& index_filepath)
+{
   std::ifstream ifs(index_filepath);
   btllib::check_stream(ifs, index_filepath);
   std::string token, id;
@@ -108,10 +512,7 @@ SeqIndex::SeqIndex(const std::string& index_filepath, std::string seqs_filepath)
       }
       case 3: {
         phred_avg = std::stod(token);
-        seqs_coords_and_phred_avg.emplace(
-          std::piecewise_construct,
-          std::make_tuple(id),
-          std::make_tuple(seq_start, seq_len, phred_avg));
+        add_seq(id, seq_start, seq_len, phred_avg);
         break;
       }
       default: {
@@ -121,23 +522,118 @@ SeqIndex::SeqIndex(const std::string& index_filepath, std::string seqs_filepath)
     }
     i++;
   }
-  btllib::log_info(FN_NAME + ": Done!");
+  finalize();
 }
 
-size_t
-SeqIndex::get_seq_len(const std::string& id) const
+SeqId
+SeqIndex::get_seq_id(const std::string_view name) const
 {
-  return seqs_coords_and_phred_avg.at(id).seq_len;
+  const auto* const end = seqs + seq_num;
+  const auto* const it =
+    std::lower_bound(seqs,
+                     end,
+                     name,
+                     [&](const IndexedSeq& seq, const std::string_view& key) {
+                       return std::string_view(ids + seq.id_start,
+                                               seq.id_len) < key;
+                     });
+  if (it == end || std::string_view(ids + it->id_start, it->id_len) != name) {
+    return INVALID_SEQ_ID;
+  }
+  return SeqId(it - seqs);
 }
 
-double
-SeqIndex::get_phred_avg(const std::string& id) const
+uint64_t
+SeqIndex::fingerprint() const
 {
-  return seqs_coords_and_phred_avg.at(id).phred_avg;
+  static const size_t SAMPLES = 1024;
+
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  auto hash = fnv1a_hash(reinterpret_cast<const char*>(&seq_num),
+                         sizeof(seq_num));
+  const auto step = std::max(size_t(1), seq_num / SAMPLES);
+  for (size_t i = 0; i < seq_num; i += step) {
+    const auto name = get_seq_name(SeqId(i));
+    hash = fnv1a_hash(name.data(), name.size(), hash);
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+    hash = fnv1a_hash(reinterpret_cast<const char*>(&seqs[i].seq_len),
+                      sizeof(seqs[i].seq_len),
+                      hash);
+  }
+  return hash;
 }
 
-bool
-SeqIndex::seq_exists(const std::string& id) const
+std::string_view
+SeqIndex::get_seq(const SeqId id,
+                  const size_t start,
+                  const size_t len,
+                  std::string& buffer) const
 {
-  return seqs_coords_and_phred_avg.find(id) != seqs_coords_and_phred_avg.end();
-}
\ No newline at end of file
+  const auto& seq = seqs[id];
+  btllib::check_error(start + len > seq.seq_len,
+                      FN_NAME + ": Requested bases are out of bounds of " +
+                        std::string(get_seq_name(id)) + ".");
+  if (packed_offsets != nullptr) {
+    unpack_seq(packed_file.data() + packed_offsets[id], start, len, buffer);
+    return buffer;
+  }
+  btllib::check_error(seq.seq_start + seq.seq_len > seqs_file.size(),
+                      FN_NAME + ": " + std::string(get_seq_name(id)) +
+                        " is out of bounds of " + seqs_filepath +
+                        ". Is the index outdated?");
+  return { seqs_file.data() + seq.seq_start + start, len };
+}
+
+void
+SeqIndex::prefetch_seq(const SeqId id,
+                       const size_t start,
+                       const size_t len) const
+{
+  if (packed_offsets != nullptr) {
+    // The runs of non-ACGT bases are read along with the bases
+    packed_file.advise(packed_offsets[id],
+                       packed_offsets[id + 1] - packed_offsets[id],
+                       MADV_WILLNEED);
+  } else {
+    seqs_file.advise(seqs[id].seq_start + start, len, MADV_WILLNEED);
+  }
+}
+
+std::string_view
+SeqIndex::get_qual(const SeqId id, const size_t start, const size_t len) const
+{
+  const auto& seq = seqs[id];
+  btllib::check_error(start + len > seq.seq_len,
+                      FN_NAME + ": Requested qualities are out of bounds of " +
+                        std::string(get_seq_name(id)) + ".");
+
+  // The qualities follow the '+' line after the sequence line
+  const auto* const end = seqs_file.data() + seqs_file.size();
+  const auto plus_line_start = seq.seq_start + seq.seq_len + 1;
+  const auto* const plus_line = seqs_file.data() + plus_line_start;
+  const auto* const qual =
+    plus_line_start < seqs_file.size() ? next_line(plus_line, end) : end;
+  btllib::check_error(plus_line_start >= seqs_file.size() ||
+                        *plus_line != '+' ||
+                        end - qual < std::ptrdiff_t(seq.seq_len),
+                      FN_NAME + ": " + std::string(get_seq_name(id)) +
+                        " has no qualities in " + seqs_filepath +
+                        ". Is the index outdated?");
+  return { qual + start, len };
+}
+
+void
+SeqIndex::prefetch_qual(const SeqId id,
+                        const size_t start,
+                        const size_t len) const
+{
+  // The '+' line is at most as long as the header line, where it repeats
+  // the ID
+  const auto& seq = seqs[id];
+  const auto qual_start = seq.seq_start + seq.seq_len + start;
+  const auto qual_end =
+    std::min(qual_start + seq.id_len + 3 + len, seqs_file.size());
+  if (qual_start < qual_end) {
+    seqs_file.advise(qual_start, qual_end - qual_start, MADV_WILLNEED);
+  }
+}
@@ -6,34 +6,70 @@
 #include "btllib/status.hpp"
 #include "btllib/util.hpp"
 
-#include <fstream>
+#include <cstdint>
 #include <string>
-#include <unordered_map>
-#include <utility>
+#include <string_view>
+#include <vector>
 
-#include <fcntl.h>
-#include <unistd.h>
+// Binary index layout, in native byte order:
+//   SeqIndexHeader
+//   IndexedSeq[seq_num], sorted by ID
+//   char[ids_bytes], the IDs referred to by the records
+static const char SEQ_INDEX_MAGIC[8] = { 'G', 'P', 'I', 'N', 'D', 'E', 'X', 0 };
+static const uint32_t SEQ_INDEX_VERSION = 1;
 
-struct SeqCoordinatesAndPhredAvg
+struct SeqIndexHeader
 {
-  size_t seq_start, seq_len;
-  double phred_avg;
+  char magic[sizeof(SEQ_INDEX_MAGIC)];
+  uint32_t version;
+  uint32_t flags;
+  uint64_t seq_num;
+  uint64_t ids_bytes;
+};
 
-  SeqCoordinatesAndPhredAvg(const size_t seq_start,
-                            const size_t seq_len,
-                            const double phred_avg)
-    : seq_start(seq_start)
-    , seq_len(seq_len)
-    , phred_avg(phred_avg)
-  {
-  }
+// Packed sequences store layout, in native byte order:
+//   PackedSeqsHeader
+//   uint64_t[seq_num + 1], offsets of the packed sequences, in index order
+//   Packed sequences, each made of:
+//     uint32_t, number of runs of non-ACGT bases
+//     uint32_t[2 * runs], start and length of each run
+//     uint8_t[ceil(seq_len / 4)], 2-bit bases, 4 per byte, first in low bits
+// Non-ACGT bases are unpacked as N and lowercase bases as uppercase, which
+// hash identically. The store is only used with the index and sequences file
+// it was written from, which the header identifies.
+static const char PACKED_SEQS_MAGIC[8] = { 'G', 'P', 'P', 'A', 'C', 'K', 0, 0 };
+static const uint32_t PACKED_SEQS_VERSION = 2;
+static const std::string PACKED_SEQS_EXTENSION = ".packed";
+
+struct PackedSeqsHeader
+{
+  char magic[sizeof(PACKED_SEQS_MAGIC)];
+  uint32_t version;
+  uint32_t flags;
+  uint64_t seq_num;
+  uint64_t index_fingerprint;
+  uint64_t seqs_size;
+  int64_t seqs_mtime_ns;
+};
+
+using SeqId = uint32_t;
+static const SeqId INVALID_SEQ_ID = UINT32_MAX;
+
+// Offset of the quality characters of FASTQ files
+static const unsigned PHRED_OFFSET = 33;
+
+struct IndexedSeq
+{
+  uint64_t id_start, id_len;
+  uint64_t seq_start, seq_len;
+  double phred_avg;
 };
 
 class SeqIndex
 {
 
 public:
-  SeqIndex(const std::string& seqs_filepath);
+  SeqIndex(const std::string& seqs_filepath, unsigned threads);
   SeqIndex(const std::string& index_filepath, std::string seqs_filepath);
 
   SeqIndex(const SeqIndex&) = delete;
@@ -41,64 +77,86 @@ public:
 
   void save(const std::string& filepath);
 
-  template<int i>
-  std::tuple<const char*, size_t> get_seq(const std::string& id) const;
+  // Write the sequences in 2-bit packed form next to the index at filepath.
+  // Indexes loaded from filepath then serve sequences from the packed store.
+  void save_packed(const std::string& filepath, unsigned threads) const;
 
-  size_t get_seq_len(const std::string& id) const;
+  // Sequence IDs are dense and follow the order of sequence names, so
+  // comparing IDs is the same as comparing names.
+  SeqId get_seq_id(std::string_view name) const;
+  std::string_view get_seq_name(SeqId id) const
+  {
+    return { ids + seqs[id].id_start, seqs[id].id_len };
+  }
 
-  double get_phred_avg(const std::string& id) const;
+  // Number of indexed sequences. IDs are in [0, size()).
+  size_t size() const { return seq_num; }
 
-  bool seq_exists(const std::string& id) const;
+  // Hash of the number of sequences and of a sample of their names and
+  // lengths, to tell apart indexes that would give different IDs.
+  uint64_t fingerprint() const;
 
-private:
-  std::string seqs_filepath;
-  std::unordered_map<std::string, SeqCoordinatesAndPhredAvg>
-    seqs_coords_and_phred_avg;
-};
-
-template<int i>
-std::tuple<const char*, size_t>
-SeqIndex::get_seq(const std::string& id) const
-{
-  // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
-  thread_local static int seqs_file;
-  thread_local static bool seqs_file_initialized = false;
-
-  static const size_t max_seqlen = 20ULL * 1024ULL * 1024ULL;
-  // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
-  thread_local static char* seq;
-  thread_local static bool seq_initialized = false;
-
-  if (!seqs_file_initialized) {
-    seqs_file = open(seqs_filepath.c_str(), O_RDONLY);
-#ifdef __linux__
-    const auto ret = posix_fadvise(seqs_file, 0, 0, POSIX_FADV_RANDOM);
-    btllib::check_error(ret != 0, "posix_fadvise failed.");
-#endif
-    seqs_file_initialized = true;
+  // The returned view points either into the memory mapped sequences file, or
+  // into buffer if the sequence is unpacked from the packed store.
+  std::string_view get_seq(SeqId id, std::string& buffer) const
+  {
+    return get_seq(id, 0, get_seq_len(id), buffer);
   }
-
-  if (!seq_initialized) {
-    seq = new char[max_seqlen];
-    seq_initialized = true;
+  // Only bases [start, start + len) of the sequence, of which only the needed
+  // part is unpacked.
+  std::string_view get_seq(SeqId id,
+                           size_t start,
+                           size_t len,
+                           std::string& buffer) const;
+
+  // Hint that the sequence, or bases [start, start + len) of it, will be read
+  // soon, so its pages can be read in ahead of get_seq.
+  void prefetch_seq(SeqId id) const { prefetch_seq(id, 0, get_seq_len(id)); }
+  void prefetch_seq(SeqId id, size_t start, size_t len) const;
+
+  size_t get_seq_len(SeqId id) const { return seqs[id].seq_len; }
+
+  // Whether the sequences file is FASTQ, so get_qual can be used
+  bool has_quals() const
+  {
+    return seqs_file.size() > 0 && seqs_file.data()[0] == '@';
   }
 
-  const auto& coords = seqs_coords_and_phred_avg.at(id);
-  const auto seq_len = coords.seq_len;
-  btllib::check_error(
-    seq_len >= max_seqlen,
-    FN_NAME + ": Seq size over buffer size. Consider increasing buffer size.");
-  // NOLINTNEXTLINE(bugprone-narrowing-conversions,cppcoreguidelines-narrowing-conversions)
-  const auto lseek_ret = lseek(seqs_file, coords.seq_start, SEEK_SET);
-  btllib::check_error(lseek_ret == -1,
-                      FN_NAME + ": lseek: " + btllib::get_strerror());
-  const auto read_ret = read(seqs_file, seq, seq_len);
-  btllib::check_error(read_ret != int(seq_len),
-                      FN_NAME + ": read did not read all bytes.");
-
-  seq[seq_len] = '\0';
-
-  return decltype(SeqIndex::get_seq<i>(id)){ seq, seq_len };
-}
+  // Qualities of bases [start, start + len) of the sequence, read from the
+  // memory mapped sequences file, even if sequences are served from the
+  // packed store.
+  std::string_view get_qual(SeqId id, size_t start, size_t len) const;
+
+  // Like prefetch_seq, for the qualities read by get_qual
+  void prefetch_qual(SeqId id, size_t start, size_t len) const;
+
+  double get_phred_avg(SeqId id) const { return seqs[id].phred_avg; }
+
+private:
+  void add_seq(const std::string& id,
+               size_t seq_start,
+               size_t seq_len,
+               double phred_avg);
+  void finalize();
+  void load_binary(const std::string& index_filepath);
+  void load_legacy(const std::string& index_filepath);
+  void load_packed(const std::string& packed_filepath);
+  PackedSeqsHeader make_packed_header() const;
+
+  std::string seqs_filepath;
+  MappedFile seqs_file;
+  MappedFile packed_file;
+  const uint64_t* packed_offsets = nullptr;
+
+  // Records and IDs are either owned, when the index is built or loaded from
+  // the legacy text format, or point into the memory mapped index file.
+  std::vector<IndexedSeq> owned_seqs;
+  std::string owned_ids;
+  MappedFile index_file;
+
+  const IndexedSeq* seqs = nullptr;
+  size_t seq_num = 0;
+  const char* ids = nullptr;
+};
 
 #endif
@@ -7,9 +7,11 @@
 #include "btllib/status.hpp"
 
 #include <algorithm>
+#include <cerrno>
 #include <chrono>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iterator>
 #include <limits>
@@ -18,16 +20,133 @@
 #include <sstream>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 static const pid_t INIT_PID = 1;
 static const unsigned PARENT_QUERY_PERIOD = 1; // seconds
 static const auto FIFO_FLAGS = S_IRUSR | S_IWUSR;
+static const auto FILE_FLAGS = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+static const int SOCKET_BACKLOG = 256;
+
+MappedFile::MappedFile(const std::string& filepath)
+{
+  const auto fd = open(filepath.c_str(), O_RDONLY);
+  btllib::check_error(fd == -1,
+                      FN_NAME + ": open " + filepath + ": " +
+                        btllib::get_strerror());
+  struct stat st
+  {};
+  btllib::check_error(fstat(fd, &st) != 0,
+                      FN_NAME + ": fstat " + filepath + ": " +
+                        btllib::get_strerror());
+  bytes = size_t(st.st_size);
+  if (bytes > 0) {
+    void* const ret = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+    btllib::check_error(ret == MAP_FAILED,
+                        FN_NAME + ": mmap " + filepath + ": " +
+                          btllib::get_strerror());
+    mapping = static_cast<char*>(ret);
+  }
+  close(fd);
+}
+
+MappedFile::MappedFile(const std::string& filepath, const size_t size)
+  : bytes(size)
+{
+  const auto fd = open(filepath.c_str(), O_RDWR | O_CREAT | O_TRUNC, FILE_FLAGS);
+  btllib::check_error(fd == -1,
+                      FN_NAME + ": open " + filepath + ": " +
+                        btllib::get_strerror());
+  btllib::check_error(ftruncate(fd, off_t(size)) != 0,
+                      FN_NAME + ": ftruncate " + filepath + ": " +
+                        btllib::get_strerror());
+  if (bytes > 0) {
+    void* const ret =
+      mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    btllib::check_error(ret == MAP_FAILED,
+                        FN_NAME + ": mmap " + filepath + ": " +
+                          btllib::get_strerror());
+    mapping = static_cast<char*>(ret);
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+  unmap();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+  : mapping(other.mapping)
+  , bytes(other.bytes)
+{
+  other.mapping = nullptr;
+  other.bytes = 0;
+}
+
+MappedFile&
+MappedFile::operator=(MappedFile&& other) noexcept
+{
+  if (this != &other) {
+    unmap();
+    mapping = other.mapping;
+    bytes = other.bytes;
+    other.mapping = nullptr;
+    other.bytes = 0;
+  }
+  return *this;
+}
+
+void
+MappedFile::unmap()
+{
+  if (mapping != nullptr) {
+    munmap(mapping, bytes);
+    mapping = nullptr;
+    bytes = 0;
+  }
+}
+
+void
+MappedFile::advise(const int advice) const
+{
+  advise(0, bytes, advice);
+}
+
+void
+MappedFile::advise(const size_t start, const size_t len, const int advice) const
+{
+  if (mapping == nullptr || len == 0) {
+    return;
+  }
+  // madvise requires a page aligned start address
+  static const auto page_size = size_t(sysconf(_SC_PAGESIZE));
+  const auto aligned_start = start - (start % page_size);
+  madvise(mapping + aligned_start, len + (start - aligned_start), advice);
+}
+
+int64_t
+get_mtime_ns(const struct stat& st)
+{
+  static const int64_t NS_PER_S = 1'000'000'000LL;
+#ifdef __APPLE__
+  const auto& mtime = st.st_mtimespec;
+#else
+  const auto& mtime = st.st_mtim;
+#endif
+  return int64_t(mtime.tv_sec) * NS_PER_S + int64_t(mtime.tv_nsec);
+}
 
 std::vector<size_t>
 get_random_indices(const size_t total_size, const size_t count)
@@ -93,31 +212,303 @@ confirm_pipe(const std::string& pipepath)
   confirm << "1" << std::endl;
 }
 
+// Keep the socket fd out of child processes, and where send has no
+// MSG_NOSIGNAL, make writes to a closed peer fail with EPIPE instead of
+// raising SIGPIPE
+static void
+set_socket_options(const int fd)
+{
+  btllib::check_error(fcntl(fd, F_SETFD, FD_CLOEXEC) == -1,
+                      FN_NAME + ": fcntl failed: " + btllib::get_strerror());
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+  const int on = 1;
+  btllib::check_error(
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on)) == -1,
+    FN_NAME + ": setsockopt failed: " + btllib::get_strerror());
+#endif
+}
+
+int
+listen_socket(const std::string& socketpath)
+{
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  btllib::check_error(socketpath.size() >= sizeof(address.sun_path),
+                      FN_NAME + ": Socket path " + socketpath +
+                        " is too long.");
+  std::memcpy(address.sun_path, socketpath.c_str(), socketpath.size() + 1);
+
+  const auto fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  btllib::check_error(fd == -1,
+                      FN_NAME + ": socket failed: " + btllib::get_strerror());
+  set_socket_options(fd);
+  unlink(socketpath.c_str());
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  auto* const address_ptr = reinterpret_cast<sockaddr*>(&address);
+  btllib::check_error(bind(fd, address_ptr, sizeof(address)) != 0 ||
+                        listen(fd, SOCKET_BACKLOG) != 0,
+                      FN_NAME + ": Listening at " + socketpath +
+                        " failed: " + btllib::get_strerror());
+  return fd;
+}
+
+int
+accept_socket(const int listen_fd)
+{
+  const auto fd = accept(listen_fd, nullptr, nullptr);
+  if (fd != -1) {
+    set_socket_options(fd);
+  }
+  return fd;
+}
+
+// A peer that is gone fails sends instead of raising SIGPIPE
+#ifdef MSG_NOSIGNAL
+static const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+static const int SEND_FLAGS = 0;
+#endif
+
+bool
+send_all(const int fd, const std::string& data)
+{
+  size_t sent = 0;
+  while (sent < data.size()) {
+    const auto ret =
+      send(fd, data.data() + sent, data.size() - sent, SEND_FLAGS);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret < 0) {
+      return false;
+    }
+    sent += size_t(ret);
+  }
+  return true;
+}
+
+bool
+send_all(const int fd, const std::string& data, const std::vector<int>& fds)
+{
+  if (fds.empty() || data.empty()) {
+    return send_all(fd, data);
+  }
+  auto first_byte = data[0];
+  iovec iov{ &first_byte, 1 };
+  const auto fds_bytes = fds.size() * sizeof(int);
+  // Control messages are aligned like their header
+  std::vector<cmsghdr> control(
+    (CMSG_SPACE(fds_bytes) + sizeof(cmsghdr) - 1) / sizeof(cmsghdr));
+  msghdr message{};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control.data();
+  message.msg_controllen = CMSG_SPACE(fds_bytes);
+  // NOLINTBEGIN(cppcoreguidelines-pro-type-reinterpret-cast,cppcoreguidelines-pro-bounds-pointer-arithmetic)
+  auto* const header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(fds_bytes);
+  std::memcpy(CMSG_DATA(header), fds.data(), fds_bytes);
+  // NOLINTEND(cppcoreguidelines-pro-type-reinterpret-cast,cppcoreguidelines-pro-bounds-pointer-arithmetic)
+  ssize_t ret = 0;
+  do {
+    ret = sendmsg(fd, &message, SEND_FLAGS);
+  } while (ret < 0 && errno == EINTR);
+  return ret == 1 && send_all(fd, data.substr(1));
+}
+
+int
+create_memory_file(const std::string& name)
+{
+#ifdef __linux__
+  return memfd_create(name.c_str(), MFD_CLOEXEC);
+#else
+  (void)name;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+MultiNtHash::MultiNtHash(const char* seq,
+                         const size_t seq_len,
+                         const unsigned hash_num,
+                         const std::vector<unsigned>& k_values)
+  : rolling(k_values.size(), 1)
+{
+  nthashes.reserve(k_values.size());
+  for (const auto k : k_values) {
+    nthashes.push_back(
+      std::make_unique<btllib::NtHash>(seq, seq_len, hash_num, k));
+  }
+}
+
+bool
+MultiNtHash::roll()
+{
+  // Each k value's hashes are rolled past the current position, and the next
+  // position is the first one any of them is at
+  auto next_pos = std::numeric_limits<size_t>::max();
+  for (size_t i = 0; i < nthashes.size(); i++) {
+    if (rolling[i] == 0) {
+      continue;
+    }
+    if (!started || nthashes[i]->get_pos() == pos) {
+      rolling[i] = char(nthashes[i]->roll());
+    }
+    if (rolling[i] != 0) {
+      next_pos = std::min(next_pos, nthashes[i]->get_pos());
+    }
+  }
+  started = true;
+  pos = next_pos;
+  return next_pos != std::numeric_limits<size_t>::max();
+}
+
+template<typename KmerCounter>
 void
 fill_bfs(const char* seq,
          const size_t seq_len,
          const unsigned hash_num,
          const std::vector<unsigned>& k_values,
          const unsigned kmer_threshold,
-         std::vector<std::unique_ptr<btllib::KmerCountingBloomFilter8>>& cbfs,
+         std::vector<std::unique_ptr<KmerCounter>>& counters,
          std::vector<std::unique_ptr<btllib::KmerBloomFilter>>& bfs)
 {
   btllib::check_error(kmer_threshold < 4,
                       FN_NAME + ": kmer_threshold must be "
                                 "greater than or equal to 4.");
-  unsigned adjusted_kmer_threshold = kmer_threshold - 2;
-  for (size_t i = 0; i < k_values.size(); i++) {
-    const auto k = k_values[i];
-    const auto& cbf = cbfs[i];
-    const auto& bf = bfs[i];
-    btllib::NtHash nthash(seq, seq_len, hash_num, k);
-    while (nthash.roll()) {
-      if (cbf->insert_thresh_contains(nthash.hashes(),
-                                      adjusted_kmer_threshold) >=
-          adjusted_kmer_threshold) {
-        bf->insert(nthash.hashes());
+  // The sequence is read once for all k values. Each k value has its own
+  // counter and filter, which see its k-mers in the same order as when the
+  // k values are rolled one after the other, so the filters are the same.
+  MultiNtHash nthash(seq, seq_len, hash_num, k_values);
+  while (nthash.roll()) {
+    for (size_t i = 0; i < k_values.size(); i++) {
+      if (!nthash.has_hashes(i)) {
+        continue;
+      }
+      const auto threshold = adjusted_kmer_threshold(kmer_threshold, i);
+      const auto* const hashes = nthash.hashes(i);
+      if (counters[i]->insert_thresh_contains(hashes, threshold) >=
+          threshold) {
+        bfs[i]->insert(hashes);
       }
     }
-    adjusted_kmer_threshold++;
   }
 }
+
+template<typename KmerCounter>
+void
+count_kmers(const char* seq,
+            const size_t seq_len,
+            const unsigned hash_num,
+            const std::vector<unsigned>& k_values,
+            const std::vector<unsigned>& kmer_thresholds,
+            std::vector<std::unique_ptr<KmerCounter>>& counters,
+            SampledKmerCounts* const sampled_counts,
+            const uint64_t sample_mask)
+{
+  MultiNtHash nthash(seq, seq_len, hash_num, k_values);
+  while (nthash.roll()) {
+    for (size_t i = 0; i < k_values.size(); i++) {
+      if (!nthash.has_hashes(i)) {
+        continue;
+      }
+      const auto* const hashes = nthash.hashes(i);
+      counters[i]->insert_thresh_contains(hashes, kmer_thresholds[i]);
+      if (sampled_counts != nullptr && (hashes[0] & sample_mask) == 0) {
+        (*sampled_counts)[i][hashes[0]]++;
+      }
+    }
+  }
+}
+
+template<typename KmerCounter>
+void
+promote_kmers(const char* seq,
+              const size_t seq_len,
+              const unsigned hash_num,
+              const std::vector<unsigned>& k_values,
+              const std::vector<unsigned>& kmer_thresholds,
+              const std::vector<std::unique_ptr<KmerCounter>>& counters,
+              std::vector<std::unique_ptr<btllib::KmerBloomFilter>>& bfs)
+{
+  MultiNtHash nthash(seq, seq_len, hash_num, k_values);
+  while (nthash.roll()) {
+    for (size_t i = 0; i < k_values.size(); i++) {
+      if (nthash.has_hashes(i) &&
+          counters[i]->contains(nthash.hashes(i)) >= kmer_thresholds[i]) {
+        bfs[i]->insert(nthash.hashes(i));
+      }
+    }
+  }
+}
+
+template void
+fill_bfs(const char* seq,
+         size_t seq_len,
+         unsigned hash_num,
+         const std::vector<unsigned>& k_values,
+         unsigned kmer_threshold,
+         std::vector<std::unique_ptr<PooledCountingBloomFilter>>& counters,
+         std::vector<std::unique_ptr<btllib::KmerBloomFilter>>& bfs);
+
+// btllib's counting filters, which the pooled ones count the same as
+template void
+fill_bfs(
+  const char* seq,
+  size_t seq_len,
+  unsigned hash_num,
+  const std::vector<unsigned>& k_values,
+  unsigned kmer_threshold,
+  std::vector<std::unique_ptr<btllib::KmerCountingBloomFilter8>>& counters,
+  std::vector<std::unique_ptr<btllib::KmerBloomFilter>>& bfs);
+
+template void
+fill_bfs(const char* seq,
+         size_t seq_len,
+         unsigned hash_num,
+         const std::vector<unsigned>& k_values,
+         unsigned kmer_threshold,
+         std::vector<std::unique_ptr<PooledKmerCountTable>>& counters,
+         std::vector<std::unique_ptr<btllib::KmerBloomFilter>>& bfs);
+
+template void
+count_kmers(const char* seq,
+            size_t seq_len,
+            unsigned hash_num,
+            const std::vector<unsigned>& k_values,
+            const std::vector<unsigned>& kmer_thresholds,
+            std::vector<std::unique_ptr<PooledCountingBloomFilter>>& counters,
+            SampledKmerCounts* sampled_counts,
+            uint64_t sample_mask);
+
+template void
+count_kmers(const char* seq,
+            size_t seq_len,
+            unsigned hash_num,
+            const std::vector<unsigned>& k_values,
+            const std::vector<unsigned>& kmer_thresholds,
+            std::vector<std::unique_ptr<PooledKmerCountTable>>& counters,
+            SampledKmerCounts* sampled_counts,
+            uint64_t sample_mask);
+
+template void
+promote_kmers(
+  const char* seq,
+  size_t seq_len,
+  unsigned hash_num,
+  const std::vector<unsigned>& k_values,
+  const std::vector<unsigned>& kmer_thresholds,
+  const std::vector<std::unique_ptr<PooledCountingBloomFilter>>& counters,
+  std::vector<std::unique_ptr<btllib::KmerBloomFilter>>& bfs);
+
+template void
+promote_kmers(
+  const char* seq,
+  size_t seq_len,
+  unsigned hash_num,
+  const std::vector<unsigned>& k_values,
+  const std::vector<unsigned>& kmer_thresholds,
+  const std::vector<std::unique_ptr<PooledKmerCountTable>>& counters,
+  std::vector<std::unique_ptr<btllib::KmerBloomFilter>>& bfs);
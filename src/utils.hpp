@@ -1,15 +1,114 @@
 #ifndef UTILS_HPP
 #define UTILS_HPP
 
+#include "filter_pool.hpp"
 #include "fn_name.hpp"
 
 #include "btllib/bloom_filter.hpp"
-#include "btllib/counting_bloom_filter.hpp"
+#include "btllib/nthash.hpp"
 
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include <sys/stat.h>
+
+// Memory mapping of a whole file. The mapping is shared between processes
+// mapping the same file, so its pages are only loaded once.
+class MappedFile
+{
+
+public:
+  MappedFile() = default;
+  // Map an existing file read-only.
+  explicit MappedFile(const std::string& filepath);
+  // Create a file of the given size and map it writable.
+  MappedFile(const std::string& filepath, size_t size);
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  MappedFile(MappedFile&& other) noexcept;
+  MappedFile& operator=(MappedFile&& other) noexcept;
+
+  const char* data() const { return mapping; }
+  char* data() { return mapping; }
+  size_t size() const { return bytes; }
+
+  void advise(int advice) const;
+  void advise(size_t start, size_t len, int advice) const;
+
+private:
+  void unmap();
+
+  char* mapping = nullptr;
+  size_t bytes = 0;
+};
+
+// Read-only view of a contiguous array.
+template<typename T>
+class Span
+{
+
+public:
+  Span() = default;
+  Span(const T* data, size_t size)
+    : ptr(data)
+    , len(size)
+  {
+  }
+
+  const T* begin() const { return ptr; }
+  const T* end() const { return ptr + len; }
+  const T* data() const { return ptr; }
+  size_t size() const { return len; }
+  bool empty() const { return len == 0; }
+  const T& operator[](size_t i) const { return ptr[i]; }
+
+private:
+  const T* ptr = nullptr;
+  size_t len = 0;
+};
+
+// Don't split a file into chunks smaller than this for parallel parsing
+static const size_t MIN_CHUNK_BYTES = 4ULL * 1024ULL * 1024ULL;
+// How many chunks to create per thread, for load balancing
+static const size_t CHUNKS_PER_THREAD = 16;
+
+static const uint64_t FNV1A_OFFSET_BASIS = 0xcbf29ce484222325ULL;
+static const uint64_t FNV1A_PRIME = 0x100000001b3ULL;
+
+// 64-bit FNV-1a hash. Hashes of several buffers are chained by passing the
+// previous hash as seed.
+inline uint64_t
+fnv1a_hash(const char* data,
+           const size_t size,
+           uint64_t seed = FNV1A_OFFSET_BASIS)
+{
+  for (size_t i = 0; i < size; i++) {
+    seed = (seed ^ static_cast<unsigned char>(data[i])) * FNV1A_PRIME;
+  }
+  return seed;
+}
+
+// Start of the line after the one at line, or end if there is none.
+inline const char*
+next_line(const char* line, const char* end)
+{
+  const auto* const newline =
+    static_cast<const char*>(std::memchr(line, '\n', end - line));
+  return newline == nullptr ? end : newline + 1;
+}
+
+// Modification time of a file from its status, in nanoseconds
+int64_t
+get_mtime_ns(const struct stat& st);
+
 std::vector<size_t>
 get_random_indices(size_t total_size, size_t count);
 
@@ -28,25 +127,146 @@ read_pipe(const std::string& pipepath);
 void
 confirm_pipe(const std::string& pipepath);
 
+// Create a Unix stream socket listening at socketpath, replacing any stale
+// socket file there, and return its descriptor.
+int
+listen_socket(const std::string& socketpath);
+
+// Accept a client of the listening socket listen_fd, like accept, with the
+// same options as listen_socket's descriptor. Returns -1 with errno set if
+// accept fails.
+int
+accept_socket(int listen_fd);
+
+// Write all of data to the connected socket fd. Returns false if the peer is
+// gone.
+bool
+send_all(int fd, const std::string& data);
+
+// Write all of data to the connected socket fd, passing the descriptors fds
+// along with its first byte. Returns false if the peer is gone.
+bool
+send_all(int fd, const std::string& data, const std::vector<int>& fds);
+
+// Create an anonymous file in memory, which is freed once the last process
+// holding a descriptor of it closes it, and return its descriptor. Returns -1
+// with errno set where there are no such files.
+int
+create_memory_file(const std::string& name);
+
+// Rolls the hashes of several k values over a sequence in a single pass, one
+// position at a time. At each position, the k values that have a k-mer
+// without non-ACGT bases starting there have hashes, the same as
+// btllib::NtHash gives for that k-mer.
+class MultiNtHash
+{
+
+public:
+  MultiNtHash(const char* seq,
+              size_t seq_len,
+              unsigned hash_num,
+              const std::vector<unsigned>& k_values);
+
+  MultiNtHash(const MultiNtHash&) = delete;
+  MultiNtHash& operator=(const MultiNtHash&) = delete;
+
+  // Move to the next position where a k value has a k-mer. Returns false
+  // once no k value has k-mers left.
+  bool roll();
+  size_t get_pos() const { return pos; }
+  // Whether k_values[i] has a k-mer at the current position, and its hashes
+  bool has_hashes(size_t i) const
+  {
+    return rolling[i] != 0 && nthashes[i]->get_pos() == pos;
+  }
+  const uint64_t* hashes(size_t i) const { return nthashes[i]->hashes(); }
+
+private:
+  std::vector<std::unique_ptr<btllib::NtHash>> nthashes;
+  // Whether each k value has k-mers left
+  std::vector<char> rolling;
+  size_t pos = 0;
+  bool started = false;
+};
+
+// Threshold of k_values[k_index], which rises by one for each further k value
+// from kmer_threshold - 2
+inline unsigned
+adjusted_kmer_threshold(const unsigned kmer_threshold, const size_t k_index)
+{
+  return unsigned(kmer_threshold - 2 + k_index);
+}
+
+// Thresholds of all k values from the threshold of the first one plus 2, as
+// adjusted_kmer_threshold gives them
+inline std::vector<unsigned>
+adjusted_kmer_thresholds(const unsigned kmer_threshold, const size_t k_num)
+{
+  std::vector<unsigned> kmer_thresholds;
+  for (size_t i = 0; i < k_num; i++) {
+    kmer_thresholds.push_back(adjusted_kmer_threshold(kmer_threshold, i));
+  }
+  return kmer_thresholds;
+}
+
+// Exact counts of a sample of k-mers, for each k value
+using SampledKmerCounts = std::vector<std::unordered_map<uint64_t, unsigned>>;
+
+// Count the k-mers of seq for every k value in its counter, a
+// PooledCountingBloomFilter or PooledKmerCountTable, up to its threshold in
+// kmer_thresholds, without inserting them into filters. Counters of shards of
+// a batch's sequences are summed and handed to promote_kmers. With
+// sampled_counts, the k-mers whose hash has no bits of sample_mask set are
+// also counted in it, exactly and without a threshold.
+template<typename KmerCounter>
+void
+count_kmers(const char* seq,
+            size_t seq_len,
+            unsigned hash_num,
+            const std::vector<unsigned>& k_values,
+            const std::vector<unsigned>& kmer_thresholds,
+            std::vector<std::unique_ptr<KmerCounter>>& counters,
+            SampledKmerCounts* sampled_counts = nullptr,
+            uint64_t sample_mask = 0);
+
+// Insert the k-mers of seq for every k value whose counts in counters reach
+// their thresholds in kmer_thresholds into their filters. The same filters
+// can be filled from different sequences concurrently.
+template<typename KmerCounter>
+void
+promote_kmers(const char* seq,
+              size_t seq_len,
+              unsigned hash_num,
+              const std::vector<unsigned>& k_values,
+              const std::vector<unsigned>& kmer_thresholds,
+              const std::vector<std::unique_ptr<KmerCounter>>& counters,
+              std::vector<std::unique_ptr<btllib::KmerBloomFilter>>& bfs);
+
+// Insert the k-mers of seq into their filters, once their counters, a
+// PooledCountingBloomFilter or PooledKmerCountTable for each k value, have
+// seen them enough times. With PooledKmerCountTable counters, the same
+// filters can be filled from different sequences concurrently.
+template<typename KmerCounter>
 void
 fill_bfs(const char* seq,
          size_t seq_len,
          unsigned hash_num,
          const std::vector<unsigned>& k_values,
          unsigned kmer_threshold,
-         std::vector<std::unique_ptr<btllib::KmerCountingBloomFilter8>>& cbfs,
+         std::vector<std::unique_ptr<KmerCounter>>& counters,
          std::vector<std::unique_ptr<btllib::KmerBloomFilter>>& bfs);
 
+template<typename KmerCounter>
 inline void
 fill_bfs(const std::string& seq,
          unsigned hash_num,
          const std::vector<unsigned>& k_values,
          unsigned kmer_threshold,
-         std::vector<std::unique_ptr<btllib::KmerCountingBloomFilter8>>& cbfs,
+         std::vector<std::unique_ptr<KmerCounter>>& counters,
          std::vector<std::unique_ptr<btllib::KmerBloomFilter>>& bfs)
 {
   fill_bfs(
-    seq.c_str(), seq.size(), hash_num, k_values, kmer_threshold, cbfs, bfs);
+    seq.c_str(), seq.size(), hash_num, k_values, kmer_threshold, counters, bfs);
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,276 @@
+#include "bam.hpp"
+#include "mappings.hpp"
+#include "seqindex.hpp"
+
+#include "btllib/status.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+static const std::string TARGET_SEQS_FILEPATH = "bam_test_targets.fa";
+static const std::string MAPPED_SEQS_FILEPATH = "bam_test_reads.fa";
+static const std::string SAM_FILEPATH = "bam_test.sam";
+static const std::string BAM_FILEPATH = "bam_test.bam";
+static const std::string TARGET_NAME = "target";
+static const uint32_t TARGET_LEN = 1000;
+static const uint32_t READ_LEN = 100;
+// 1-based, as in SAM files
+static const uint32_t POS = 101;
+static const uint32_t PADDING = 10;
+
+struct CigarCase
+{
+  uint16_t flag;
+  std::string cigar;
+  // Aligned part of the read as sequenced, and the reference bases covered
+  uint32_t query_start, query_end, ref_span;
+};
+
+// One read of READ_LEN bases is mapped with each case, the reads being named
+// in the same order, so they have the same IDs
+static const std::vector<CigarCase> CASES = {
+  { 0, "100M", 0, 100, 100 },
+  { 0, "10S80M10S", 10, 90, 80 },
+  { BAM_FLAG_REVERSE, "5S80M15S", 15, 95, 80 },
+  { 0, "5H80M15H", 5, 85, 80 },
+  // Hard clips are counted like soft clips, as they are still part of the
+  // read as sequenced
+  { BAM_FLAG_REVERSE, "5H80M15H", 15, 95, 80 },
+  { BAM_FLAG_REVERSE, "3H2S80M10S5H", 15, 95, 80 },
+  { 0, "10S40M5I20M3D15M10S", 10, 90, 78 },
+  { BAM_FLAG_REVERSE, "20S30M10N30M20H", 20, 80, 70 },
+  { 0, "50=1X49=", 0, 100, 100 },
+  { BAM_FLAG_REVERSE, "*", 0, READ_LEN, 0 },
+};
+
+static std::string
+read_name(const size_t i)
+{
+  return "read" + std::to_string(i);
+}
+
+static CigarSpans
+parse_cigar(const std::string& cigar)
+{
+  CigarSpans spans;
+  uint32_t len = 0;
+  for (const auto c : cigar) {
+    if (c >= '0' && c <= '9') {
+      len = len * 10 + uint32_t(c - '0');
+      continue;
+    }
+    spans.add(len, unsigned(CigarSpans::CIGAR_OPS.find(c)));
+    len = 0;
+  }
+  return spans;
+}
+
+template<typename T>
+static void
+append_le(std::string& bytes, const T value)
+{
+  for (size_t i = 0; i < sizeof(T); i++) {
+    bytes += char((uint64_t(value) >> (8 * i)) & 0xFF); // NOLINT
+  }
+}
+
+static std::string
+bgzf_block(const std::string& data)
+{
+  std::string compressed(compressBound(uLong(data.size())) + 64, '\0');
+  z_stream stream{};
+  btllib::check_error(deflateInit2(&stream,
+                                   Z_DEFAULT_COMPRESSION,
+                                   Z_DEFLATED,
+                                   -MAX_WBITS,
+                                   8,
+                                   Z_DEFAULT_STRATEGY) != Z_OK,
+                      "deflateInit2 failed.");
+  // NOLINTBEGIN(cppcoreguidelines-pro-type-reinterpret-cast)
+  auto input = data;
+  stream.next_in = reinterpret_cast<Bytef*>(input.data());
+  stream.avail_in = uInt(input.size());
+  stream.next_out = reinterpret_cast<Bytef*>(compressed.data());
+  stream.avail_out = uInt(compressed.size());
+  btllib::check_error(deflate(&stream, Z_FINISH) != Z_STREAM_END,
+                      "deflate failed.");
+  compressed.resize(stream.total_out);
+  deflateEnd(&stream);
+
+  std::string block = { 31, char(139), 8, 4, 0, 0, 0, 0, 0, char(255), 6, 0 };
+  block += "BC";
+  append_le<uint16_t>(block, 2);
+  // The block size minus one, counting this field and the CRC32 and ISIZE
+  append_le<uint16_t>(block,
+                      uint16_t(block.size() + 2 + compressed.size() + 8 - 1));
+  block += compressed;
+  const auto* const bytes = reinterpret_cast<const Bytef*>(data.data());
+  append_le<uint32_t>(block, uint32_t(crc32(0, bytes, uInt(data.size()))));
+  // NOLINTEND(cppcoreguidelines-pro-type-reinterpret-cast)
+  append_le<uint32_t>(block, uint32_t(data.size()));
+  return block;
+}
+
+static void
+write_files()
+{
+  std::ofstream targets(TARGET_SEQS_FILEPATH);
+  targets << '>' << TARGET_NAME << '\n' << std::string(TARGET_LEN, 'A') << '\n';
+  targets.close();
+
+  std::ofstream reads(MAPPED_SEQS_FILEPATH);
+  for (size_t i = 0; i < CASES.size(); i++) {
+    reads << '>' << read_name(i) << '\n' << std::string(READ_LEN, 'C') << '\n';
+  }
+  reads.close();
+
+  std::string header = "@SQ\tSN:" + TARGET_NAME +
+                       "\tLN:" + std::to_string(TARGET_LEN) + '\n';
+  std::ofstream sam(SAM_FILEPATH);
+  sam << header;
+
+  std::string bam = "BAM\1";
+  append_le<int32_t>(bam, int32_t(header.size()));
+  bam += header;
+  append_le<int32_t>(bam, 1);
+  append_le<int32_t>(bam, int32_t(TARGET_NAME.size() + 1));
+  bam += TARGET_NAME + '\0';
+  append_le<int32_t>(bam, int32_t(TARGET_LEN));
+
+  for (size_t i = 0; i < CASES.size(); i++) {
+    const auto& test_case = CASES[i];
+    sam << read_name(i) << '\t' << test_case.flag << '\t' << TARGET_NAME
+        << '\t' << POS << "\t60\t" << test_case.cigar << "\t*\t0\t0\t*\t*\n";
+
+    std::vector<uint32_t> ops;
+    uint32_t len = 0;
+    for (const auto c : test_case.cigar) {
+      if (c >= '0' && c <= '9') {
+        len = len * 10 + uint32_t(c - '0');
+      } else if (c != '*') {
+        ops.push_back((len << 4U) |
+                      uint32_t(CigarSpans::CIGAR_OPS.find(c)));
+        len = 0;
+      }
+    }
+    const auto name = read_name(i);
+    std::string record;
+    append_le<int32_t>(record, 0);
+    append_le<int32_t>(record, int32_t(POS - 1));
+    record += char(name.size() + 1);
+    record += char(60);
+    append_le<uint16_t>(record, 0);
+    append_le<uint16_t>(record, uint16_t(ops.size()));
+    append_le<uint16_t>(record, test_case.flag);
+    append_le<int32_t>(record, 0);
+    append_le<int32_t>(record, -1);
+    append_le<int32_t>(record, -1);
+    append_le<int32_t>(record, 0);
+    record += name + '\0';
+    for (const auto op : ops) {
+      append_le<uint32_t>(record, op);
+    }
+    append_le<int32_t>(bam, int32_t(record.size()));
+    bam += record;
+  }
+  sam.close();
+
+  std::ofstream bam_file(BAM_FILEPATH, std::ios::binary);
+  bam_file << bgzf_block(bam) << bgzf_block("");
+  bam_file.close();
+}
+
+static void
+check_mappings(const std::string& mappings_filepath,
+               const SeqIndex& target_seqs_index,
+               const SeqIndex& mapped_seqs_index,
+               const uint32_t padding)
+{
+  const AllMappings all_mappings(mappings_filepath,
+                                 target_seqs_index,
+                                 mapped_seqs_index,
+                                 1,
+                                 1,
+                                 1,
+                                 1,
+                                 padding);
+  const auto target_id = target_seqs_index.get_seq_id(TARGET_NAME);
+  const auto mapped_ids = all_mappings.get_mappings(target_id);
+  const auto mapped_intervals = all_mappings.get_mapped_intervals(target_id);
+  const auto target_intervals = all_mappings.get_target_intervals(target_id);
+  btllib::check_error(mapped_ids.size() != CASES.size(),
+                      mappings_filepath + " has " +
+                        std::to_string(mapped_ids.size()) + " mappings.");
+
+  for (size_t i = 0; i < mapped_ids.size(); i++) {
+    const auto name =
+      std::string(mapped_seqs_index.get_seq_name(mapped_ids[i]));
+    const auto& test_case = CASES.at(std::stoul(name.substr(4)));
+    const auto expected_start =
+      test_case.query_start > padding ? test_case.query_start - padding : 0;
+    const auto expected_end =
+      READ_LEN - test_case.query_end > padding ? test_case.query_end + padding
+                                               : READ_LEN;
+    const auto& interval = mapped_intervals[i];
+    btllib::check_error(
+      interval.start != expected_start || interval.end != expected_end,
+      mappings_filepath + ": " + test_case.cigar + " with flag " +
+        std::to_string(test_case.flag) + " and padding " +
+        std::to_string(padding) + " gives read interval [" +
+        std::to_string(interval.start) + ", " + std::to_string(interval.end) +
+        ") instead of [" + std::to_string(expected_start) + ", " +
+        std::to_string(expected_end) + ").");
+
+    const auto expected_target =
+      test_case.cigar == "*"
+        ? WHOLE_TARGET
+        : MappedInterval{ POS - 1, POS - 1 + test_case.ref_span };
+    btllib::check_error(target_intervals[i].start != expected_target.start ||
+                          target_intervals[i].end != expected_target.end,
+                        mappings_filepath + ": " + test_case.cigar +
+                          " gives the wrong target interval.");
+  }
+}
+
+int
+main()
+{
+  for (const auto& test_case : CASES) {
+    if (test_case.cigar == "*") {
+      continue;
+    }
+    const auto spans = parse_cigar(test_case.cigar);
+    const auto reverse = (test_case.flag & BAM_FLAG_REVERSE) != 0;
+    btllib::check_error(
+      spans.query_start(reverse) != test_case.query_start ||
+        spans.query_start(reverse) + spans.query_span != test_case.query_end ||
+        spans.ref_span != test_case.ref_span ||
+        spans.leading_clip + spans.query_span + spans.trailing_clip !=
+          READ_LEN,
+      test_case.cigar + " with flag " + std::to_string(test_case.flag) +
+        " gives the wrong spans.");
+  }
+
+  write_files();
+  const SeqIndex target_seqs_index(TARGET_SEQS_FILEPATH, 1);
+  const SeqIndex mapped_seqs_index(MAPPED_SEQS_FILEPATH, 1);
+  for (const auto& mappings_filepath : { SAM_FILEPATH, BAM_FILEPATH }) {
+    for (const auto padding : { uint32_t(0), PADDING, UINT32_MAX }) {
+      check_mappings(
+        mappings_filepath, target_seqs_index, mapped_seqs_index, padding);
+    }
+  }
+
+  for (const auto& filepath : { TARGET_SEQS_FILEPATH,
+                                MAPPED_SEQS_FILEPATH,
+                                SAM_FILEPATH,
+                                BAM_FILEPATH }) {
+    std::remove(filepath.c_str());
+  }
+  return 0;
+}
@@ -0,0 +1,139 @@
+#include "filter_pool.hpp"
+
+#include "btllib/status.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <omp.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static const int THREADS = 4;
+static const size_t KMERS = 5000;
+static const size_t INSERTS = 100000;
+static const size_t REPEATS_PER_THREAD = 100;
+
+static std::mt19937_64 rng(1); // NOLINT(cert-msc32-c,cert-msc51-cpp)
+
+static std::vector<uint64_t>
+random_kmers(const size_t count)
+{
+  std::vector<uint64_t> kmers;
+  for (size_t i = 0; i < count; i++) {
+    kmers.push_back(rng());
+  }
+  return kmers;
+}
+
+static PooledKmerCountTable
+make_table(FilterPool& pool, const size_t kmers)
+{
+  return PooledKmerCountTable(
+    std::move(pool.acquire(PooledKmerCountTable::bytes_for(kmers), 1)[0]));
+}
+
+// Inserted in serial, the table returns the same counts as a map counting up
+// to each insert's threshold
+static void
+check_serial()
+{
+  FilterPool pool;
+  auto table = make_table(pool, KMERS);
+  const auto kmers = random_kmers(KMERS);
+  std::unordered_map<uint64_t, unsigned> counts;
+  for (size_t i = 0; i < INSERTS; i++) {
+    // Some k-mers are inserted many times and saturate their counts
+    const auto kmer =
+      kmers[i % 2 == 0 ? rng() % KMERS : rng() % (KMERS / 1000)];
+    const auto threshold = uint8_t(rng() % 2 == 0 ? UINT8_MAX : rng() % 20);
+    auto& count = counts[kmer];
+    if (count == 0 || (count < threshold && count < UINT8_MAX)) {
+      count++;
+    }
+    const auto table_count = table.insert_thresh_contains(&kmer, threshold);
+    btllib::check_error(table_count != count,
+                        "The count table counted " +
+                          std::to_string(table_count) + " instead of " +
+                          std::to_string(count) + ".");
+  }
+}
+
+// Inserted from several threads at once, the table ends up with the same
+// counts as in serial
+static void
+check_parallel()
+{
+  FilterPool pool;
+  auto table = make_table(pool, KMERS);
+  const auto kmers = random_kmers(KMERS);
+  std::vector<uint64_t> inserts;
+  for (size_t i = 0; i < KMERS; i++) {
+    inserts.insert(inserts.end(), i % REPEATS_PER_THREAD + 1, kmers[i]);
+  }
+  std::shuffle(inserts.begin(), inserts.end(), rng);
+
+#pragma omp parallel for num_threads(THREADS) schedule(static, 1)
+  for (int thread = 0; thread < THREADS; thread++) {
+    for (const auto kmer : inserts) {
+      table.insert_thresh_contains(&kmer, UINT8_MAX);
+    }
+  }
+
+  for (size_t i = 0; i < KMERS; i++) {
+    const auto expected =
+      std::min<unsigned>((i % REPEATS_PER_THREAD + 1) * THREADS, UINT8_MAX);
+    // A threshold of 0 returns the count without adding to it
+    const auto count = table.insert_thresh_contains(&kmers[i], 0);
+    btllib::check_error(count != expected,
+                        "Counted " + std::to_string(count) + " instead of " +
+                          std::to_string(expected) +
+                          " inserts from several threads.");
+  }
+}
+
+// Whether inserting kmers distinct k-mers into a table sized for
+// table_kmers exits the process, which is checked in a child process
+static bool
+fails_on_insert(const size_t table_kmers, const size_t kmers)
+{
+  const auto pid = fork();
+  btllib::check_error(pid == -1, "fork failed: " + btllib::get_strerror());
+  if (pid == 0) {
+    FilterPool pool;
+    auto table = make_table(pool, table_kmers);
+    for (const auto kmer : random_kmers(kmers)) {
+      table.insert_thresh_contains(&kmer, UINT8_MAX);
+    }
+    _exit(0);
+  }
+  int status = 0;
+  btllib::check_error(waitpid(pid, &status, 0) != pid,
+                      "waitpid failed: " + btllib::get_strerror());
+  return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+// A table takes as many k-mers as it was sized for, and fails with an error
+// instead of probing endlessly once it is full
+static void
+check_full()
+{
+  btllib::check_error(fails_on_insert(KMERS, KMERS),
+                      "The count table failed below its size.");
+  const auto slots = PooledKmerCountTable::bytes_for(KMERS) / sizeof(uint64_t);
+  btllib::check_error(!fails_on_insert(KMERS, slots),
+                      "The count table didn't fail once full.");
+}
+
+int
+main()
+{
+  check_serial();
+  check_parallel();
+  check_full();
+  return 0;
+}
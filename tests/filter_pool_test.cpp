@@ -0,0 +1,251 @@
+#include "filter_pool.hpp"
+#include "utils.hpp"
+
+#include "btllib/bloom_filter.hpp"
+#include "btllib/counting_bloom_filter.hpp"
+#include "btllib/status.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <omp.h>
+
+static const int THREADS = 4;
+static const size_t BUFFER_BYTES = 1000;
+static const size_t BUFFERS_PER_THREAD = 2;
+static const std::vector<size_t> CBF_BYTES = { 1000, 1001, 1024, 4099 };
+static const std::vector<unsigned> HASH_NUMS = { 1, 3, 5 };
+static const size_t KMERS = 3000;
+static const size_t INSERTS = 30000;
+static const std::vector<unsigned> K_VALUES = { 32, 28 };
+static const unsigned KMER_THRESHOLD = 4;
+static const size_t READS = 200;
+static const size_t READ_LEN = 150;
+static const size_t GENOME_LEN = 2000;
+static const size_t FILL_CBF_BYTES = 10001;
+static const size_t BF_BYTES = 4096;
+static const size_t BUDGET_BYTES = 1000;
+
+static std::mt19937_64 rng(1); // NOLINT(cert-msc32-c,cert-msc51-cpp)
+
+static void
+check_size_classes()
+{
+  for (const size_t bytes : { size_t(1),
+                              size_t(7),
+                              BUFFER_BYTES,
+                              size_t(1) << 20U,
+                              size_t(10) * 1024 * 1024 + 1 }) {
+    const auto size = FilterPool::size_class(bytes);
+    btllib::check_error(size < bytes || size * 4 >= bytes * 5 + 4,
+                        "Size class " + std::to_string(size) + " of " +
+                          std::to_string(bytes) + " bytes.");
+  }
+  btllib::check_error(FilterPool::size_class(size_t(1) << 20U) !=
+                        size_t(1) << 20U,
+                      "A power of 2 isn't a size class of its own.");
+}
+
+// Each thread gets back the zeroed buffers it released, from its own free
+// list, even after other threads released theirs. Threads release and then
+// acquire one after the other, so the order is the same in every run.
+static void
+check_free_lists()
+{
+  omp_set_num_threads(THREADS);
+  FilterPool pool;
+  std::vector<std::vector<const uint8_t*>> released(THREADS);
+  bool reused_own = true, zeroed = true;
+#pragma omp parallel num_threads(THREADS) default(shared)
+  {
+    const auto thread = omp_get_thread_num();
+    auto buffers = pool.acquire(BUFFER_BYTES, BUFFERS_PER_THREAD);
+    for (auto& buffer : buffers) {
+      std::fill(buffer.data(), buffer.data() + buffer.size(), UINT8_MAX);
+      released[thread].push_back(buffer.data());
+    }
+    for (int i = 0; i < THREADS; i++) {
+#pragma omp barrier
+      if (i == thread) {
+        buffers.clear();
+      }
+    }
+    for (int i = 0; i < THREADS; i++) {
+#pragma omp barrier
+      if (i == thread) {
+        buffers = pool.acquire(BUFFER_BYTES, BUFFERS_PER_THREAD);
+      }
+    }
+    for (auto& buffer : buffers) {
+      if (std::find(released[thread].begin(),
+                    released[thread].end(),
+                    buffer.data()) == released[thread].end()) {
+#pragma omp atomic write
+        reused_own = false;
+      }
+      for (size_t i = 0; i < buffer.size(); i++) {
+        if (buffer.data()[i] != 0) {
+#pragma omp atomic write
+          zeroed = false;
+        }
+      }
+    }
+  }
+  btllib::check_error(!reused_own,
+                      "A thread didn't reuse the buffers it released.");
+  btllib::check_error(!zeroed, "A reused buffer wasn't cleared.");
+}
+
+// The pooled filter returns the same counts as btllib's filter of the same
+// size and number of hashes, including sizes that btllib rounds up and
+// saturated counters
+static void
+check_counts(const size_t bytes, const unsigned hash_num)
+{
+  FilterPool pool;
+  PooledCountingBloomFilter pooled(
+    std::move(pool.acquire(PooledCountingBloomFilter::bytes_for(bytes), 1)[0]),
+    bytes,
+    hash_num);
+  btllib::KmerCountingBloomFilter8 cbf(bytes, hash_num, K_VALUES[0]);
+
+  std::vector<std::vector<uint64_t>> kmer_hashes(KMERS);
+  for (auto& hashes : kmer_hashes) {
+    for (unsigned i = 0; i < hash_num; i++) {
+      hashes.push_back(rng());
+    }
+  }
+  for (size_t i = 0; i < INSERTS; i++) {
+    // Some k-mers are inserted many times and reach any threshold
+    const auto& hashes =
+      kmer_hashes[i % 2 == 0 ? rng() % KMERS : rng() % (KMERS / 100)];
+    const auto threshold = uint8_t(rng() % 2 == 0 ? UINT8_MAX : rng() % 20);
+    const auto pooled_count =
+      pooled.insert_thresh_contains(hashes.data(), threshold);
+    const auto btllib_count =
+      cbf.insert_thresh_contains(hashes.data(), threshold);
+    btllib::check_error(pooled_count != btllib_count,
+                        "A pooled counting filter of " +
+                          std::to_string(bytes) + " bytes and " +
+                          std::to_string(hash_num) + " hashes counted " +
+                          std::to_string(pooled_count) + " instead of " +
+                          std::to_string(btllib_count) + ".");
+  }
+}
+
+// A batch is admitted while it fits next to the admitted ones, or on its own
+// if it is larger than the budget, and its share returns once it is done
+static void
+check_memory_budget()
+{
+  const std::chrono::milliseconds no_wait(0);
+  MemoryBudget budget(BUDGET_BYTES);
+  btllib::check_error(!budget.wait_to_fit(BUDGET_BYTES * 2, no_wait),
+                      "A batch larger than the budget wasn't let in alone.");
+  {
+    const auto large = budget.admit(BUDGET_BYTES * 2, 0);
+    btllib::check_error(budget.wait_for_room(no_wait) ||
+                          budget.wait_to_fit(1, no_wait),
+                        "A full budget had room for another batch.");
+  }
+  const auto half = budget.admit(BUDGET_BYTES / 2, 0);
+  btllib::check_error(!budget.wait_to_fit(BUDGET_BYTES / 2, no_wait),
+                      "A batch that fits the rest of the budget wasn't let "
+                      "in.");
+  btllib::check_error(budget.wait_to_fit(BUDGET_BYTES / 2 + 1, no_wait),
+                      "A batch over the rest of the budget was let in.");
+  btllib::check_error(!MemoryBudget().wait_to_fit(BUDGET_BYTES * 2, no_wait),
+                      "A budget of 0 didn't let a batch in.");
+}
+
+static std::string
+read_file(const std::string& filepath)
+{
+  std::ifstream file(filepath, std::ios::binary);
+  return { std::istreambuf_iterator<char>(file),
+           std::istreambuf_iterator<char>() };
+}
+
+// Presence filters filled through pooled counting filters are saved the same
+// as ones filled through btllib's
+static void
+check_saved_filters()
+{
+  static const std::string BASES = "ACGT";
+  std::string genome;
+  for (size_t i = 0; i < GENOME_LEN; i++) {
+    genome += BASES[rng() % BASES.size()];
+  }
+  std::vector<std::string> reads;
+  for (size_t i = 0; i < READS; i++) {
+    reads.push_back(genome.substr(rng() % (GENOME_LEN - READ_LEN), READ_LEN));
+  }
+
+  const unsigned hash_num = HASH_NUMS[1];
+  const auto make_bfs = [&]() {
+    std::vector<std::unique_ptr<btllib::KmerBloomFilter>> bfs;
+    for (const auto k : K_VALUES) {
+      bfs.push_back(
+        std::make_unique<btllib::KmerBloomFilter>(BF_BYTES, hash_num, k));
+    }
+    return bfs;
+  };
+
+  FilterPool pool;
+  std::vector<std::unique_ptr<PooledCountingBloomFilter>> pooled_cbfs;
+  const auto buffer_bytes =
+    PooledCountingBloomFilter::bytes_for(FILL_CBF_BYTES);
+  for (auto& buffer : pool.acquire(buffer_bytes, K_VALUES.size())) {
+    pooled_cbfs.push_back(std::make_unique<PooledCountingBloomFilter>(
+      std::move(buffer), FILL_CBF_BYTES, hash_num));
+  }
+  std::vector<std::unique_ptr<btllib::KmerCountingBloomFilter8>> cbfs;
+  for (const auto k : K_VALUES) {
+    cbfs.push_back(std::make_unique<btllib::KmerCountingBloomFilter8>(
+      FILL_CBF_BYTES, hash_num, k));
+  }
+  auto pooled_bfs = make_bfs();
+  auto bfs = make_bfs();
+  for (const auto& read : reads) {
+    fill_bfs(read, hash_num, K_VALUES, KMER_THRESHOLD, pooled_cbfs, pooled_bfs);
+    fill_bfs(read, hash_num, K_VALUES, KMER_THRESHOLD, cbfs, bfs);
+  }
+
+  for (size_t i = 0; i < K_VALUES.size(); i++) {
+    const auto pooled_filepath =
+      "filter_pool_test_pooled-k" + std::to_string(K_VALUES[i]) + ".bf";
+    const auto filepath =
+      "filter_pool_test-k" + std::to_string(K_VALUES[i]) + ".bf";
+    pooled_bfs[i]->save(pooled_filepath);
+    bfs[i]->save(filepath);
+    btllib::check_error(read_file(pooled_filepath) != read_file(filepath),
+                        "The k = " + std::to_string(K_VALUES[i]) +
+                          " filter filled through a pooled counting filter "
+                          "differs from the one filled through btllib's.");
+    std::remove(pooled_filepath.c_str());
+    std::remove(filepath.c_str());
+  }
+}
+
+int
+main()
+{
+  check_size_classes();
+  check_free_lists();
+  for (const auto bytes : CBF_BYTES) {
+    for (const auto hash_num : HASH_NUMS) {
+      check_counts(bytes, hash_num);
+    }
+  }
+  check_saved_filters();
+  check_memory_budget();
+  return 0;
+}
@@ -0,0 +1,72 @@
+#!/bin/bash
+
+set -eux -o pipefail
+
+prefix=goldpolish_bam_test
+python3 goldpolish_test_data.py ${prefix}
+goldpolish-index ${prefix}.fa ${prefix}.fa.index
+goldpolish-index ${prefix}.fq ${prefix}.fq.index
+# Small BGZF blocks, so that the BAM file has many and records span them
+python3 sam_to_bam.py --block-size 4096 ${prefix}.sam ${prefix}.bam
+
+# Build the Bloom filters of two batches with the given mappings and options
+build_bfs() {
+  local out=$1 mappings=$2
+  shift 2
+  rm -rf ${out}
+  python3 targeted_bfs_client.py \
+    --request "1 32,28 contig1 contig2" --request "2 32,28 contig3 contig4" \
+    ${out} -- --no-mappings-cache "$@" \
+    $(pwd)/${prefix}.fa $(pwd)/${prefix}.fa.index $(pwd)/${mappings} \
+    $(pwd)/${prefix}.fq $(pwd)/${prefix}.fq.index 1000 1000 4 32 28
+}
+
+same_bfs() {
+  for bf in $1/*.bf; do
+    cmp -- ${bf} $2/${bf##*/} || return 1
+  done
+}
+
+echo "Building Bloom filters from SAM and BAM mappings"
+
+build_bfs ${prefix}.sam_bfs ${prefix}.sam
+build_bfs ${prefix}.bam_bfs ${prefix}.bam
+same_bfs ${prefix}.sam_bfs ${prefix}.bam_bfs
+
+build_bfs ${prefix}.sam_skip_bfs ${prefix}.sam --skip-secondary --skip-supplementary
+build_bfs ${prefix}.bam_skip_bfs ${prefix}.bam --skip-secondary --skip-supplementary
+same_bfs ${prefix}.sam_skip_bfs ${prefix}.bam_skip_bfs
+# The test data has secondary and supplementary alignments to skip
+if same_bfs ${prefix}.sam_bfs ${prefix}.sam_skip_bfs; then
+  echo "Skipping secondary and supplementary alignments had no effect"
+  exit 1
+fi
+
+echo "Rejecting corrupt and truncated BAM files"
+
+python3 sam_to_bam.py --block-size 4096 --corrupt-block 5 ${prefix}.sam ${prefix}.corrupt.bam
+bam_size=$(wc -c < ${prefix}.bam)
+head -c $((bam_size / 2)) ${prefix}.bam > ${prefix}.truncated.bam
+for bam in corrupt truncated; do
+  if goldpolish-targeted-bfs --no-mappings-cache \
+      ${prefix}.fa ${prefix}.fa.index ${prefix}.${bam}.bam \
+      ${prefix}.fq ${prefix}.fq.index 1000 1000 4 32 28 2> ${prefix}.${bam}.log; then
+    echo "The ${bam} BAM file was accepted"
+    exit 1
+  fi
+done
+grep "has a corrupt BGZF block" ${prefix}.corrupt.log
+grep "is truncated" ${prefix}.truncated.log
+
+echo "Launching GoldPolish with SAM and BAM mappings"
+
+goldpolish --mappings ${prefix}.sam ${prefix}.fa ${prefix}.fq ${prefix}.sam-polished.fa
+goldpolish --mappings ${prefix}.bam ${prefix}.fa ${prefix}.fq ${prefix}.bam-polished.fa
+
+if cmp -- ${prefix}.sam-polished.fa ${prefix}.bam-polished.fa; then
+  echo "Test successful"
+else
+  echo "Polishing with SAM and BAM mappings gave different results - please check your installation"
+  exit 1
+fi
+exit 0
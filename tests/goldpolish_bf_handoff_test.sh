@@ -0,0 +1,47 @@
+#!/bin/bash
+
+set -eux -o pipefail
+
+prefix=goldpolish_bf_handoff_test
+python3 goldpolish_test_data.py ${prefix}
+goldpolish-index ${prefix}.fa ${prefix}.fa.index
+goldpolish-index ${prefix}.fq ${prefix}.fq.index
+
+# Build the Bloom filters of two batches with the given options and keep the
+# replies
+build_bfs() {
+  local out=$1
+  shift
+  rm -rf ${out}
+  python3 targeted_bfs_client.py \
+    --request "1 32,28 contig1 contig2" --request "2 32,28 contig3 contig4" \
+    ${out} -- --no-mappings-cache "$@" \
+    $(pwd)/${prefix}.fa $(pwd)/${prefix}.fa.index $(pwd)/${prefix}.paf \
+    $(pwd)/${prefix}.fq $(pwd)/${prefix}.fq.index 1000 1000 4 32 28 \
+    > ${out}.replies
+}
+
+same_bfs() {
+  for bf in $1/*.bf; do
+    cmp -- ${bf} $2/${bf##*/} || return 1
+  done
+}
+
+echo "Handing Bloom filters over in memory files and in files"
+
+build_bfs ${prefix}.memory
+build_bfs ${prefix}.files --filter-files
+same_bfs ${prefix}.memory ${prefix}.files
+same_bfs ${prefix}.files ${prefix}.memory
+
+# Files are named in the replies with their directory
+grep -c "^[12] $(pwd)/${prefix}.files/[12]-k32.bf $(pwd)/${prefix}.files/[12]-k28.bf$" ${prefix}.files.replies | grep -x 2
+
+# Memory files are only available on Linux, elsewhere the builder falls back
+# to files
+if [[ "$(uname)" == Linux ]]; then
+  grep -c "^[12] fd: [12]-k32.bf [12]-k28.bf$" ${prefix}.memory.replies | grep -x 2
+fi
+
+echo "Test successful"
+exit 0
@@ -0,0 +1,69 @@
+#!/bin/bash
+
+set -eux -o pipefail
+
+# Download the test data
+curl -L --output test_reads.fq https://www.bcgsc.ca/downloads/btl/goldrush/test/test_reads.fq
+
+# Run this demo to test the built-in mapper of your GoldPolish installation
+echo "Launching GoldPolish with the built-in mapper"
+
+goldpolish --builtin-mapper goldrush_test_golden_path.fa test_reads.fq goldrush_test_golden_path.goldpolish-builtin-polished.fa
+
+# The built-in mapper doesn't pick exactly the reads ntLink does, so the
+# result is compared to the ntLink expectation by its shared k-mers rather
+# than byte for byte. It should miss at most half of the expected k-mers that
+# the unpolished sequences miss.
+if python3 - goldrush_test_golden_path.fa goldrush_test_golden_path.goldpolish-builtin-polished.fa $(pwd)/expected_files/goldrush_test_golden_path.goldpolish-polished_expected.fa <<'EOF'
+import sys
+
+K = 25
+MAX_MISSING_KMERS_RATIO = 0.5
+MAX_LENGTH_DIFFERENCE = 0.01
+
+
+def read_fasta(path):
+    seqs, name = {}, None
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if line.startswith(">"):
+                name = line[1:].split()[0]
+                seqs[name] = []
+            elif name is not None:
+                seqs[name].append(line.upper())
+    return {name: "".join(parts) for name, parts in seqs.items()}
+
+
+def kmers(seqs):
+    return {
+        seq[i : i + K] for seq in seqs.values() for i in range(len(seq) - K + 1)
+    }
+
+
+draft, polished, expected = (read_fasta(path) for path in sys.argv[1:4])
+if polished.keys() != expected.keys():
+    sys.exit("Polished sequences differ from the expected ones")
+
+polished_len = sum(len(seq) for seq in polished.values())
+expected_len = sum(len(seq) for seq in expected.values())
+if abs(polished_len - expected_len) > MAX_LENGTH_DIFFERENCE * expected_len:
+    sys.exit(f"Polished length {polished_len} is far from {expected_len}")
+
+expected_kmers = kmers(expected)
+polished_shared = len(kmers(polished) & expected_kmers) / len(expected_kmers)
+draft_shared = len(kmers(draft) & expected_kmers) / len(expected_kmers)
+print(
+    f"Shared k-mers with the expected result: polished {polished_shared:.4f}, "
+    f"unpolished {draft_shared:.4f}"
+)
+if 1 - polished_shared > MAX_MISSING_KMERS_RATIO * (1 - draft_shared):
+    sys.exit("Polished sequences are too far from the expected ones")
+EOF
+then
+  echo "Test successful"
+else
+  echo "Final polishing file isn't close to the expected result - please check your installation"
+  exit 1
+fi
+exit 0
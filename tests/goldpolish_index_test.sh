@@ -0,0 +1,22 @@
+#!/bin/bash
+
+set -eux -o pipefail
+
+# Reads whose quality lines often start with '@', so the parallel indexer has
+# to tell them apart from headers where it splits the file. The file is large
+# enough to be split between several threads.
+python3 goldpolish_test_data.py --contig-length 100000 --coverage 25 goldpolish_index_test
+
+echo "Building the read index with 1 and 8 threads"
+
+goldpolish-index -t1 -p goldpolish_index_test.fq goldpolish_index_test.t1.index
+goldpolish-index -t8 -p goldpolish_index_test.fq goldpolish_index_test.t8.index
+
+if cmp -- goldpolish_index_test.t1.index goldpolish_index_test.t8.index && \
+   cmp -- goldpolish_index_test.t1.index.packed goldpolish_index_test.t8.index.packed; then
+  echo "Test successful"
+else
+  echo "Indexes built with 1 and 8 threads differ - please check your installation"
+  exit 1
+fi
+exit 0
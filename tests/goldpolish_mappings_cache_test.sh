@@ -0,0 +1,59 @@
+#!/bin/bash
+
+set -eux -o pipefail
+
+prefix=goldpolish_mappings_cache_test
+python3 goldpolish_test_data.py ${prefix}
+goldpolish-index ${prefix}.fa ${prefix}.fa.index
+goldpolish-index ${prefix}.fq ${prefix}.fq.index
+rm -f ${prefix}.paf.gpmap
+
+# Build the Bloom filters of all contigs with the mappings cached next to the
+# mappings file
+build_bfs() {
+  local out=$1
+  shift
+  rm -rf ${out}
+  python3 targeted_bfs_client.py \
+    --request "1 32,28 contig1 contig2 contig3 contig4" ${out} -- "$@" \
+    $(pwd)/${prefix}.fa $(pwd)/${prefix}.fa.index $(pwd)/${prefix}.paf \
+    $(pwd)/${prefix}.fq $(pwd)/${prefix}.fq.index 1000 1000 4 32 28
+}
+
+same_bfs() {
+  for bf in $1/*.bf; do
+    cmp -- ${bf} $2/${bf##*/} || return 1
+  done
+}
+
+echo "Building Bloom filters with cached mappings"
+
+build_bfs ${prefix}.first
+grep "Saving mappings to .*${prefix}.paf.gpmap" ${prefix}.first/builder.log
+test -s ${prefix}.paf.gpmap
+
+build_bfs ${prefix}.cached
+grep "Loaded [0-9]* mappings from .*${prefix}.paf.gpmap" ${prefix}.cached/builder.log
+same_bfs ${prefix}.first ${prefix}.cached
+
+# Trimming reads to their aligned part changes the cached mappings
+build_bfs ${prefix}.padded --padding=0
+grep "does not match the mappings. Rebuilding it." ${prefix}.padded/builder.log
+grep "Saving mappings to" ${prefix}.padded/builder.log
+if same_bfs ${prefix}.first ${prefix}.padded; then
+  echo "Changing the padding didn't change the Bloom filters"
+  exit 1
+fi
+
+build_bfs ${prefix}.padded_cached --padding=0
+grep "Loaded [0-9]* mappings from" ${prefix}.padded_cached/builder.log
+same_bfs ${prefix}.padded ${prefix}.padded_cached
+
+# So does changing the mappings file
+touch -t 202001010000 ${prefix}.paf
+build_bfs ${prefix}.touched --padding=0
+grep "does not match the mappings. Rebuilding it." ${prefix}.touched/builder.log
+same_bfs ${prefix}.padded ${prefix}.touched
+
+echo "Test successful"
+exit 0
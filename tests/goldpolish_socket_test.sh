@@ -0,0 +1,59 @@
+#!/bin/bash
+
+set -eux -o pipefail
+
+prefix=goldpolish_socket_test
+python3 goldpolish_test_data.py ${prefix}
+goldpolish-index ${prefix}.fa ${prefix}.fa.index
+goldpolish-index ${prefix}.fq ${prefix}.fq.index
+
+# Build the Bloom filters of the requested batches with the given number of
+# threads and keep the replies
+build_bfs() {
+  local out=$1 threads=$2
+  shift 2
+  rm -rf ${out}
+  python3 targeted_bfs_client.py "$@" ${out} -- --no-mappings-cache \
+    $(pwd)/${prefix}.fa $(pwd)/${prefix}.fa.index $(pwd)/${prefix}.paf \
+    $(pwd)/${prefix}.fq $(pwd)/${prefix}.fq.index 1000 1000 ${threads} 32 28 \
+    > ${out}.replies
+}
+
+same_bfs() {
+  for bf in $1/*.bf; do
+    cmp -- ${bf} $2/${bf##*/} || return 1
+  done
+}
+
+echo "Serving valid requests after malformed ones and clients that disconnect"
+
+build_bfs ${prefix}.valid 4 --request "1 32,28 contig1 contig2"
+
+for threads in 4 1; do
+  out=${prefix}.t${threads}
+  # A client that disconnects before its batch is done, one that disconnects
+  # partway through a request, and malformed requests between valid ones
+  build_bfs ${out} ${threads} --allow-errors \
+    --abandon "3 32,28 contig3 contig4" --partial "4 32,28 cont" \
+    --request "5 32,29 contig1" --request "6 32,28 nocontig" \
+    --request "7" --request "1 32,28 contig1 contig2"
+  same_bfs ${prefix}.valid ${out}
+
+  grep -x "5 error: asks for k = 29, which the builder was not started with." ${out}.replies
+  grep "^6 error: has an invalid target: " ${out}.replies
+  grep -x "7 error: has no k values." ${out}.replies
+  grep -c "^1 " ${out}.replies | grep -x 1
+  grep -c " error: " ${out}.replies | grep -x 3
+
+  # The abandoned batch is built and its reply dropped, and the partial
+  # request is never served
+  grep "Batch 3: " ${out}/builder.log
+  grep "Client is gone, dropping reply." ${out}/builder.log
+  if grep "Batch 4" ${out}/builder.log; then
+    echo "A partial request was served"
+    exit 1
+  fi
+done
+
+echo "Test successful"
+exit 0
@@ -0,0 +1,47 @@
+#!/bin/bash
+
+set -eux -o pipefail
+
+prefix=goldpolish_stream_mappings_test
+python3 goldpolish_test_data.py ${prefix}
+goldpolish-index ${prefix}.fa ${prefix}.fa.index
+goldpolish-index ${prefix}.fq ${prefix}.fq.index
+sort -s -t "$(printf '\t')" -k6,6 ${prefix}.paf > ${prefix}.sorted.paf
+
+# Build the Bloom filters of two batches with the given mappings and options
+build_bfs() {
+  local out=$1 mappings=$2
+  shift 2
+  rm -rf ${out}
+  python3 targeted_bfs_client.py \
+    --request "1 32,28 contig1 contig2" --request "2 32,28 contig3 contig4" \
+    ${out} -- --no-mappings-cache "$@" \
+    $(pwd)/${prefix}.fa $(pwd)/${prefix}.fa.index ${mappings} \
+    $(pwd)/${prefix}.fq $(pwd)/${prefix}.fq.index 1000 1000 4 32 28
+}
+
+same_bfs() {
+  for bf in $1/*.bf; do
+    cmp -- ${bf} $2/${bf##*/} || return 1
+  done
+}
+
+echo "Building Bloom filters from mappings streamed through stdin"
+
+build_bfs ${prefix}.file $(pwd)/${prefix}.paf
+cat ${prefix}.paf | build_bfs ${prefix}.stdin - --mappings-format=paf
+same_bfs ${prefix}.file ${prefix}.stdin
+
+# Targets are served as soon as their mappings are complete
+cat ${prefix}.sorted.paf | build_bfs ${prefix}.sorted - --mappings-format=paf --target-sorted
+same_bfs ${prefix}.file ${prefix}.sorted
+
+# Mappings that aren't sorted by target must be rejected
+if cat ${prefix}.paf | build_bfs ${prefix}.unsorted - --mappings-format=paf --target-sorted; then
+  echo "Mappings that aren't sorted by target were accepted"
+  exit 1
+fi
+grep "Mappings are not sorted by target, .* appears more than once." ${prefix}.unsorted/builder.log
+
+echo "Test successful"
+exit 0
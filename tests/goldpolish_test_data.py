@@ -0,0 +1,238 @@
+#!/usr/bin/env python3
+"""
+Write a small synthetic data set for the GoldPolish tests: draft contigs with
+errors, reads sampled from the sequence they were drafted from, and the
+alignments of the reads to the contigs as SAM and PAF. Sequences are on one
+line, as the sequence index requires.
+
+Reads have clipped flanks that don't align, and are on either strand, so the
+alignments have soft and hard clips on both ends. Some reads have runs of N,
+some are shorter than the k values used, some are unmapped, and some have
+secondary and supplementary alignments too. Quality lines often start with
+'@', like the read headers of FASTQ files.
+"""
+
+import argparse
+import random
+
+BASES = "ACGT"
+COMPLEMENTS = str.maketrans("ACGTN", "TGCAN")
+DRAFT_ERROR_RATE = 0.005
+READ_ERROR_RATE = 0.01
+MAX_CLIP = 200
+SHORT_READ_RATE = 0.02
+N_RUN_RATE = 0.05
+UNMAPPED_RATE = 0.02
+SECONDARY_RATE = 0.1
+SUPPLEMENTARY_RATE = 0.05
+QUAL_AT_START_RATE = 0.3
+MIN_PHRED = 2
+MAX_PHRED = 40
+PHRED_OFFSET = 33
+QUAL_CHARS = [chr(PHRED_OFFSET + phred) for phred in range(MIN_PHRED, MAX_PHRED + 1)]
+
+
+def get_cli_args():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument(
+        "prefix",
+        help="Writes prefix.fa, prefix.fq, prefix.sam and prefix.paf.",
+    )
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--contigs", type=int, default=4)
+    parser.add_argument("--contig-length", type=int, default=20000)
+    parser.add_argument("--coverage", type=float, default=30)
+    parser.add_argument("--read-length", type=int, default=2000)
+    return parser.parse_args()
+
+
+def reverse_complement(seq):
+    return seq.translate(COMPLEMENTS)[::-1]
+
+
+def random_seq(rng, length):
+    return "".join(rng.choices(BASES, k=length))
+
+
+def add_errors(rng, seq, rate):
+    seq = list(seq)
+    for _ in range(int(len(seq) * rate)):
+        i = rng.randrange(len(seq))
+        seq[i] = rng.choice(BASES.replace(seq[i], ""))
+    return "".join(seq)
+
+
+def write_fasta(path, seqs):
+    with open(path, "w") as f:
+        for name, seq in seqs:
+            print(f">{name}\n{seq}", file=f)
+
+
+def random_qual(rng, length):
+    qual = "".join(rng.choices(QUAL_CHARS, k=length))
+    if length > 0 and rng.random() < QUAL_AT_START_RATE:
+        qual = "@" + qual[1:]
+    return qual
+
+
+def cigar_clip(rng, length):
+    return "" if length == 0 else f"{length}{rng.choice('SH')}"
+
+
+def make_read(rng, contigs, read_length):
+    """Returns a read and its alignments as (flag, contig index, start, length,
+    leading clip, trailing clip), with clips on the read as sequenced."""
+    contig_idx = rng.randrange(len(contigs))
+    genome = contigs[contig_idx][1]
+    if rng.random() < SHORT_READ_RATE:
+        length = rng.randint(1, 30)
+    else:
+        length = rng.randint(read_length // 2, read_length * 3 // 2)
+    length = min(length, len(genome))
+    start = rng.randrange(len(genome) - length + 1)
+    leading, trailing = rng.randint(0, MAX_CLIP), rng.randint(0, MAX_CLIP)
+    read = (
+        random_seq(rng, leading)
+        + add_errors(rng, genome[start : start + length], READ_ERROR_RATE)
+        + random_seq(rng, trailing)
+    )
+    if rng.random() < N_RUN_RATE:
+        run_length = rng.randint(1, 50)
+        run_start = rng.choice(
+            [0, len(read) - run_length, rng.randrange(len(read))]
+        )
+        run_start = max(run_start, 0)
+        read = read[:run_start] + "N" * run_length + read[run_start + run_length :]
+        read = read[: leading + length + trailing]
+
+    reverse = rng.random() < 0.5
+    if reverse:
+        read = reverse_complement(read)
+        leading, trailing = trailing, leading
+    if rng.random() < UNMAPPED_RATE:
+        return read, []
+
+    flag = 16 if reverse else 0
+    alignments = [(flag, contig_idx, start, length, leading, trailing)]
+    if rng.random() < SECONDARY_RATE:
+        other_idx = rng.randrange(len(contigs))
+        other_start = rng.randrange(len(contigs[other_idx][1]) - length + 1)
+        alignments.append(
+            (flag | 0x100, other_idx, other_start, length, leading, trailing)
+        )
+    if rng.random() < SUPPLEMENTARY_RATE and length > 1:
+        # The first half of the aligned bases, aligned elsewhere
+        other_idx = rng.randrange(len(contigs))
+        half = length // 2
+        other_start = rng.randrange(len(contigs[other_idx][1]) - half + 1)
+        alignments.append(
+            (
+                flag | 0x800,
+                other_idx,
+                other_start,
+                half,
+                leading,
+                trailing + length - half,
+            )
+        )
+    return read, alignments
+
+
+def sam_record(rng, name, read, qual, contigs, alignment):
+    flag, contig_idx, start, length, leading, trailing = alignment
+    reverse = (flag & 16) != 0
+    # SAM sequences and CIGARs are on the reference strand
+    seq = reverse_complement(read) if reverse else read
+    qual = qual[::-1] if reverse else qual
+    if reverse:
+        leading, trailing = trailing, leading
+    leading_op, trailing_op = cigar_clip(rng, leading), cigar_clip(rng, trailing)
+    seq_start = leading if leading_op.endswith("H") else 0
+    seq_end = len(seq) - (trailing if trailing_op.endswith("H") else 0)
+    if (flag & 0x100) != 0:
+        seq, qual = "*", "*"
+    else:
+        seq, qual = seq[seq_start:seq_end], qual[seq_start:seq_end]
+    cigar = f"{leading_op}{length}M{trailing_op}"
+    return "\t".join(
+        [
+            name,
+            str(flag),
+            contigs[contig_idx][0],
+            str(start + 1),
+            "60",
+            cigar,
+            "*",
+            "0",
+            "0",
+            seq,
+            qual,
+        ]
+    )
+
+
+def paf_record(name, read, contigs, alignment):
+    flag, contig_idx, start, length, leading, _ = alignment
+    contig_name, contig_seq = contigs[contig_idx]
+    return "\t".join(
+        [
+            name,
+            str(len(read)),
+            str(leading),
+            str(leading + length),
+            "-" if (flag & 16) != 0 else "+",
+            contig_name,
+            str(len(contig_seq)),
+            str(start),
+            str(start + length),
+            str(length),
+            str(length),
+            "60",
+            "tp:A:" + ("S" if (flag & 0x100) != 0 else "P"),
+        ]
+    )
+
+
+def main():
+    args = get_cli_args()
+    rng = random.Random(args.seed)
+
+    contigs = [
+        (f"contig{i + 1}", random_seq(rng, args.contig_length))
+        for i in range(args.contigs)
+    ]
+    write_fasta(
+        f"{args.prefix}.fa",
+        [(name, add_errors(rng, seq, DRAFT_ERROR_RATE)) for name, seq in contigs],
+    )
+
+    read_num = int(
+        args.coverage * args.contigs * args.contig_length / args.read_length
+    )
+    with open(f"{args.prefix}.fq", "w") as fq, open(
+        f"{args.prefix}.sam", "w"
+    ) as sam, open(f"{args.prefix}.paf", "w") as paf:
+        print("@HD\tVN:1.6\tSO:unsorted", file=sam)
+        for name, seq in contigs:
+            print(f"@SQ\tSN:{name}\tLN:{len(seq)}", file=sam)
+        print("@PG\tID:goldpolish_test_data\tPN:goldpolish_test_data", file=sam)
+
+        for i in range(read_num):
+            name = f"read{i + 1}"
+            read, alignments = make_read(rng, contigs, args.read_length)
+            qual = random_qual(rng, len(read))
+            print(f"@{name}\n{read}\n+\n{qual}", file=fq)
+            if not alignments:
+                print(
+                    "\t".join(
+                        [name, "4", "*", "0", "0", "*", "*", "0", "0", read, qual]
+                    ),
+                    file=sam,
+                )
+            for alignment in alignments:
+                print(sam_record(rng, name, read, qual, contigs, alignment), file=sam)
+                print(paf_record(name, read, contigs, alignment), file=paf)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,56 @@
+#!/bin/bash
+
+set -eux -o pipefail
+
+prefix=goldpolish_window_test
+python3 goldpolish_test_data.py ${prefix}
+
+# Name of each sequence in a FASTA file, in order
+seq_names() {
+  grep "^>" $1 | cut -d " " -f 1
+}
+
+echo "Launching GoldPolish with and without windows smaller than the contigs"
+
+goldpolish --mappings ${prefix}.paf ${prefix}.fa ${prefix}.fq ${prefix}.polished.fa
+# The 20 kbp contigs are split into 4 windows each. With a batch size of 3,
+# windows of a contig are polished in different batches.
+goldpolish --mappings ${prefix}.paf --window-length 6000 --window-overlap 500 \
+  ${prefix}.fa ${prefix}.fq ${prefix}.windows.polished.fa
+goldpolish --mappings ${prefix}.paf --window-length 6000 --window-overlap 500 -b 3 \
+  ${prefix}.fa ${prefix}.fq ${prefix}.windows_b3.polished.fa
+
+seq_names ${prefix}.fa > ${prefix}.names
+for out in polished windows.polished windows_b3.polished; do
+  seq_names ${prefix}.${out}.fa > ${prefix}.${out}.names
+  if ! cmp -- ${prefix}.names ${prefix}.${out}.names; then
+    echo "The contigs of ${prefix}.${out}.fa aren't named or ordered as in ${prefix}.fa"
+    exit 1
+  fi
+done
+
+# Windows are joined back into contigs of about the same length
+python3 - ${prefix}.polished.fa ${prefix}.windows.polished.fa ${prefix}.windows_b3.polished.fa <<'PYTHON'
+import sys
+
+
+def seq_lens(filepath):
+    lens = []
+    with open(filepath) as fasta:
+        for line in fasta:
+            if line.startswith(">"):
+                lens.append(0)
+            else:
+                lens[-1] += len(line.strip())
+    return lens
+
+
+expected = seq_lens(sys.argv[1])
+for filepath in sys.argv[2:]:
+    for expected_len, seq_len in zip(expected, seq_lens(filepath)):
+        if abs(seq_len - expected_len) > expected_len // 100:
+            sys.exit(f"A contig of {filepath} is {seq_len} bp instead of about {expected_len} bp")
+PYTHON
+
+echo "Test successful"
+exit 0
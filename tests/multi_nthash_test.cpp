@@ -0,0 +1,103 @@
+#include "utils.hpp"
+
+#include "btllib/nthash.hpp"
+#include "btllib/status.hpp"
+
+#include <cstdint>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+static const unsigned HASH_NUM = 3;
+static const std::vector<unsigned> K_VALUES = { 32, 1, 28, 24, 5, 20, 64 };
+static const size_t RANDOM_SEQS = 100;
+static const size_t MAX_RANDOM_SEQ_LEN = 300;
+
+// Hashes of every k-mer of seq, by position
+using KmerHashes = std::map<size_t, std::vector<uint64_t>>;
+
+static void
+check_seq(const std::string& seq)
+{
+  std::vector<KmerHashes> expected(K_VALUES.size());
+  for (size_t i = 0; i < K_VALUES.size(); i++) {
+    btllib::NtHash nthash(seq.data(), seq.size(), HASH_NUM, K_VALUES[i]);
+    while (nthash.roll()) {
+      expected[i][nthash.get_pos()] = std::vector<uint64_t>(
+        nthash.hashes(), nthash.hashes() + HASH_NUM);
+    }
+  }
+
+  std::vector<KmerHashes> rolled(K_VALUES.size());
+  MultiNtHash nthash(seq.data(), seq.size(), HASH_NUM, K_VALUES);
+  size_t last_pos = 0;
+  bool first = true;
+  while (nthash.roll()) {
+    btllib::check_error(!first && nthash.get_pos() <= last_pos,
+                        "MultiNtHash went back from position " +
+                          std::to_string(last_pos) + " in " + seq + ".");
+    bool any = false;
+    for (size_t i = 0; i < K_VALUES.size(); i++) {
+      if (nthash.has_hashes(i)) {
+        rolled[i][nthash.get_pos()] = std::vector<uint64_t>(
+          nthash.hashes(i), nthash.hashes(i) + HASH_NUM);
+        any = true;
+      }
+    }
+    btllib::check_error(!any,
+                        "MultiNtHash stopped at position " +
+                          std::to_string(nthash.get_pos()) +
+                          " without hashes in " + seq + ".");
+    last_pos = nthash.get_pos();
+    first = false;
+  }
+
+  for (size_t i = 0; i < K_VALUES.size(); i++) {
+    btllib::check_error(rolled[i] != expected[i],
+                        "MultiNtHash hashes for k = " +
+                          std::to_string(K_VALUES[i]) + " of " + seq +
+                          " differ from btllib::NtHash's.");
+  }
+}
+
+int
+main()
+{
+  static const std::string BASES = "ACGTacgt";
+  std::mt19937 rng(1); // NOLINT(cert-msc32-c,cert-msc51-cpp)
+
+  const auto random_seq = [&](const size_t len) {
+    std::string seq;
+    for (size_t i = 0; i < len; i++) {
+      seq += BASES[rng() % BASES.size()];
+    }
+    return seq;
+  };
+
+  // Shorter than some or all k values, and runs of N at the start, in the
+  // middle and at the end
+  check_seq("");
+  check_seq("A");
+  check_seq("N");
+  check_seq(random_seq(4));
+  check_seq(random_seq(27));
+  check_seq(random_seq(63));
+  check_seq(random_seq(64));
+  check_seq(std::string(100, 'N'));
+  check_seq("NNNN" + random_seq(100));
+  check_seq(random_seq(100) + "NNNN");
+  check_seq(random_seq(30) + "N" + random_seq(30) + "NNNNN" + random_seq(70));
+  check_seq(random_seq(10) + "N" + random_seq(10) + "N" + random_seq(10));
+
+  for (size_t i = 0; i < RANDOM_SEQS; i++) {
+    auto seq = random_seq(rng() % MAX_RANDOM_SEQ_LEN);
+    for (auto runs = rng() % 4; runs > 0 && !seq.empty(); runs--) {
+      const auto start = rng() % seq.size();
+      seq.replace(start, 1 + rng() % 40, 1 + rng() % 40, 'N');
+    }
+    check_seq(seq);
+  }
+
+  return 0;
+}
@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+"""
+Convert a SAM file to BAM, with BGZF blocks of at most --block-size
+uncompressed bytes, so that small test files span many blocks. Only the
+fields that BAM mappings are read from are required to be valid.
+
+With --corrupt-block, one byte of the compressed data of that block is
+flipped, to test that corrupt files are rejected.
+"""
+
+import argparse
+import re
+import struct
+import zlib
+
+CIGAR_OPS = "MIDNSHP=X"
+SEQ_CODES = "=ACMGRSVTWYHKDBN"
+MAX_BLOCK_SIZE = 0xFF00
+BGZF_HEADER = struct.Struct("<BBBBIBBHBBHH")
+# Empty block marking the end of a BGZF file
+BGZF_EOF = bytes.fromhex("1f8b08040000000000ff0600424302001b0003000000000000000000")
+# Bin of records without coordinates, which isn't used for mappings
+UNMAPPED_BIN = 4680
+
+
+def get_cli_args():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("sam")
+    parser.add_argument("bam")
+    parser.add_argument("--block-size", type=int, default=MAX_BLOCK_SIZE)
+    parser.add_argument("--corrupt-block", type=int, default=-1)
+    return parser.parse_args()
+
+
+def bgzf_block(data, corrupt):
+    compressor = zlib.compressobj(6, zlib.DEFLATED, -15)
+    compressed = bytearray(compressor.compress(data) + compressor.flush())
+    if corrupt:
+        compressed[len(compressed) // 2] ^= 0xFF
+    block_size = BGZF_HEADER.size + len(compressed) + 8
+    return (
+        BGZF_HEADER.pack(31, 139, 8, 4, 0, 0, 255, 6, 66, 67, 2, block_size - 1)
+        + compressed
+        + struct.pack("<II", zlib.crc32(data), len(data))
+    )
+
+
+def bam_record(fields, ref_ids):
+    name, flag, ref, pos, mapq, cigar, _, _, _, seq, qual = fields[:11]
+    ops = [
+        (int(length) << 4) | CIGAR_OPS.index(op)
+        for length, op in re.findall(r"(\d+)([MIDNSHP=X])", cigar)
+    ]
+    seq = "" if seq == "*" else seq
+    packed_seq = bytearray((len(seq) + 1) // 2)
+    for i, base in enumerate(seq):
+        code = SEQ_CODES.find(base.upper())
+        packed_seq[i // 2] |= (15 if code < 0 else code) << (4 if i % 2 == 0 else 0)
+    quals = b"\xff" * len(seq) if qual == "*" else bytes(ord(c) - 33 for c in qual)
+    read_name = name.encode() + b"\0"
+    record = (
+        struct.pack(
+            "<iiBBHHHiiii",
+            ref_ids.get(ref, -1),
+            int(pos) - 1,
+            len(read_name),
+            int(mapq),
+            UNMAPPED_BIN,
+            len(ops),
+            int(flag),
+            len(seq),
+            -1,
+            -1,
+            0,
+        )
+        + read_name
+        + b"".join(struct.pack("<I", op) for op in ops)
+        + bytes(packed_seq)
+        + quals
+    )
+    return struct.pack("<i", len(record)) + record
+
+
+def main():
+    args = get_cli_args()
+    header, refs, records = "", [], []
+    with open(args.sam) as sam:
+        for line in sam:
+            if line.startswith("@"):
+                header += line
+                if line.startswith("@SQ"):
+                    tags = dict(tag.split(":", 1) for tag in line.split()[1:])
+                    refs.append((tags["SN"], int(tags["LN"])))
+                continue
+            records.append(line.rstrip("\n").split("\t"))
+
+    data = bytearray(b"BAM\1")
+    data += struct.pack("<i", len(header)) + header.encode()
+    data += struct.pack("<i", len(refs))
+    for name, length in refs:
+        data += struct.pack("<i", len(name) + 1) + name.encode() + b"\0"
+        data += struct.pack("<i", length)
+    ref_ids = {name: i for i, (name, _) in enumerate(refs)}
+    for fields in records:
+        data += bam_record(fields, ref_ids)
+
+    block_size = min(args.block_size, MAX_BLOCK_SIZE)
+    with open(args.bam, "wb") as bam:
+        for i, start in enumerate(range(0, len(data), block_size)):
+            bam.write(
+                bgzf_block(
+                    bytes(data[start : start + block_size]), i == args.corrupt_block
+                )
+            )
+        bam.write(BGZF_EOF)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,112 @@
+#include "seqindex.hpp"
+
+#include "btllib/status.hpp"
+
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+static const std::string SEQS_FILEPATH = "seqindex_test.fa";
+static const std::string INDEX_FILEPATH = "seqindex_test.fa.index";
+static const unsigned THREADS = 2;
+static const size_t RANDOM_SEQ_LEN = 1000;
+static const unsigned RANDOM_RANGES = 10000;
+
+// Sequences as the packed store serves them: uppercase, with every base other
+// than A, C, G and T turned into N
+static std::string
+packed_form(const std::string& seq)
+{
+  std::string result;
+  for (const auto c : seq) {
+    const auto upper = char(std::toupper(static_cast<unsigned char>(c)));
+    result +=
+      std::string("ACGT").find(upper) == std::string::npos ? 'N' : upper;
+  }
+  return result;
+}
+
+int
+main()
+{
+  static const std::string BASES = "ACGTacgtNnRYSWKMBDHVryswkmbdhv.-";
+  std::mt19937 rng(1); // NOLINT(cert-msc32-c,cert-msc51-cpp)
+  std::string random_seq;
+  for (size_t i = 0; i < RANDOM_SEQ_LEN; i++) {
+    // Mostly ACGT, with runs of other bases every so often
+    if (rng() % 8 == 0) {
+      random_seq += std::string(1 + rng() % 20, BASES[rng() % BASES.size()]);
+    } else {
+      random_seq += BASES[rng() % 8];
+    }
+  }
+
+  const std::vector<std::pair<std::string, std::string>> seqs = {
+    { "n_runs_at_ends", "NNNNACGTACGTTGCANNNNN" },
+    { "n_run_at_start", "NACGTACG" },
+    { "n_run_at_end", "ACGTACGN" },
+    { "all_n", "NNNNNNNNNN" },
+    { "lowercase", "acgtacgtaaccggttACGTacgt" },
+    { "iupac", "ACRYSWKMBDHVNacgtryswkmbdhvnACGT" },
+    { "single_base", "g" },
+    { "single_n", "n" },
+    { "random", random_seq },
+  };
+
+  std::ofstream seqs_file(SEQS_FILEPATH);
+  for (const auto& seq : seqs) {
+    seqs_file << '>' << seq.first << '\n' << seq.second << '\n';
+  }
+  seqs_file.close();
+
+  {
+    SeqIndex index(SEQS_FILEPATH, THREADS);
+    index.save(INDEX_FILEPATH);
+    index.save_packed(INDEX_FILEPATH, THREADS);
+  }
+
+  const SeqIndex index(INDEX_FILEPATH, SEQS_FILEPATH);
+  std::string buffer;
+  for (const auto& seq : seqs) {
+    const auto id = index.get_seq_id(seq.first);
+    btllib::check_error(id == INVALID_SEQ_ID, seq.first + " is not indexed.");
+    const auto expected = packed_form(seq.second);
+    btllib::check_error(index.get_seq_len(id) != expected.size(),
+                        seq.first + " has the wrong length.");
+    btllib::check_error(std::string(index.get_seq(id, buffer)) != expected,
+                        seq.first + " is unpacked as " +
+                          std::string(index.get_seq(id, buffer)) +
+                          " instead of " + expected + ".");
+
+    // Every range of the short sequences, and random ranges of the long one
+    const auto check_range = [&](const size_t start, const size_t len) {
+      const auto unpacked = std::string(index.get_seq(id, start, len, buffer));
+      btllib::check_error(unpacked != expected.substr(start, len),
+                          seq.first + " bases [" + std::to_string(start) +
+                            ", " + std::to_string(start + len) +
+                            ") are unpacked as " + unpacked + " instead of " +
+                            expected.substr(start, len) + ".");
+    };
+    if (expected.size() < RANDOM_SEQ_LEN) {
+      for (size_t start = 0; start <= expected.size(); start++) {
+        for (size_t len = 0; start + len <= expected.size(); len++) {
+          check_range(start, len);
+        }
+      }
+    } else {
+      for (unsigned i = 0; i < RANDOM_RANGES; i++) {
+        const auto start = rng() % (expected.size() + 1);
+        check_range(start, rng() % (expected.size() - start + 1));
+      }
+    }
+  }
+
+  std::remove(SEQS_FILEPATH.c_str());
+  std::remove(INDEX_FILEPATH.c_str());
+  std::remove((INDEX_FILEPATH + PACKED_SEQS_EXTENSION).c_str());
+  return 0;
+}
@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+"""
+Run goldpolish-targeted-bfs in a directory with the given arguments, send it
+batch requests over its socket, print its replies in the order they arrive,
+and end it. Exits with an error if the builder fails, or if it replies with an
+error unless --allow-errors is given. The Bloom filters are left in the directory; filters passed as memory
+files are copied there under their names.
+
+Before the requests, each --abandon request and --partial text is sent by a
+client of its own, which disconnects without waiting for a reply.
+
+Usage: targeted_bfs_client.py [--request REQUEST]... [--abandon REQUEST]...
+                              [--partial TEXT]... [--allow-errors]
+                              dir -- builder_args...
+"""
+
+import argparse
+import os
+import socket
+import subprocess as sp
+import sys
+import time
+
+GOLDPOLISH_TARGETED_BFS = "goldpolish-targeted-bfs"
+SOCKET_NAME = "bfs.sock"
+END_SYMBOL = "x"
+ERROR_REPLY = "error:"
+MEMORY_FILES_REPLY = "fd:"
+REPLY_BYTES = 65536
+MAX_FDS = 256
+CONNECT_TIMEOUT = 60
+CONNECT_INTERVAL = 0.1
+
+
+def start_builder(directory, builder_args, stdin=None):
+    """Start the builder serving requests at SOCKET_NAME in directory."""
+    os.makedirs(directory, exist_ok=True)
+    log = open(os.path.join(directory, "builder.log"), "w")
+    return sp.Popen(
+        [GOLDPOLISH_TARGETED_BFS, f"--socket={SOCKET_NAME}"] + builder_args,
+        cwd=directory,
+        stdin=stdin,
+        stdout=sp.DEVNULL,
+        stderr=log,
+    )
+
+
+def connect(directory, builder):
+    """Connect to the builder started in directory, once it accepts
+    connections."""
+    address = os.path.relpath(os.path.join(directory, SOCKET_NAME))
+    deadline = time.monotonic() + CONNECT_TIMEOUT
+    while True:
+        connection = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        try:
+            connection.connect(address)
+            return connection
+        except (FileNotFoundError, ConnectionRefusedError):
+            connection.close()
+            if builder.poll() is not None:
+                sys.exit(f"{GOLDPOLISH_TARGETED_BFS} exited with {builder.returncode}")
+            if time.monotonic() > deadline:
+                sys.exit(f"{GOLDPOLISH_TARGETED_BFS} didn't open its socket")
+            time.sleep(CONNECT_INTERVAL)
+
+
+def save_memory_files(directory, names, fds):
+    """Copy the filters passed as memory files to their names in directory and
+    close their descriptors."""
+    for name, fd in zip(names, fds):
+        with os.fdopen(fd, "rb") as memory_file, open(
+            os.path.join(directory, name), "wb"
+        ) as bf:
+            memory_file.seek(0)
+            bf.write(memory_file.read())
+
+
+def request(directory, builder, requests):
+    """Send requests on one connection and return their replies, in the order
+    they arrive."""
+    connection = connect(directory, builder)
+    connection.sendall("".join(f"{line}\n" for line in requests).encode())
+    connection.shutdown(socket.SHUT_WR)
+    expected = sum(1 for line in requests if line.split()[0] != END_SYMBOL)
+    replies = []
+    received = b""
+    fds = []
+    while len(replies) < expected:
+        data, new_fds, _, _ = socket.recv_fds(connection, REPLY_BYTES, MAX_FDS)
+        fds += new_fds
+        if not data:
+            sys.exit(f"{GOLDPOLISH_TARGETED_BFS} closed the connection")
+        received += data
+        while b"\n" in received and len(replies) < expected:
+            reply, received = received.split(b"\n", 1)
+            reply = reply.decode()
+            fields = reply.split()
+            if fields[1:2] == [MEMORY_FILES_REPLY]:
+                names = fields[2:]
+                if len(fds) < len(names):
+                    sys.exit(f"{GOLDPOLISH_TARGETED_BFS} didn't pass all filters")
+                save_memory_files(directory, names, fds[: len(names)])
+                fds = fds[len(names) :]
+            replies.append(reply)
+    connection.close()
+    return replies
+
+
+def abandon(directory, builder, text):
+    """Send text from a client that disconnects right away."""
+    connection = connect(directory, builder)
+    connection.sendall(text.encode())
+    connection.close()
+
+
+def end_builder(directory, builder):
+    """End the builder once it has served its clients and return its exit
+    status."""
+    request(directory, builder, [END_SYMBOL])
+    return builder.wait()
+
+
+def get_cli_args():
+    parser = argparse.ArgumentParser(
+        description="Run goldpolish-targeted-bfs and request Bloom filters from it."
+    )
+    parser.add_argument("--request", action="append", default=[])
+    parser.add_argument("--abandon", action="append", default=[])
+    parser.add_argument("--partial", action="append", default=[])
+    parser.add_argument("--allow-errors", action="store_true")
+    parser.add_argument("dir")
+    parser.add_argument("builder_args", nargs=argparse.REMAINDER)
+    args = parser.parse_args()
+    if args.builder_args[:1] == ["--"]:
+        args.builder_args = args.builder_args[1:]
+    return args
+
+
+def main():
+    args = get_cli_args()
+    builder = start_builder(args.dir, args.builder_args)
+    for line in args.abandon:
+        abandon(args.dir, builder, f"{line}\n")
+    for text in args.partial:
+        abandon(args.dir, builder, text)
+    replies = request(args.dir, builder, args.request)
+    for reply in replies:
+        print(reply)
+    if end_builder(args.dir, builder) != 0:
+        sys.exit(f"{GOLDPOLISH_TARGETED_BFS} exited with {builder.returncode}")
+    if not args.allow_errors and any(
+        reply.split()[1:2] == [ERROR_REPLY] for reply in replies
+    ):
+        sys.exit(f"{GOLDPOLISH_TARGETED_BFS} failed a request")
+
+
+if __name__ == "__main__":
+    main()